@@ -10,7 +10,10 @@
 #include "unicode_escape.h"
 #include "utf8.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cwctype>
+#include <functional>
 #include <fstream>
 #include <iostream>
 #include <regex>
@@ -39,14 +42,26 @@ std::ostream& operator<<(std::ostream& os, const AtomicUnicodeHistogram::auh_t::
  */
 std::vector<AtomicUnicodeHistogram::auh_t::item> AtomicUnicodeHistogram::makeReport(size_t topN)
 {
-    const std::lock_guard<std::mutex> lock(M);
-    std::vector<AtomicUnicodeHistogram::auh_t::item> ret = h.items();
-
-    std::sort(ret.begin(), ret.end(), AtomicUnicodeHistogram::histogram_compare); // reverse sort
+    merge_thread_local();
+    std::vector<AtomicUnicodeHistogram::auh_t::item> ret;
+    ret.reserve(size());
+    if (topk) {
+        topk->items(ret);
+        if (topN == 0 || topN > def.approximate_top_n) topN = def.approximate_top_n;
+    }
+    for (auto& stripe : stripes) {
+        const std::lock_guard<std::mutex> lock(stripe.M);
+        for (auto& e : stripe.entries) {
+            ret.push_back(auh_t::item(e.key, &e.tally));
+        }
+    }
 
-    /* If we only want some of them, delete the extra */
+    /* If we only want some of them, only sort those */
     if ((topN > 0) && (topN < ret.size())) {
+        std::partial_sort(ret.begin(), ret.begin() + topN, ret.end(), AtomicUnicodeHistogram::histogram_compare);
         ret.erase( ret.begin()+topN, ret.end());
+    } else {
+        std::sort(ret.begin(), ret.end(), AtomicUnicodeHistogram::histogram_compare); // reverse sort
     }
     return ret;
 }
@@ -69,8 +84,96 @@ std::vector<AtomicUnicodeHistogram::auh_t::item> AtomicUnicodeHistogram::makeRep
 uint32_t AtomicUnicodeHistogram::debug_histogram_malloc_fail_frequency = 0;
 void AtomicUnicodeHistogram::clear()
 {
-    const std::lock_guard<std::mutex> lock(M);
-    h.clear();
+    if (topk) topk->clear();
+    {
+        const std::lock_guard<std::mutex> lock(Mlocal);
+        for (auto& lt : local_tables) {
+            const std::lock_guard<std::mutex> lock2(lt->M);
+            lt->counts.clear();
+            lt->key_bytes = 0;
+        }
+    }
+    for (auto& stripe : stripes) {
+        const std::lock_guard<std::mutex> lock(stripe.M);
+        for (const auto& e : stripe.entries) key_bytes -= e.key.size();
+        entry_count -= stripe.entries.size();
+        stripe.entries.clear();
+        stripe.slots.clear();
+    }
+}
+
+std::vector<AtomicUnicodeHistogram::run_entry_t> AtomicUnicodeHistogram::drain()
+{
+    std::vector<run_entry_t> ret;
+    if (topk) return ret;
+    merge_thread_local();
+    ret.reserve(size());
+    for (auto& stripe : stripes) {
+        std::deque<Entry> entries;
+        {
+            const std::lock_guard<std::mutex> lock(stripe.M);
+            entries.swap(stripe.entries);
+            std::vector<Slot>().swap(stripe.slots);
+            entry_count -= entries.size();
+        }
+        for (auto& e : entries) {
+            key_bytes -= e.key.size();
+            ret.emplace_back(std::move(e.key), e.tally);
+        }
+    }
+    std::sort(ret.begin(), ret.end(), [](const run_entry_t& a, const run_entry_t& b) { return a.first < b.first; });
+    return ret;
+}
+
+/* std::hash is not guaranteed to mix its high bits, which select the stripe; finish with the splitmix64 finalizer. */
+uint64_t AtomicUnicodeHistogram::key_hash(const std::string& key)
+{
+    uint64_t z = std::hash<std::string>{}(key);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Double the table (or create it) and re-insert the entries using their stored hashes.
+ * Caller must hold M.
+ */
+void AtomicUnicodeHistogram::Stripe::grow()
+{
+    std::vector<Slot> nslots(slots.size() ? slots.size() * 2 : 64);
+    const size_t mask = nslots.size() - 1;
+    for (const auto& slot : slots) {
+        if (slot.index == Slot::EMPTY) continue;
+        size_t i = slot.hash32 & mask;
+        while (nslots[i].index != Slot::EMPTY) i = (i + 1) & mask;
+        nslots[i] = slot;
+    }
+    slots.swap(nslots);
+}
+
+/* Return the tally for key, adding it if necessary, with one probe sequence.
+ * Caller must hold M.
+ */
+AtomicUnicodeHistogram::HistogramTally& AtomicUnicodeHistogram::Stripe::find_or_insert(const std::string& key, uint32_t hash32)
+{
+    if (slots.empty()) grow();
+    const size_t mask = slots.size() - 1;
+    for (size_t i = hash32 & mask;; i = (i + 1) & mask) {
+        Slot& slot = slots[i];
+        if (slot.index == Slot::EMPTY) {
+            /* keep the load factor under 1/2 */
+            if ((entries.size() + 1) * 2 > slots.size()) {
+                grow();
+                return find_or_insert(key, hash32);
+            }
+            entries.emplace_back(key);
+            slot.hash32 = hash32;
+            slot.index  = entries.size() - 1;
+            return entries.back().tally;
+        }
+        if (slot.hash32 == hash32 && entries[slot.index].key == key) {
+            return entries[slot.index].tally;
+        }
+    }
 }
 
 // low-level add after key has been converted to UTF8
@@ -78,52 +181,143 @@ void AtomicUnicodeHistogram::add0(const std::string& u8key, const std::string &c
 {
     std::string displayString;
 
-    if (def.match(u8key, &displayString, context)) {
-
+    if (make_key(u8key, context, displayString)) {
         if (debug) std::cerr << "  AtomicUnicodeHistogram::add0 match u8key=" << u8key << std::endl;
+        add_key(displayString, found_utf16);
+    }
+}
 
-        /* Escape as necessary */
-        displayString = validateOrEscapeUTF8(displayString, true, true, false);
+bool AtomicUnicodeHistogram::make_key(const std::string& u8key, const std::string &context, std::string &displayString) const
+{
+    if (!matcher.match(u8key, &displayString, context)) return false;
 
-        /* For debugging low-memory handling logic,
-         * specify DEBUG_MALLOC_FAIL to make malloc occasionally fail (not yet implemented)
-         */
-        if (debug_histogram_malloc_fail_frequency) {
-            const std::lock_guard<std::mutex> lock(M);
-            if ((h.size() % debug_histogram_malloc_fail_frequency) == (debug_histogram_malloc_fail_frequency - 1)) {
-                throw std::bad_alloc();
-            }
+    /* Escape as necessary */
+    displayString = validateOrEscapeUTF8(displayString, true, true, false);
+    return true;
+}
+
+void AtomicUnicodeHistogram::add_key(const std::string& displayString, bool found_utf16)
+{
+    /* For debugging low-memory handling logic,
+     * specify DEBUG_MALLOC_FAIL to make malloc occasionally fail (not yet implemented)
+     */
+    if (debug_histogram_malloc_fail_frequency) {
+        if ((entry_count % debug_histogram_malloc_fail_frequency) == (debug_histogram_malloc_fail_frequency - 1)) {
+            throw std::bad_alloc();
         }
+    }
 
-        /* Add the key to the histogram. Note that this is threadsafe */
-        const std::lock_guard<std::mutex> lock(M);
-        h[displayString].count++;
-        if (found_utf16) {
-            h[displayString].count16++; // track how many UTF16s were converted
+    const size_t threshold = thread_local_threshold;
+    if (threshold > 0) {
+        LocalTable& lt = local_table();
+        const std::lock_guard<std::mutex> lock(lt.M);
+        auto it = lt.counts.find(displayString);
+        if (it == lt.counts.end()) {
+            it = lt.counts.emplace(displayString, HistogramTally()).first;
+            lt.key_bytes += displayString.size();
         }
-        if (debug) std::cerr << "  AtomicUnicodeHistogram::add0 h[" <<displayString << "].count=" << h[displayString].count << std::endl;
+        it->second.count++;
+        if (found_utf16) it->second.count16++;
+        if (lt.counts.size() >= threshold) merge_local(lt);
+        return;
     }
+
+    add_tally(displayString, 1, found_utf16 ? 1 : 0);
+    if (debug) std::cerr << "  AtomicUnicodeHistogram::add_key " << displayString << std::endl;
 }
 
-void AtomicUnicodeHistogram::add_feature_context(const std::string& key_unknown_encoding, const std::string& context)
+/* Add counts to a key. Only the key's stripe is locked. */
+void AtomicUnicodeHistogram::add_tally(const std::string& key, uint32_t count, uint32_t count16)
 {
-    if (key_unknown_encoding.size() == 0) return; // don't deal with zero-length keys
+    const uint64_t hash = key_hash(key);
+    if (topk) {
+        topk->add(key, hash, count, count16);
+        return;
+    }
+    Stripe& stripe = stripes[hash >> 60 & (STRIPES - 1)];
+    const std::lock_guard<std::mutex> lock(stripe.M);
+    const size_t before = stripe.entries.size();
+    HistogramTally& tally = stripe.find_or_insert(key, static_cast<uint32_t>(hash));
+    tally.count   += count;
+    tally.count16 += count16;           // track how many UTF16s were converted
+    if (stripe.entries.size() != before) {
+        entry_count++;
+        key_bytes += key.size();
+    }
+}
 
-    /* On input, the key may be UTF8 or UTF16. See if we can figure it out */
-    bool found_utf16   = false;   // did we find a utf16?
-    bool little_endian = false; // was it little_endian?
-    std::u32string u32key;      // u32key. Doesn't matter if LE or BE, because we never write it out.
+/* Each thread caches its tables by histogram serial number, not address, so that a new histogram
+ * allocated at the address of a deleted one does not find the deleted histogram's table.
+ * A cached table's weak_ptr expires when its histogram is deleted; such entries are pruned
+ * when the cache has doubled in size since it was last pruned.
+ */
+AtomicUnicodeHistogram::LocalTable& AtomicUnicodeHistogram::local_table()
+{
+    struct cached_t {
+        LocalTable* table;
+        std::weak_ptr<LocalTable> owner;
+    };
+    thread_local std::unordered_map<uint64_t, cached_t> tables;
+    thread_local size_t prune_at {16};
+    auto it = tables.find(serial);
+    if (it != tables.end()) return *it->second.table;
 
-    if (looks_like_utf16(key_unknown_encoding, little_endian)) {
-        // We have an endian-guessing implementation that converts from 16 to 8, so convert from 16 to 8
-        // and then convert it to utf32
-        u32key = convert_utf8_to_utf32(convert_utf16_to_utf8(key_unknown_encoding, little_endian));
-        found_utf16 = true;
-    } else {
-        u32key = convert_utf8_to_utf32(key_unknown_encoding);
+    if (tables.size() >= prune_at) {
+        for (auto i = tables.begin(); i != tables.end();) {
+            i = i->second.owner.expired() ? tables.erase(i) : std::next(i);
+        }
+        prune_at = std::max(size_t(16), tables.size() * 2);
+    }
+    std::shared_ptr<LocalTable> lt(new LocalTable()); // not make_shared, which would keep the table for the weak_ptr
+    {
+        const std::lock_guard<std::mutex> lock(Mlocal);
+        local_tables.push_back(lt);
+    }
+    tables[serial] = cached_t{lt.get(), lt};
+    return *lt;
+}
+
+void AtomicUnicodeHistogram::merge_local(LocalTable& lt)
+{
+    if (lt.counts.empty()) return;
+    auto t0 = std::chrono::steady_clock::now();
+    for (const auto& it : lt.counts) {
+        add_tally(it.first, it.second.count, it.second.count16);
+    }
+    lt.counts.clear();
+    lt.key_bytes = 0;
+    merges++;
+    merge_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+}
+
+void AtomicUnicodeHistogram::merge_thread_local()
+{
+    const std::lock_guard<std::mutex> lock(Mlocal);
+    for (auto& lt : local_tables) {
+        const std::lock_guard<std::mutex> lock2(lt->M);
+        merge_local(*lt);
+    }
+}
+
+AtomicUnicodeHistogram::thread_local_stats_t AtomicUnicodeHistogram::get_thread_local_stats() const
+{
+    thread_local_stats_t ret;
+    ret.merges   = merges;
+    ret.merge_ns = merge_ns;
+    const std::lock_guard<std::mutex> lock(Mlocal);
+    ret.tables = local_tables.size();
+    for (const auto& lt : local_tables) {
+        const std::lock_guard<std::mutex> lock2(lt->M);
+        ret.bytes += sizeof(*lt) + lt->key_bytes + lt->counts.size() * (sizeof(std::string) + sizeof(HistogramTally));
     }
+    return ret;
+}
+
+void AtomicUnicodeHistogram::add_feature_context(const std::string& key_unknown_encoding, const std::string& context)
+{
+    if (key_unknown_encoding.size() == 0) return; // don't deal with zero-length keys
 
-    /* At this point we have UTF-32, which we treat as raw unicode characters.
+    /* On input, the key may be UTF8 or UTF16. histogram_feature figures it out and converts it to UTF-8.
      *
      * We would like to process lowercase, numeric and regular expressions in utf32 world.
      * Ideally this would be done with ICU, but we do not want to assume we have ICU.
@@ -139,19 +333,118 @@ void AtomicUnicodeHistogram::add_feature_context(const std::string& key_unknown_
      * See also:
      * https://www.moria.us/articles/wchar-is-a-historical-accident/?
      */
+    add_feature(histogram_feature(key_unknown_encoding), context);
+}
 
-    std::string u8key = convert_utf32_to_utf8(u32key);
-    add0(u8key, context, found_utf16);
+void AtomicUnicodeHistogram::add_feature(const histogram_feature& feature, const std::string& context)
+{
+    std::string displayString;
+    if (make_key(feature, context, displayString)) {
+        add_key(displayString, feature.found_utf16);
+    }
 }
 
-size_t AtomicUnicodeHistogram::size() const // returns the total number of bytes of the histogram,.
+bool AtomicUnicodeHistogram::make_key(const histogram_feature& feature, const std::string &context, std::string &displayString) const
 {
-    const std::lock_guard<std::mutex> lock(M);
-    return h.size();
+    if (!matcher.match(feature, &displayString, context)) return false;
+    displayString = validateOrEscapeUTF8(displayString, true, true, false);
+    return true;
+}
+
+size_t AtomicUnicodeHistogram::size() const // returns the number of entries in the histogram
+{
+    if (topk) return topk->size();
+    return entry_count;
 }
 
 size_t AtomicUnicodeHistogram::bytes() const // returns the total number of bytes of the histogram,.
+{
+    size_t count = sizeof(*this) + (topk ? topk->bytes() : 0) + entry_count * sizeof(Entry) + key_bytes;
+    for (const auto& stripe : stripes) {
+        const std::lock_guard<std::mutex> lock(stripe.M);
+        count += stripe.slots.size() * sizeof(Slot);
+    }
+    return count + get_thread_local_stats().bytes;
+}
+
+/****************************************************************
+ *** Approximate top-N
+ ****************************************************************/
+
+/* The sketch is made wide enough that the error on each estimate is a small fraction of what a top-N key needs */
+AtomicUnicodeHistogram::TopK::TopK(size_t top_n):
+    capacity(top_n * 2),
+    width(std::max(size_t(1024), size_t(1) << (64 - __builtin_clzll(top_n * 16 - 1)))),
+    sketch(DEPTH * width),
+    sketch16(DEPTH * width)
+{
+}
+
+void AtomicUnicodeHistogram::TopK::add(const std::string& key, uint64_t hash, uint32_t count, uint32_t count16)
+{
+    /* Each row is indexed with h1 + row*h2 (Kirsch and Mitzenmacher), so one hash serves all of the rows */
+    const uint32_t h1 = static_cast<uint32_t>(hash);
+    const uint32_t h2 = static_cast<uint32_t>(hash >> 32) | 1;
+    uint32_t est   = UINT32_MAX;
+    uint32_t est16 = UINT32_MAX;
+
+    const std::lock_guard<std::mutex> lock(M);
+    for (size_t row = 0; row < DEPTH; row++) {
+        size_t i = row * width + ((h1 + row * h2) & (width - 1));
+        sketch[i]   += count;
+        sketch16[i] += count16;
+        est   = std::min(est, sketch[i]);
+        est16 = std::min(est16, sketch16[i]);
+    }
+
+    auto it = top.find(key);
+    if (it != top.end()) {
+        by_count.erase(std::make_pair(it->second.count, &it->first));
+    } else {
+        if (top.size() >= capacity) {
+            /* Replace the smallest key, if this one is now larger */
+            auto smallest = by_count.begin();
+            if (est <= smallest->first) return;
+            auto victim = top.find(*smallest->second); // before the key it points to is erased
+            by_count.erase(smallest);
+            top.erase(victim);
+        }
+        it = top.emplace(key, HistogramTally()).first;
+    }
+    it->second.count   = est;
+    it->second.count16 = est16;
+    by_count.insert(std::make_pair(est, &it->first));
+}
+
+void AtomicUnicodeHistogram::TopK::items(std::vector<auh_t::item>& ret)
 {
     const std::lock_guard<std::mutex> lock(M);
-    return sizeof(*this) + h.bytes();
+    for (auto& it : top) {
+        ret.push_back(auh_t::item(it.first, &it.second));
+    }
+}
+
+void AtomicUnicodeHistogram::TopK::clear()
+{
+    const std::lock_guard<std::mutex> lock(M);
+    std::fill(sketch.begin(), sketch.end(), 0);
+    std::fill(sketch16.begin(), sketch16.end(), 0);
+    top.clear();
+    by_count.clear();
+}
+
+size_t AtomicUnicodeHistogram::TopK::size() const
+{
+    const std::lock_guard<std::mutex> lock(M);
+    return top.size();
+}
+
+size_t AtomicUnicodeHistogram::TopK::bytes() const
+{
+    const std::lock_guard<std::mutex> lock(M);
+    size_t count = sizeof(*this) + (sketch.size() + sketch16.size()) * sizeof(uint32_t);
+    for (const auto& it : top) {
+        count += sizeof(it) + it.first.size() + sizeof(std::pair<uint32_t, const std::string*>);
+    }
+    return count;
 }
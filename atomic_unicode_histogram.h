@@ -20,7 +20,14 @@
 #include "atomic_map.h"
 #include "histogram_def.h"
 #include "unicode_escape.h"
+#include <array>
 #include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
 
 struct AtomicUnicodeHistogram {
     static uint32_t debug_histogram_malloc_fail_frequency; // for debugging, make malloc fail sometimes
@@ -50,7 +57,9 @@ struct AtomicUnicodeHistogram {
         }
     };
 
-    /* A FrequencyReportVector is a vector of report elements when the report is generated.*/
+    /* A FrequencyReportVector is a vector of report elements when the report is generated.
+     * The histogram itself is no longer stored in an atomic_map, but the report items still use its item type.
+     */
     typedef atomic_map<std::string, struct AtomicUnicodeHistogram::HistogramTally> auh_t;
     typedef std::vector<auh_t::item> FrequencyReportVector;
 
@@ -64,33 +73,134 @@ struct AtomicUnicodeHistogram {
         return false;
     }
 
-    AtomicUnicodeHistogram(const struct histogram_def& def_) : def(def_) {}
+    AtomicUnicodeHistogram(const struct histogram_def& def_) : def(def_), matcher(def_), serial(next_serial++) {
+        if (def.approximate_top_n > 0) topk = std::make_unique<TopK>(def.approximate_top_n);
+    }
     virtual ~AtomicUnicodeHistogram(){};
 
     // is it empty?
     bool empty() {
-        const std::lock_guard<std::mutex> lock(M);
-        return h.size()==0;
+        return size()==0;
     }
     void clear();                       // empties the histogram
     // low-level add, directly to what we display, if the match function checks out.
     void add0(const std::string& u8key, const std::string &context, bool found_utf16);
 
+    // add0() in two steps, so that callers can partition by the key that will be displayed:
+    // make_key() applies the histogram_def and escapes; returns false if the feature does not match.
+    bool make_key(const std::string& u8key, const std::string &context, std::string &displayString) const;
+    void add_key(const std::string& displayString, bool found_utf16); // count a key made by make_key()
+
      // adds Unicode string to the histogram count. context is used for histogram_def
     void add_feature_context(const std::string& feature, const std::string&context);
-    size_t size()  const;              // returns the number of entries in the historam
-    size_t bytes() const;              // returns the number of bytes used by the histogram
+    // the same, for a feature that has already been normalized, so that several histograms can share the work
+    void add_feature(const histogram_feature& feature, const std::string& context);
+    bool make_key(const histogram_feature& feature, const std::string &context, std::string &displayString) const;
+    size_t size()  const;              // returns the number of entries in the historam (not counting thread-local tables)
+    size_t bytes() const;              // returns the number of bytes used by the histogram, including thread-local tables
 
     /** makeReport() makes a report and returns a
-     * FrequencyReportVector.
+     * FrequencyReportVector. This is the only place that the histogram is sorted.
+     * The items point to the tallies in the histogram, so they are valid until the histogram is cleared.
+     * An approximate histogram reports at most def.approximate_top_n items, and they are only valid until the next add.
      */
     std::vector<auh_t::item> makeReport(size_t topN=0);          // returns items of <count,key>
+
+    /* drain() removes every entry from the histogram and returns them sorted by key, for spilling to a sorted run.
+     * Each stripe is emptied under its lock, so an entry added concurrently is either returned or stays in the histogram.
+     * Approximate histograms have bounded memory and are never drained.
+     */
+    typedef std::pair<std::string, HistogramTally> run_entry_t;
+    std::vector<run_entry_t> drain();
     const struct histogram_def def;            // the definition we are making
+    const histogram_matcher matcher;           // def, compiled
     bool  debug {false};                        // set to enable debugging
 
+    /* The histogram is divided into STRIPES stripes, selected by the hash of the key, each with its own lock.
+     * Each stripe is an open-addressing hash table with linear probing. The slots hold the key's hash and the index
+     * of its entry; entries are kept in a deque so that their addresses do not change when the table grows.
+     */
+    static inline const size_t STRIPES {16};
+
+    /* Thread-local accumulation.
+     * If thread_local_threshold>0, add_key() counts in a table private to the calling thread. The table is merged into
+     * the histogram when it holds thread_local_threshold keys, when merge_thread_local() is called (at shutdown),
+     * and by makeReport().
+     */
+    std::atomic<size_t> thread_local_threshold {0};
+    void merge_thread_local();          // merge every thread's table into the histogram
+    struct thread_local_stats_t {
+        uint64_t merges {0};            // number of tables merged
+        uint64_t merge_ns {0};          // time spent merging
+        size_t   tables {0};            // number of thread-local tables
+        size_t   bytes {0};             // bytes currently held in thread-local tables
+    };
+    thread_local_stats_t get_thread_local_stats() const;
+
+    /* Approximate counting, used when def.approximate_top_n>0.
+     * A count-min sketch estimates the count of every key; the top-K table keeps the 2*approximate_top_n keys with
+     * the largest estimates. Memory for the counts is fixed when the histogram is created.
+     * Estimates are never low, and are high by at most e/WIDTH of all counts added, with probability 1-exp(-DEPTH).
+     */
+    class TopK {
+        TopK(const TopK&) = delete;
+        TopK& operator=(const TopK&) = delete;
+        mutable std::mutex M {};
+        const size_t capacity;          // keys kept in top
+        const size_t width;             // sketch columns; a power of 2
+        std::vector<uint32_t> sketch {};    // DEPTH rows of count
+        std::vector<uint32_t> sketch16 {};  // DEPTH rows of count16
+        std::unordered_map<std::string, HistogramTally> top {};
+        std::set<std::pair<uint32_t, const std::string*>> by_count {}; // top, smallest count first
+    public:
+        static inline const size_t DEPTH {4};
+        TopK(size_t top_n);
+        void add(const std::string& key, uint64_t hash, uint32_t count, uint32_t count16);
+        void items(std::vector<auh_t::item>& ret);
+        void clear();
+        size_t size() const;
+        size_t bytes() const;
+    };
+
 private:
-    mutable std::mutex M {};                    // mutex for the histogram, used to lock individual elements.
-    auh_t h {};                         // the histogram
+    std::unique_ptr<TopK> topk {};      // only for approximate histograms
+
+    struct LocalTable {
+        std::mutex M {};                // only contended while another thread merges this table
+        std::unordered_map<std::string, HistogramTally> counts {};
+        size_t key_bytes {0};
+    };
+    static inline std::atomic<uint64_t> next_serial {0};
+    const uint64_t serial;              // identifies this histogram in each thread's table cache
+    mutable std::mutex Mlocal {};       // protects local_tables
+    std::vector<std::shared_ptr<LocalTable>> local_tables {}; // each thread's cache holds a weak_ptr
+    std::atomic<uint64_t> merges {0};
+    std::atomic<uint64_t> merge_ns {0};
+    LocalTable& local_table();          // the calling thread's table
+    void merge_local(LocalTable& lt);   // caller must hold lt.M
+    void add_tally(const std::string& key, uint32_t count, uint32_t count16);
+
+    struct Entry {
+        Entry(const std::string& key_) : key(key_) {}
+        std::string key;
+        HistogramTally tally {};
+    };
+    struct Slot {
+        uint32_t hash32 {0};
+        uint32_t index {EMPTY};
+        static inline const uint32_t EMPTY {0xffffffff};
+    };
+    struct Stripe {
+        mutable std::mutex M {};
+        std::deque<Entry> entries {};
+        std::vector<Slot> slots {};     // size is zero or a power of 2
+        HistogramTally& find_or_insert(const std::string& key, uint32_t hash32);
+        void grow();
+    };
+    static uint64_t key_hash(const std::string& key);
+    std::array<Stripe, STRIPES> stripes {};
+    std::atomic<size_t> entry_count {0};
+    std::atomic<size_t> key_bytes {0};  // so that bytes() does not have to visit every entry
 };
 
 std::ostream& operator<<(std::ostream& os, const AtomicUnicodeHistogram::FrequencyReportVector& rep);
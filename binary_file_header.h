@@ -0,0 +1,64 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef BINARY_FILE_HEADER_H
+#define BINARY_FILE_HEADER_H
+
+#include <cinttypes>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <string>
+
+#include "formatter.h"
+
+/**
+ * binary_file_header_t:
+ * The header that starts each of the binary files that are mapped and used in place: columnar
+ * feature files, the carve store index and stop list indexes. They are written in native byte
+ * order and layout, so a reader checks the magic, the version and the byte order mark before
+ * it uses anything else in the file.
+ */
+struct binary_file_header_t {
+    static inline const uint32_t BYTE_ORDER_MARK {0x01020304};
+
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;            // BYTE_ORDER_MARK, as written
+
+    static binary_file_header_t make(const char (&magic_)[8], uint32_t version_) {
+        binary_file_header_t hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, magic_, sizeof(hdr.magic));
+        hdr.version = version_;
+        hdr.byte_order = BYTE_ORDER_MARK;
+        return hdr;
+    }
+};
+
+/* The base of each file format's exception; prefix names the format */
+class binary_file_error : public std::exception {
+public:
+    std::string msg {};
+    binary_file_error(const std::string& prefix, const std::string& m) : msg(prefix + ": " + m) {}
+    const char* what() const noexcept override { return msg.c_str(); };
+};
+
+/* Throws E unless the len bytes at base start with a header that has magic and version and
+ * was written on this architecture. kind is what the file should be, for the message.
+ */
+template <class E>
+void check_binary_file_header(const char* base, size_t len, const char (&magic)[8], uint32_t version,
+                              const std::filesystem::path& fname, const char* kind) {
+    binary_file_header_t hdr;
+    if (len < sizeof(hdr)) {
+        throw E(Formatter() << fname << " is too short");
+    }
+    memcpy(&hdr, base, sizeof(hdr));
+    if (memcmp(hdr.magic, magic, sizeof(hdr.magic)) != 0) {
+        throw E(Formatter() << fname << " is not a " << kind);
+    }
+    if (hdr.version != version || hdr.byte_order != binary_file_header_t::BYTE_ORDER_MARK) {
+        throw E(Formatter() << fname << " was written by another version or on another architecture");
+    }
+}
+
+#endif
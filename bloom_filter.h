@@ -0,0 +1,100 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <cinttypes>
+#include <vector>
+
+/**
+ * blocked_bloom_filter:
+ * A Bloom filter in which all of a key's bits are in one 64-byte block, so a lookup
+ * touches one cache line. It is given a 64-bit hash rather than the key: the upper half
+ * picks the block and the lower half picks the bits within it.
+ *
+ * With the default 10 bits per key, about 1% of the keys that were not added are reported present.
+ *
+ * The blocks are either built with init() and add(), or attach()ed to memory that holds
+ * the data() of a filter built earlier, such as a mapped file.
+ */
+class blocked_bloom_filter {
+public:
+    static inline const size_t BLOCK_WORDS {8}; // 64 bytes
+    static inline const size_t DEFAULT_BITS_PER_KEY {10};
+
+private:
+    struct alignas(64) block_t {
+        uint64_t words[BLOCK_WORDS] {};
+    };
+    static inline const uint32_t SALT[8] {0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+                                          0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+    std::vector<block_t> owned {};
+    const uint64_t* words {nullptr};    // owned, or attached
+    size_t nblocks {0};
+
+    size_t block_of(uint64_t h) const {
+        return ((h >> 32) * nblocks) >> 32;
+    }
+
+public:
+    blocked_bloom_filter() {}
+    blocked_bloom_filter(const blocked_bloom_filter&) = delete;
+    blocked_bloom_filter& operator=(const blocked_bloom_filter&) = delete;
+
+    void init(size_t keys, size_t bits_per_key = DEFAULT_BITS_PER_KEY) {
+        owned.assign((keys * bits_per_key + 511) / 512, block_t());
+        words = owned.empty() ? nullptr : owned[0].words;
+        nblocks = owned.size();
+    }
+    /* Use nblocks_ blocks at p, which must stay valid and be 8-byte aligned */
+    void attach(const void* p, size_t nblocks_) {
+        owned.clear();
+        words = static_cast<const uint64_t*>(p);
+        nblocks = nblocks_;
+    }
+    void clear() {
+        owned.clear();
+        words = nullptr;
+        nblocks = 0;
+    }
+    bool empty() const { return nblocks == 0; }
+    size_t blocks() const { return nblocks; }
+    size_t bytes() const { return nblocks * sizeof(block_t); }
+    const void* data() const { return words; }
+
+    void add(uint64_t h) {
+        uint64_t* b = owned[block_of(h)].words;
+        const uint32_t lo = h;
+        for (int i = 0; i < 8; i++) {
+            const uint32_t bit = (lo * SALT[i]) >> 23; // 0..511
+            b[bit >> 6] |= uint64_t(1) << (bit & 63);
+        }
+    }
+
+    /* false if h was certainly not added; an empty filter contains nothing */
+    bool maybe_contains(uint64_t h) const {
+        if (nblocks == 0) return false;
+        const uint64_t* b = words + block_of(h) * BLOCK_WORDS;
+        const uint32_t lo = h;
+        for (int i = 0; i < 8; i++) {
+            const uint32_t bit = (lo * SALT[i]) >> 23;
+            if ((b[bit >> 6] & (uint64_t(1) << (bit & 63))) == 0) return false;
+        }
+        return true;
+    }
+
+    /* Measured by probing with pseudo-random hashes, which is what hashes of absent keys look like */
+    double false_positive_rate(size_t probes = 100000) const {
+        if (nblocks == 0 || probes == 0) return 0.0;
+        uint64_t x = 0x9e3779b97f4a7c15ULL;
+        size_t positives = 0;
+        for (size_t i = 0; i < probes; i++) {
+            x ^= x << 13;               // xorshift64
+            x ^= x >> 7;
+            x ^= x << 17;
+            if (maybe_contains(x)) positives++;
+        }
+        return double(positives) / probes;
+    }
+};
+
+#endif
@@ -0,0 +1,268 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+
+#include "carve_queue.h"
+#include "feature_recorder.h"
+#include "formatter.h"
+
+carve_queue::carve_queue(size_t threads_, size_t max_bytes_in_flight_) : max_bytes_in_flight(max_bytes_in_flight_)
+{
+    for (size_t i = 0; i < threads_; i++) {
+        workers.emplace_back(&carve_queue::run, this);
+    }
+}
+
+carve_queue::~carve_queue()
+{
+    {
+        const std::lock_guard<std::mutex> lock(M);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (auto& t : workers) {
+        t.join();
+    }
+}
+
+void carve_queue::rethrow_error()
+{
+    if (error) {
+        std::exception_ptr e = error;
+        error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+void carve_queue::enqueue(job_t&& job)
+{
+    if (workers.empty()) {
+        write_job(job);
+        return;
+    }
+    const size_t n = job_bytes(job);
+    std::unique_lock<std::mutex> lock(M);
+    try {
+        rethrow_error();
+    } catch (...) {
+        lock.unlock();
+        drop(job);
+        throw;
+    }
+    if (in_flight > 0 && in_flight + n > max_bytes_in_flight) {
+        waits++;
+        room.wait(lock, [&] { return in_flight == 0 || in_flight + n <= max_bytes_in_flight; });
+    }
+    in_flight += n;
+    jobs.push_back(std::move(job));
+    lock.unlock();
+    work_ready.notify_one();
+}
+
+void carve_queue::drain()
+{
+    std::unique_lock<std::mutex> lock(M);
+    room.wait(lock, [&] { return jobs.empty() && writing == 0; });
+    rethrow_error();
+}
+
+size_t carve_queue::bytes_in_flight() const
+{
+    const std::lock_guard<std::mutex> lock(M);
+    return in_flight;
+}
+
+/* Jobs that are queued when the queue stops are still written */
+void carve_queue::run()
+{
+    for (;;) {
+        job_t job;
+        {
+            std::unique_lock<std::mutex> lock(M);
+            work_ready.wait(lock, [&] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+            writing++;
+        }
+        try {
+            write_job(job);
+        } catch (...) {
+            const std::lock_guard<std::mutex> lock(M);
+            if (!error) error = std::current_exception();
+        }
+        {
+            const std::lock_guard<std::mutex> lock(M);
+            in_flight -= job_bytes(job);
+            writing--;
+        }
+        room.notify_all();
+    }
+}
+
+void carve_queue::write_job(job_t& job)
+{
+    try {
+        make_directory(job.path.parent_path());
+        write_file(job);
+    } catch (...) {
+        drop(job);
+        throw;
+    }
+    close_source(job);
+    if (job.on_written) job.on_written();
+    files_written++;
+    bytes_written += job.bytes.size() + job.source_bytes;
+}
+
+/* A job that will not be written; every such job comes here, so that on_failed is always called */
+void carve_queue::drop(job_t& job)
+{
+    close_source(job);
+    if (job.on_failed) job.on_failed();
+}
+
+void carve_queue::close_source(job_t& job)
+{
+    if (job.source_fd >= 0) {
+        ::close(job.source_fd);
+        job.source_fd = -1;
+    }
+}
+
+void carve_queue::make_directory(const std::filesystem::path& dir)
+{
+    const std::lock_guard<std::mutex> lock(Mdirs);
+    if (dirs.find(dir) != dirs.end()) return;
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    if (ec && !std::filesystem::is_directory(dir)) {
+        throw feature_recorder::DiskWriteError(Formatter() << "cannot create directory " << dir << ":" << ec.message());
+    }
+    dirs.insert(dir);
+}
+
+void carve_queue::write_file(const job_t& job)
+{
+    if (job.source_fd >= 0) {
+        write_file_from_source(job);
+    } else {
+        std::ofstream os;
+        os.open(job.path, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!os.is_open()) {
+            throw feature_recorder::DiskWriteError(Formatter() << "cannot open file for writing:" << job.path << ":" << std::strerror(errno));
+        }
+        os.write(reinterpret_cast<const char*>(job.bytes.data()), job.bytes.size());
+        os.close();
+        if (os.bad() || os.fail()) {
+            throw feature_recorder::DiskWriteError(Formatter() << "error writing file " << job.path);
+        }
+    }
+
+    /* Set timestamp if necessary. Note that we do not use std::filesystem::last_write_time()
+     * as there seems to be no portable way to use it under C++17.
+     */
+    if (job.mtime > 0) {
+#ifdef HAVE_UTIMES
+        const struct timeval times[2] = {{job.mtime, 0}, {job.mtime, 0}};
+        utimes(job.path.c_str(), times);
+#endif
+    }
+}
+
+namespace {
+void write_all(int fd, const char* p, size_t len, const std::filesystem::path& path)
+{
+    while (len > 0) {
+        ssize_t n = ::write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            throw feature_recorder::DiskWriteError(Formatter() << "error writing file " << path << ":" << std::strerror(errno));
+        }
+        p += n;
+        len -= n;
+    }
+}
+}
+
+/* The source range is copied by copy_file_range(), which can share or clone the blocks on some file systems,
+ * or else by sendfile(); both keep the data in the kernel. If neither works for these two files,
+ * it is read with pread() and written.
+ */
+void carve_queue::write_file_from_source(const job_t& job)
+{
+    int out = ::open(job.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0) {
+        throw feature_recorder::DiskWriteError(Formatter() << "cannot open file for writing:" << job.path << ":" << std::strerror(errno));
+    }
+    try {
+        write_all(out, reinterpret_cast<const char*>(job.bytes.data()), job.bytes.size(), job.path);
+        uint64_t off = job.source_offset;
+        uint64_t left = job.source_bytes;
+        bool try_copy_file_range = true;
+        bool try_sendfile = true;
+        std::vector<char> buf;
+        while (left > 0) {
+            const size_t chunk = std::min<uint64_t>(left, MAX_KERNEL_COPY);
+            ssize_t n = -1;
+            bool in_kernel = false;
+#ifdef HAVE_COPY_FILE_RANGE
+            if (try_copy_file_range) {
+                loff_t o = off;
+                n = ::copy_file_range(job.source_fd, &o, out, nullptr, chunk, 0);
+                if (n < 0 && errno != EINTR) {
+                    try_copy_file_range = false;
+                    continue;
+                }
+                in_kernel = true;
+            } else
+#endif
+#ifdef HAVE_SENDFILE
+            if (try_sendfile) {
+                off_t o = off;
+                n = ::sendfile(out, job.source_fd, &o, chunk);
+                if (n < 0 && errno != EINTR) {
+                    try_sendfile = false;
+                    continue;
+                }
+                in_kernel = true;
+            } else
+#endif
+            {
+                if (buf.empty()) buf.resize(BUFFERED_COPY);
+                n = ::pread(job.source_fd, buf.data(), std::min(chunk, buf.size()), off);
+                if (n > 0) write_all(out, buf.data(), n, job.path);
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                throw feature_recorder::DiskWriteError(Formatter() << "error copying to " << job.path << ":" << std::strerror(errno));
+            }
+            if (n == 0) {
+                throw feature_recorder::DiskWriteError(Formatter() << "source of " << job.path << " ended early");
+            }
+            if (in_kernel) bytes_copied_in_kernel += n;
+            off += n;
+            left -= n;
+        }
+        (void)try_copy_file_range;
+        (void)try_sendfile;
+    } catch (...) {
+        ::close(out);
+        throw;
+    }
+    if (::close(out) != 0) {
+        throw feature_recorder::DiskWriteError(Formatter() << "error writing file " << job.path << ":" << std::strerror(errno));
+    }
+}
@@ -0,0 +1,97 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef CARVE_QUEUE_H
+#define CARVE_QUEUE_H
+
+#include <atomic>
+#include <cinttypes>
+#include <condition_variable>
+#include <ctime>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+/**
+ * carve_queue:
+ * Writes carved files on a pool of I/O threads, so that feature_recorder::carve() can return the
+ * carved file's name as soon as it has chosen one, rather than after the file has been written.
+ *
+ * Each job holds a copy of the bytes to write, since the sbuf they came from may be freed as soon as
+ * carve() returns. The queue is bounded by the bytes in flight (queued or being written): enqueue()
+ * waits while adding the job would go over max_bytes_in_flight. A job larger than the bound is
+ * admitted once nothing else is in flight.
+ *
+ * Data that is already in a file is not copied into the job: the job holds a duplicate of the file's
+ * descriptor and the range, and the range is copied from file to file in the kernel, with
+ * copy_file_range() or sendfile(), falling back to pread() and write(). The range counts as in flight,
+ * so the bound also limits the descriptors held by queued jobs.
+ *
+ * Directories are created on first use and remembered, so each one costs one call.
+ * The first write error is kept and rethrown, as a feature_recorder::DiskWriteError, by the next
+ * enqueue() or drain(). With no threads, enqueue() writes the file itself.
+ */
+class carve_queue {
+    carve_queue(const carve_queue&) = delete;
+    carve_queue& operator=(const carve_queue&) = delete;
+
+public:
+    struct job_t {
+        std::filesystem::path path {};  // where the file goes
+        std::vector<uint8_t> bytes {};
+        time_t mtime {0};               // if >0, the file's access and modification times
+        std::function<void()> on_written {}; // if set, called once the file has been written
+        std::function<void()> on_failed {};  // if set, called if the file could not be written or the job was rejected
+        int source_fd {-1};             // if >=0, source_bytes at source_offset in it follow bytes; closed by the queue
+        uint64_t source_offset {0};
+        uint64_t source_bytes {0};
+    };
+    static inline const size_t DEFAULT_THREADS {2};
+    static inline const size_t DEFAULT_MAX_BYTES_IN_FLIGHT {64 * 1024 * 1024};
+    static inline const size_t ZERO_COPY_MIN_BYTES {64 * 1024}; // smaller file-backed data is copied into the job
+    static inline const size_t MAX_KERNEL_COPY {1024 * 1024 * 1024};
+    static inline const size_t BUFFERED_COPY {1024 * 1024};
+
+    carve_queue(size_t threads_ = DEFAULT_THREADS, size_t max_bytes_in_flight_ = DEFAULT_MAX_BYTES_IN_FLIGHT);
+    ~carve_queue();                     // writes everything queued, then stops the threads
+
+    const size_t max_bytes_in_flight;
+
+    void enqueue(job_t&& job);
+    void drain();                       // waits until everything queued has been written
+    void make_directory(const std::filesystem::path& dir); // creates dir and its parents, once
+    void write_file(const job_t& job);  // writes one file now
+    size_t bytes_in_flight() const;
+    size_t threads() const { return workers.size(); }
+
+    std::atomic<uint64_t> files_written {0};
+    std::atomic<uint64_t> bytes_written {0};
+    std::atomic<uint64_t> waits {0};    // times that enqueue() waited for room
+    std::atomic<uint64_t> bytes_copied_in_kernel {0}; // by copy_file_range() or sendfile()
+
+private:
+    std::vector<std::thread> workers {};
+    mutable std::mutex M {};            // protects everything below but the directories
+    std::condition_variable work_ready {};
+    std::condition_variable room {};    // bytes have left flight
+    std::deque<job_t> jobs {};
+    size_t in_flight {0};               // bytes queued or being written
+    size_t writing {0};                 // jobs being written
+    bool stopping {false};
+    std::exception_ptr error {};
+    std::mutex Mdirs {};
+    std::set<std::filesystem::path> dirs {};
+
+    void run();
+    void write_job(job_t& job);
+    static size_t job_bytes(const job_t& job) { return job.bytes.size() + job.source_bytes; } // counted in flight
+    void write_file_from_source(const job_t& job);
+    static void close_source(job_t& job);
+    static void drop(job_t& job);       // for a job that will not be written
+    void rethrow_error();               // with M held
+};
+
+#endif
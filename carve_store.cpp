@@ -0,0 +1,121 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "carve_store.h"
+#include "formatter.h"
+#include "sbuf.h"
+
+carve_store::carve_store(const std::filesystem::path& dir_) : dir(dir_)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    if (!std::filesystem::is_directory(dir)) {
+        throw StoreError(Formatter() << "cannot create " << dir << ": " << ec.message());
+    }
+    const std::filesystem::path fname = dir / INDEX_NAME;
+
+    /* Only one process writes the header */
+    int cfd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (cfd >= 0) {
+        const binary_file_header_t hdr = binary_file_header_t::make(MAGIC, VERSION);
+        ssize_t w = ::write(cfd, &hdr, sizeof(hdr));
+        ::close(cfd);
+        if (w != sizeof(hdr)) {
+            throw StoreError(Formatter() << "cannot write " << fname << ": " << strerror(errno));
+        }
+    }
+    fd = ::open(fname.c_str(), O_WRONLY | O_APPEND);
+    if (fd < 0) {
+        throw StoreError(Formatter() << "cannot open " << fname << ": " << strerror(errno));
+    }
+    try {
+        load();
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+}
+
+carve_store::~carve_store()
+{
+    if (fd >= 0) ::close(fd);
+}
+
+/* The digests and paths are used where they are in the mapped index */
+void carve_store::load()
+{
+    const std::filesystem::path fname = dir / INDEX_NAME;
+    mapped.reset(sbuf_t::map_file(fname));
+    const char* base = reinterpret_cast<const char*>(mapped->get_buf());
+    const size_t len = mapped->bufsize;
+    check_binary_file_header<StoreError>(base, len, MAGIC, VERSION, fname, "carve store index");
+    size_t pos = sizeof(binary_file_header_t);
+    while (pos + sizeof(record_header_t) <= len) {
+        record_header_t rec;
+        memcpy(&rec, base + pos, sizeof(rec));
+        const size_t body = size_t(rec.digest_bytes) + rec.path_bytes;
+        if (body > len - pos - sizeof(rec)) break; // cut short
+        std::string_view digest(base + pos + sizeof(rec), rec.digest_bytes);
+        std::string_view path(base + pos + sizeof(rec) + rec.digest_bytes, rec.path_bytes);
+        objects.emplace(digest, path);  // the first record of a digest wins
+        pos += sizeof(rec) + body;
+    }
+}
+
+bool carve_store::find_or_add(const std::string& hexdigest, const std::string& ext, std::filesystem::path& path)
+{
+    const std::lock_guard<std::mutex> lock(M);
+    auto it = objects.find(hexdigest);
+    if (it != objects.end()) {
+        hits++;
+        path = dir / it->second;
+        return true;
+    }
+    auto pit = pending.find(hexdigest);
+    if (pit != pending.end()) {
+        hits++;
+        path = dir / pit->second;
+        return true;
+    }
+    misses++;
+    std::string rel = hexdigest.substr(0, 2) + "/" + hexdigest + ext;
+    path = dir / rel;
+    pending.emplace(hexdigest, std::move(rel));
+    return false;
+}
+
+void carve_store::commit(const std::string& hexdigest, const std::filesystem::path& path)
+{
+    const std::string rel = path.lexically_relative(dir).string();
+    record_header_t rec;
+    rec.digest_bytes = hexdigest.size();
+    rec.path_bytes = rel.size();
+    std::string buf(reinterpret_cast<const char*>(&rec), sizeof(rec));
+    buf += hexdigest;
+    buf += rel;
+    const std::lock_guard<std::mutex> lock(M);
+    pending.erase(hexdigest);
+    objects.emplace(keep(hexdigest), keep(rel)); // written, even if it cannot be indexed
+    if (::write(fd, buf.data(), buf.size()) != ssize_t(buf.size())) {
+        throw StoreError(Formatter() << "cannot append to " << (dir / INDEX_NAME) << ": " << strerror(errno));
+    }
+}
+
+void carve_store::abandon(const std::string& hexdigest)
+{
+    const std::lock_guard<std::mutex> lock(M);
+    pending.erase(hexdigest);
+}
+
+size_t carve_store::size() const
+{
+    const std::lock_guard<std::mutex> lock(M);
+    return objects.size();
+}
@@ -0,0 +1,81 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef CARVE_STORE_H
+#define CARVE_STORE_H
+
+#include <atomic>
+#include <cinttypes>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "binary_file_header.h"
+
+/**
+ * carve_store:
+ * A content-addressed store for carved files that is shared by every feature recorder in a
+ * feature_recorder_set, and by every run that uses the same store directory.
+ *
+ * A carved object is stored as {dir}/{first two hex digits}/{hex digest}{ext}, so an object that
+ * has been carved before, by any recorder in any run, is never written again: the feature file
+ * records the path of the existing copy instead.
+ *
+ * The digests of the objects in the store are kept in {dir}/carve_index.bin, an append-only file of
+ * (digest, path) records after a short header. It is mapped when the store is opened and nothing in
+ * it is copied; objects stored during the run are pending until they have been written, and are then
+ * kept in memory and appended to the file, one write() each. An object that could not be written is
+ * forgotten, so the next carve of it writes it again. Runs that share the store at the same time see
+ * each other's objects on their next open. A record cut short by a crash is ignored.
+ */
+class carve_store {
+    carve_store(const carve_store&) = delete;
+    carve_store& operator=(const carve_store&) = delete;
+
+public:
+    struct record_header_t {            // followed by the digest and the path
+        uint32_t digest_bytes;
+        uint32_t path_bytes;
+    };
+
+    class StoreError : public binary_file_error {
+    public:
+        StoreError(const std::string &m) : binary_file_error("Carve store error", m) {}
+    };
+
+    static inline const char MAGIC[8] {'B', 'E', '2', '0', 'C', 'S', 'T', 'R'};
+    static inline const uint32_t VERSION {1};
+    static inline const std::string INDEX_NAME {"carve_index.bin"};
+
+    explicit carve_store(const std::filesystem::path& dir_); // opens the store, creating it if need be
+    ~carve_store();
+
+    const std::filesystem::path dir;
+
+    /* If an object with hexdigest is in the store, or is being written to it, set path to it and return true.
+     * Otherwise set path to where it goes, make it pending so that later calls find it, and return false;
+     * the caller writes the object and then calls commit(), or abandon() if it could not be written.
+     */
+    bool find_or_add(const std::string& hexdigest, const std::string& ext, std::filesystem::path& path);
+    void commit(const std::string& hexdigest, const std::filesystem::path& path); // adds it to the index file
+    void abandon(const std::string& hexdigest); // forgets a pending object
+    size_t size() const;                // objects written to the store, as far as this process knows
+
+    std::atomic<uint64_t> hits {0};
+    std::atomic<uint64_t> misses {0};
+
+private:
+    std::unique_ptr<class sbuf_t> mapped {}; // the index as it was when the store was opened
+    mutable std::mutex M {};
+    std::unordered_map<std::string_view, std::string_view> objects {}; // digest -> path relative to dir
+    std::unordered_map<std::string, std::string> pending {};           // objects being written
+    std::deque<std::string> added {};   // the strings of objects added in this run
+    int fd {-1};                        // the index, open for appending
+
+    void load();
+    std::string_view keep(std::string_view s) { return added.emplace_back(s); }
+};
+
+#endif
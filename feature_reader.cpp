@@ -0,0 +1,143 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include "feature_reader.h"
+
+FeatureReader::FeatureReader(const std::filesystem::path& fname)
+{
+    /* mmap() cannot map an empty file */
+    if (std::filesystem::file_size(fname) > 0) {
+        sbuf.reset(sbuf_t::map_file(fname));
+        base = reinterpret_cast<const char*>(sbuf->get_buf());
+        len  = sbuf->bufsize;
+    }
+}
+
+FeatureReader::FeatureReader(const class feature_recorder& fr)
+    : FeatureReader(fr.fname_in_outdir("", feature_recorder::NO_COUNT))
+{
+}
+
+FeatureReader::~FeatureReader()
+{
+}
+
+/**
+ * A feature line is pos0 \t feature [\t context], optionally terminated with \r.
+ */
+bool FeatureReader::parse_line(std::string_view line, FeatureView& fv)
+{
+    if (line.size() > 0 && line.back() == '\r') line.remove_suffix(1);
+    if (line.size() == 0 || line[0] == '#') return false;
+
+    size_t tab1 = line.find('\t');
+    if (tab1 == std::string_view::npos) return false; // no feature
+    fv.pos0 = line.substr(0, tab1);
+
+    size_t tab2 = line.find('\t', tab1 + 1);
+    if (tab2 == std::string_view::npos) {
+        fv.feature = line.substr(tab1 + 1);
+        fv.context = std::string_view();
+    } else {
+        fv.feature = line.substr(tab1 + 1, tab2 - tab1 - 1);
+        fv.context = line.substr(tab2 + 1);
+    }
+    return true;
+}
+
+std::vector<FeatureReader::chunk_t> FeatureReader::chunks(size_t n) const
+{
+    std::vector<chunk_t> ret;
+    if (n == 0) n = 1;
+    size_t start = 0;
+    for (size_t i = 1; i <= n && start < len; i++) {
+        size_t end = (i == n) ? len : std::max(start, len * i / n);
+        /* move the end to just past the next newline */
+        if (end < len) {
+            const void* nl = memchr(base + end, '\n', len - end);
+            end = nl ? static_cast<const char*>(nl) - base + 1 : len;
+        }
+        if (end > start) {
+            ret.push_back(chunk_t(start, end));
+            start = end;
+        }
+    }
+    return ret;
+}
+
+void FeatureReader::for_each(const chunk_t& chunk, callback_t cb) const
+{
+    FeatureView fv;
+    size_t pos = chunk.first;
+    while (pos < chunk.second) {
+        const void* nl = memchr(base + pos, '\n', chunk.second - pos);
+        size_t eol = nl ? static_cast<const char*>(nl) - base : chunk.second;
+        if (parse_line(std::string_view(base + pos, eol - pos), fv)) {
+            cb(fv);
+        }
+        pos = eol + 1;
+    }
+}
+
+void FeatureReader::for_each(callback_t cb) const
+{
+    for_each(chunk_t(0, len), cb);
+}
+
+/**
+ * The scanner thread_pool is tied to scanner_set, so the chunks are handed out
+ * to a set of threads that exit when there are no chunks left.
+ * Making more chunks than threads smooths out the differences in chunk cost.
+ */
+void FeatureReader::for_each_parallel(callback_t cb, unsigned int threads) const
+{
+    if (threads == 0) threads = std::thread::hardware_concurrency();
+    if (threads <= 1 || len == 0) {
+        for_each(cb);
+        return;
+    }
+    const std::vector<chunk_t> work = chunks(threads * 4);
+    std::atomic<size_t> next {0};
+    std::exception_ptr error {};
+    std::mutex Merror;
+
+    auto worker = [&]() {
+        for (size_t i = next++; i < work.size(); i = next++) {
+            try {
+                for_each(work[i], cb);
+            } catch (...) {
+                const std::lock_guard<std::mutex> lock(Merror);
+                if (!error) error = std::current_exception();
+                next = work.size(); // stop the other workers
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned int i = 0; i < threads && i < work.size(); i++) {
+        pool.emplace_back(worker);
+    }
+    for (auto& t : pool) t.join();
+    if (error) std::rethrow_exception(error);
+}
+
+void FeatureReader::iterator::advance()
+{
+    while (fr && pos < fr->len) {
+        const void* nl = memchr(fr->base + pos, '\n', fr->len - pos);
+        size_t eol = nl ? static_cast<const char*>(nl) - fr->base : fr->len;
+        std::string_view line(fr->base + pos, eol - pos);
+        pos = eol + 1;
+        if (parse_line(line, fv)) return;
+    }
+    fr  = nullptr;                      // now equal to end()
+    pos = 0;
+}
@@ -0,0 +1,99 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef FEATURE_READER_H
+#define FEATURE_READER_H
+
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "feature_recorder.h"
+#include "sbuf.h"
+
+/**
+ * FeatureReader:
+ * Reads a text feature file by mapping it into memory.
+ *
+ * Each line is returned as a FeatureView whose fields point into the mapping, so nothing is
+ * allocated per line. The views are valid as long as the FeatureReader exists.
+ * The context is returned as it appears in the file (octal-quoted); use
+ * feature_recorder_file::unquote_string() if the original bytes are needed.
+ *
+ * Lines can be visited in order (for_each() or a range-for over the reader),
+ * or in parallel (for_each_parallel()), in which case the file is split into newline-aligned
+ * chunks that are parsed concurrently. Comment lines (starting with '#') and empty lines are skipped.
+ */
+
+struct FeatureView {
+    std::string_view pos0 {};
+    std::string_view feature {};
+    std::string_view context {};
+    Feature to_feature() const {
+        return Feature(std::string(pos0), std::string(feature), std::string(context));
+    }
+};
+
+class FeatureReader {
+    FeatureReader(const FeatureReader&) = delete;
+    FeatureReader& operator=(const FeatureReader&) = delete;
+
+    std::unique_ptr<sbuf_t> sbuf {};    // the mapped file; null if the file is empty
+    const char* base {nullptr};
+    size_t len {0};
+
+public:
+    typedef std::function<void(const FeatureView&)> callback_t;
+    typedef std::pair<size_t, size_t> chunk_t; // [start, end) byte offsets
+
+    FeatureReader(const std::filesystem::path& fname);
+    FeatureReader(const class feature_recorder& fr); // reads the recorder's feature file
+    ~FeatureReader();
+
+    size_t size() const { return len; }
+
+    /* Parse one line (without its \n). Returns false for comments, blank lines and lines without a feature. */
+    static bool parse_line(std::string_view line, FeatureView& fv);
+
+    /* Split the file into at most n chunks, each of which begins at the start of a line. */
+    std::vector<chunk_t> chunks(size_t n) const;
+
+    void for_each(callback_t cb) const;                   // in file order, in this thread
+    void for_each(const chunk_t& chunk, callback_t cb) const; // just the lines of one chunk
+
+    /* Parse the chunks in parallel. cb is called from several threads at once and must be threadsafe.
+     * If threads is 0, use std::thread::hardware_concurrency().
+     * The first exception thrown by a callback is rethrown after all of the threads finish.
+     */
+    void for_each_parallel(callback_t cb, unsigned int threads = 0) const;
+
+    /* Range support: for (const FeatureView &fv : reader) { ... } */
+    class iterator {
+        const FeatureReader* fr {nullptr};
+        size_t pos {0};                 // start of the next line
+        FeatureView fv {};
+        void advance();
+
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef FeatureView value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const FeatureView* pointer;
+        typedef const FeatureView& reference;
+
+        iterator() {}
+        iterator(const FeatureReader* fr_) : fr(fr_) { advance(); }
+        const FeatureView& operator*() const { return fv; }
+        const FeatureView* operator->() const { return &fv; }
+        iterator& operator++() { advance(); return *this; }
+        bool operator==(const iterator& that) const { return fr == that.fr && pos == that.pos; }
+        bool operator!=(const iterator& that) const { return !(*this == that); }
+    };
+    iterator begin() const { return iterator(this); }
+    iterator end() const { return iterator(); }
+};
+
+#endif
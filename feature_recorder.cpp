@@ -298,11 +298,17 @@ std::string feature_recorder::sanitize_filename(std::string in)
  *        {seq} is 000 through 999.  (1000 files per directory)
  *        {pos0} is where the feature was found.
  *        {ext} is the provided extension.
+ * If the feature recorder set has a carve store, the file goes in the store instead,
+ * and its path in the store is reported; see carve_store.
 
  * @param sbuf   - the buffer to carve
  * @param pos    - offset in the buffer to carve
  * @param len    - how many bytes to carve
- * @return - the path relative to the outdir
+ * @return - the path reported in the feature file: relative to the outdir, or the absolute path
+ *            of the object in the carve store if there is one
+ *
+ * The file is written later, by the feature recorder set's carve_queue;
+ * feature_recorder_set::carve_drain() waits until it has been.
  */
 /* Carving to a file depends on the carving mode.
  *
@@ -339,11 +345,24 @@ std::string feature_recorder::carve(const sbuf_t& header, const sbuf_t& data, st
 
     /* See if we have previously carved this object, in which case do not carve it again */
     std::string carved_hash_hexvalue = hash(data);
-    std::string carved_relative_path; // carved path reported in feature file, relative to outdir
+    std::string carved_relative_path; // carved path reported in feature file, relative to outdir unless in the store
     std::filesystem::path carved_absolute_path; // used for opening
-    bool in_cache = carve_cache.check_for_presence_and_insert(carved_hash_hexvalue);
-
-    if (in_cache) {
+    carve_store* store = fs.get_carve_store();
+    bool in_cache = false;            // carved before by this recorder; not reported
+    bool in_store = false;            // carved before into the store; reported with its path
+    std::string store_digest;
+
+    if (store) {
+        /* The store is addressed by the digest of everything in the file, header included */
+        if (header.bufsize > 0) {
+            store_digest = fs.hasher.pair_func(header.get_buf(), header.bufsize, data.get_buf(), data.bufsize);
+        } else {
+            store_digest = carved_hash_hexvalue;
+        }
+        in_store = store->find_or_add(store_digest, sanitize_filename(ext), carved_absolute_path);
+        carved_relative_path = carved_absolute_path.string();
+    } else if (carve_cache.check_for_presence_and_insert(carved_hash_hexvalue)) {
+        in_cache = true;
         carved_relative_path = CACHED;
     } else {
         /* Determine the directory and filename */
@@ -352,13 +371,7 @@ std::string feature_recorder::carve(const sbuf_t& header, const sbuf_t& data, st
         seq << std::setw(3) << std::setfill('0') << int(myfileNumber / 1000);
         const std::string thousands{seq.str()};
 
-        /* Create the directory.
-         * If it exists, the call fails.
-         * (That's faster than checking to see if it exists and then creating the directory)
-         */
-        std::filesystem::create_directory(fs.get_outdir() / name);
-        std::filesystem::create_directory(fs.get_outdir() / name / thousands);
-
+        /* The directory is created by the carve queue */
         std::string fname  = data.pos0.str() + ext;
         auto rpos = fname.rfind('/');   // see if there is a '/' in the string
         if (rpos != std::string::npos ){
@@ -385,29 +398,33 @@ std::string feature_recorder::carve(const sbuf_t& header, const sbuf_t& data, st
     xml << "</fileobject>";
     this->write(data.pos0, carved_relative_path, xml.str());
 
-    if (!in_cache) {
-        /* Write the data */
-        std::ofstream os;
-        os.open(carved_absolute_path, std::ios::out | std::ios::binary | std::ios::trunc);
-        if (!os.is_open()) {
-            throw feature_recorder::DiskWriteError(Formatter() << "cannot open file for writing:" << carved_absolute_path << ":" << std::strerror(errno));
+    if (!in_cache && !in_store) {
+        /* Copy the data for the carve queue; the sbufs may be freed when we return.
+         * Large data in a mapped file is not copied: the queue copies it from the file.
+         */
+        carve_queue::job_t job;
+        int source_fd = -1;
+        uint64_t source_offset = 0;
+        if (data.bufsize >= carve_queue::ZERO_COPY_MIN_BYTES && data.file_extent(source_fd, source_offset)) {
+            job.source_fd = ::fcntl(source_fd, F_DUPFD_CLOEXEC, 0);
         }
-        header.write(os);
-        data.write(os);
-        os.close();
-        if (os.bad()) {
-            throw feature_recorder::DiskWriteError(Formatter() << "error writing file " << carved_absolute_path);
+        const bool with_data = job.source_fd < 0;
+        job.bytes.reserve(header.bufsize + (with_data ? data.bufsize : 0));
+        if (header.bufsize > 0) job.bytes.insert(job.bytes.end(), header.get_buf(), header.get_buf() + header.bufsize);
+        if (with_data && data.bufsize > 0) job.bytes.insert(job.bytes.end(), data.get_buf(), data.get_buf() + data.bufsize);
+        if (job.source_fd >= 0) {
+            job.source_offset = source_offset;
+            job.source_bytes = data.bufsize;
         }
-
-        /* Set timestamp if necessary. Note that we do not use std::filesystem::last_write_time()
-         * as there seems to be no portable way to use it under C++17.
-         */
-        if (mtime > 0) {
-#ifdef HAVE_UTIMES
-            const struct timeval times[2] = {{mtime, 0}, {mtime, 0}};
-            utimes(carved_absolute_path.c_str(), times);
-#endif
+        job.path = carved_absolute_path;
+        job.mtime = mtime;
+        if (store) {
+            job.on_written = [store, store_digest, carved_absolute_path]() {
+                store->commit(store_digest, carved_absolute_path);
+            };
+            job.on_failed = [store, store_digest]() { store->abandon(store_digest); };
         }
+        fs.get_carve_queue().enqueue(std::move(job));
     }
     return carved_relative_path;
 }
@@ -426,7 +443,7 @@ void feature_recorder::shutdown()
  * allocated memory.
  *
  * In BE2.0, the file recorder's histograms are built in memory. If
- * they are too big for memory, file-histograms they are flushed and
- * need to be recombined in post-processing. SQL feature recorder uses the
+ * they are too big for memory, they are spilled to sorted runs that
+ * are merged when the histogram is written. SQL feature recorder uses the
  * SQLite3 to create the histograms.
  */
@@ -54,10 +54,10 @@
  *
  * Histogram - New in BE2.0, the histograms are built on-the-fly as features are recorded.
  * If memory runs below the LOW_MEMORY_THRESHOLD defined in the feature_recorder_sert,
- * the largest feature recorder is written to disk and a new feature_recorder histogram is started.
+ * the largest histogram is spilled to disk as a sorted run and the in-memory histogram is started over.
  *
  * When the feature_recorder_set shuts down, all remaining histograms are written to the disk.
- * Then, if there is any case where multiple histogram files were written, a merge-sort is performed.
+ * A histogram that was spilled is merge-sorted with its runs, so each histogram is still one file.
  */
 
 struct feature_recorder_def {
@@ -156,18 +156,7 @@ struct Feature {
     const std::string context;
 };
 
-/* Given an open feature_recorder, returns a class that iterates through it */
-class FeatureReader {
-    friend class feature_recorder;
-    FeatureReader(const class feature_recorder& fr);
-
-public:
-    std::fstream infile;
-    FeatureReader& operator++();
-    FeatureReader begin();
-    FeatureReader end();
-    Feature operator*();
-};
+/* FeatureReader, which iterates through a feature file, is in feature_reader.h */
 
 /* Feature recorder abstract base class */
 class feature_recorder {
@@ -346,8 +335,9 @@ public:
     // set up the histogram
     virtual void histogram_add(const histogram_def &h) = 0;                // add a new histogram definition
     virtual size_t histogram_count() = 0;            // how many histograms this feature recorder has
-    virtual bool histograms_write_largest() = 0;      // flushes largest histogram. returns false if no histogram could be flushed. For low memory.
+    virtual bool histograms_write_largest(size_t min_bytes) = 0; // flushes largest histogram if it has min_bytes. returns false if no histogram could be flushed. For low memory.
     virtual void histograms_write_all() = 0;
+    virtual void dump_histogram_stats(class dfxml_writer&) const {} // size and cost of each histogram
 
     // Called after each feature and context are processed, to support incremental histograms.
     // May not be used in all histogram implementation, in which case it should just return.
@@ -0,0 +1,270 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "feature_recorder_bin.h"
+#include "feature_recorder_set.h"
+#include "formatter.h"
+#include "sbuf.h"
+
+namespace {
+inline void put32(std::string& buf, uint32_t v) {
+    for (int i = 0; i < 4; i++) buf.push_back(static_cast<char>((v >> (i * 8)) & 0xff));
+}
+
+inline void put64(std::string& buf, uint64_t v) {
+    for (int i = 0; i < 8; i++) buf.push_back(static_cast<char>((v >> (i * 8)) & 0xff));
+}
+
+inline void put_string(std::string& buf, const std::string& s) {
+    put32(buf, s.size());
+    buf.append(s);
+}
+}
+
+feature_recorder_bin::feature_recorder_bin(class feature_recorder_set& fs_, const feature_recorder_def def_)
+    : feature_recorder_file(fs_, def_, false) {
+    if (fs.flags.disabled) return;
+
+    /* Binary feature files cannot be restarted, because the path table would have to be rebuilt.
+     * Always start a new file.
+     */
+    const std::lock_guard<std::mutex> lock(Mbin);
+    std::filesystem::path fname = bin_fname();
+    bin.open(fname, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    if (!bin.is_open()) {
+        throw std::invalid_argument(Formatter()
+                                    << "*** feature_recorder_bin: Cannot open binary feature file for writing "
+                                    << fname << ":" << strerror(errno));
+    }
+    wbuf = BIN_MAGIC;
+    put32(wbuf, BIN_VERSION);
+    bin.write(wbuf.data(), wbuf.size());
+}
+
+feature_recorder_bin::~feature_recorder_bin()
+{
+    if (bin.is_open()) { bin.close(); }
+}
+
+std::filesystem::path feature_recorder_bin::bin_fname() const
+{
+    return get_outdir() / (name + BIN_EXTENSION);
+}
+
+void feature_recorder_bin::flush()
+{
+    const std::lock_guard<std::mutex> lock(Mbin);
+    bin.flush();
+}
+
+void feature_recorder_bin::shutdown()
+{
+    flush();
+    feature_recorder_file::shutdown();  // merges the histograms
+}
+
+/**
+ * Write a feature record, preceded by a path record if this is the first time the path was seen.
+ * The feature and context have already been quoted by feature_recorder::write().
+ */
+void feature_recorder_bin::write0(const pos0_t& pos0, const std::string& feature, const std::string& context)
+{
+    feature_recorder::write0(pos0, feature, context); // call super to increment counter
+    if (fs.flags.disabled) { return; }
+
+    const pos0_t p = pos0.shift(fs.offset_add);
+    const bool with_context = (def.flags.no_context == false) && (context.size() > 0);
+
+    const std::lock_guard<std::mutex> lock(Mbin);
+    if (!bin.is_open()) return;
+    wbuf.clear();
+
+    uint32_t path_id = 0;
+    auto it = path_ids.find(p.path);
+    if (it == path_ids.end()) {
+        path_id = path_ids.size();
+        path_ids[p.path] = path_id;
+        wbuf.push_back(PATH_RECORD);
+        put32(wbuf, path_id);
+        put_string(wbuf, p.path);
+    } else {
+        path_id = it->second;
+    }
+
+    wbuf.push_back(FEATURE_RECORD);
+    put32(wbuf, path_id);
+    put64(wbuf, p.offset);
+    put_string(wbuf, feature);
+    put_string(wbuf, with_context ? context : std::string());
+
+    bin.write(wbuf.data(), wbuf.size());
+    if (bin.fail()) {
+        throw DiskWriteError(bin_fname().string());
+    }
+}
+
+size_t feature_recorder_bin::check_header(const sbuf_t& sbuf, const std::filesystem::path& fname)
+{
+    const char* base = reinterpret_cast<const char*>(sbuf.get_buf());
+    if (sbuf.bufsize < BIN_MAGIC.size() + 4 || std::memcmp(base, BIN_MAGIC.data(), BIN_MAGIC.size()) != 0) {
+        throw BinaryFormatError(Formatter() << fname << ": not a binary feature file");
+    }
+    if (sbuf.get32u(BIN_MAGIC.size()) != BIN_VERSION) {
+        throw BinaryFormatError(Formatter() << fname << ": unsupported version " << sbuf.get32u(BIN_MAGIC.size()));
+    }
+    return BIN_MAGIC.size() + 4;
+}
+
+/**
+ * The sbuf get functions throw range_exception_t if a record runs off the end of the file.
+ * Path ids are checked by the caller.
+ */
+size_t feature_recorder_bin::parse_record(const sbuf_t& sbuf, const std::filesystem::path& fname, size_t i, record_t& r)
+{
+    const char* base = reinterpret_cast<const char*>(sbuf.get_buf());
+    const size_t len = sbuf.bufsize;
+    try {
+        r.type = sbuf.get8u(i++);
+        if (r.type == PATH_RECORD) {
+            r.path_id     = sbuf.get32u(i);
+            uint32_t plen = sbuf.get32u(i + 4);
+            i += 8;
+            if (plen > len - i) {
+                throw BinaryFormatError(Formatter() << fname << ": bad path record at " << i);
+            }
+            r.feature = std::string_view(base + i, plen);
+            r.context = std::string_view();
+            return i + plen;
+        } else if (r.type == FEATURE_RECORD) {
+            r.path_id     = sbuf.get32u(i);
+            r.offset      = sbuf.get64u(i + 4);
+            uint32_t flen = sbuf.get32u(i + 12);
+            i += 16;
+            if (flen > len - i) {
+                throw BinaryFormatError(Formatter() << fname << ": bad feature record at " << i);
+            }
+            r.feature = std::string_view(base + i, flen);
+            i += flen;
+            uint32_t clen = sbuf.get32u(i);
+            i += 4;
+            if (clen > len - i) {
+                throw BinaryFormatError(Formatter() << fname << ": bad context at " << i);
+            }
+            r.context = std::string_view(base + i, clen);
+            return i + clen;
+        } else {
+            throw BinaryFormatError(Formatter() << fname << ": unknown record type at " << i - 1);
+        }
+    } catch (const sbuf_t::range_exception_t& e) {
+        throw BinaryFormatError(Formatter() << fname << ": truncated record at " << i);
+    }
+}
+
+/**
+ * Read the records by mapping the file into memory.
+ */
+void feature_recorder_bin::read_records(const std::filesystem::path& fname, record_callback_t cb)
+{
+    std::unique_ptr<sbuf_t> sbuf(sbuf_t::map_file(fname));
+    std::vector<std::string> paths;
+    record_t r;
+    for (size_t i = check_header(*sbuf, fname); i < sbuf->bufsize;) {
+        const size_t next = parse_record(*sbuf, fname, i, r);
+        if (r.type == PATH_RECORD) {
+            if (r.path_id != paths.size()) {
+                throw BinaryFormatError(Formatter() << fname << ": bad path record at " << i);
+            }
+            paths.emplace_back(r.feature);
+        } else {
+            if (r.path_id >= paths.size()) {
+                throw BinaryFormatError(Formatter() << fname << ": bad feature record at " << i);
+            }
+            cb(paths[r.path_id], r.offset, r.feature, r.context);
+        }
+        i = next;
+    }
+}
+
+/**
+ * Write the features in the same format that feature_recorder_file uses.
+ */
+void feature_recorder_bin::convert_to_text(const std::filesystem::path& fname, std::ostream& os)
+{
+    os << feature_file_header;
+    read_records(fname, [&os](const std::string& path, uint64_t offset, std::string_view feature, std::string_view context) {
+        if (path.size() > 0) { os << path << "-"; }
+        os << offset << '\t' << feature;
+        if (context.size() > 0) { os << '\t' << context; }
+        os << '\n';
+    });
+}
+
+/**
+ * Histograms are rebuilt from the binary file rather than the text file.
+ * Records are variable-length, so one pass checks them and notes where each chunk of about
+ * read_chunk_bytes starts; the chunks are then read by up to threads threads.
+ * Paths are not needed, so a chunk need not start with the paths that its features use.
+ * The context is unquoted, as it is when it is read from the text file.
+ */
+void feature_recorder_bin::feature_file_for_each(feature_callback_t cb, unsigned int threads)
+{
+    flush();
+    const std::filesystem::path fname = bin_fname();
+    if (threads <= 1) {
+        read_records(fname, [&cb](const std::string&, uint64_t, std::string_view feature, std::string_view context) {
+            cb(std::string(feature), unquote_string(std::string(context)));
+        });
+        return;
+    }
+
+    std::unique_ptr<sbuf_t> sbuf(sbuf_t::map_file(fname));
+    std::vector<size_t> chunks;         // where each chunk starts, then the end of the file
+    uint64_t paths = 0;
+    record_t r;
+    for (size_t i = check_header(*sbuf, fname); i < sbuf->bufsize;) {
+        if (chunks.empty() || i - chunks.back() >= read_chunk_bytes) chunks.push_back(i);
+        const size_t next = parse_record(*sbuf, fname, i, r);
+        if (r.type == PATH_RECORD && r.path_id != paths++) {
+            throw BinaryFormatError(Formatter() << fname << ": bad path record at " << i);
+        }
+        if (r.type == FEATURE_RECORD && r.path_id >= paths) {
+            throw BinaryFormatError(Formatter() << fname << ": bad feature record at " << i);
+        }
+        i = next;
+    }
+    chunks.push_back(sbuf->bufsize);
+
+    auto each_feature = [&](size_t chunk) {
+        record_t cr;
+        for (size_t i = chunks[chunk]; i < chunks[chunk + 1];) {
+            i = parse_record(*sbuf, fname, i, cr);
+            if (cr.type == FEATURE_RECORD) cb(std::string(cr.feature), unquote_string(std::string(cr.context)));
+        }
+    };
+    const size_t nchunks = chunks.size() - 1;
+    std::atomic<size_t> next {0};
+    std::mutex Merror;
+    std::exception_ptr error;
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < threads && t < nchunks; t++) {
+        workers.emplace_back([&]() {
+            for (size_t i = next++; i < nchunks; i = next++) {
+                try {
+                    each_feature(i);
+                } catch (...) {
+                    const std::lock_guard<std::mutex> lock(Merror);
+                    if (!error) error = std::current_exception();
+                }
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+    if (error) std::rethrow_exception(error);
+}
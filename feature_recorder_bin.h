@@ -0,0 +1,103 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef FEATURE_RECORDER_BIN_H
+#define FEATURE_RECORDER_BIN_H
+
+#include "config.h"
+
+#include <cinttypes>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "feature_recorder_file.h"
+
+/**
+ * feature_recorder_bin:
+ * A feature recorder that writes length-prefixed binary records instead of tab-separated lines.
+ * Features and contexts are stored exactly as they would appear in the text feature file,
+ * so the binary file can be converted back to the classic format without loss, but re-reading
+ * it requires no searching for tabs or newlines.
+ *
+ * Forensic paths are stored once in a string table and referenced by id.
+ *
+ * File layout (all integers are little-endian):
+ *   "BE20FEAT"                     8-byte magic
+ *   uint32 version
+ *   records...
+ *
+ * Each record starts with a one-byte type:
+ *   'P'  uint32 path_id, uint32 len, path bytes               - defines a forensic path
+ *   'F'  uint32 path_id, uint64 offset,
+ *        uint32 len, feature bytes, uint32 len, context bytes - a feature
+ *
+ * A path is always defined before the first feature that references it.
+ * Histograms are handled by feature_recorder_file; only the feature file format differs.
+ * To rebuild them, the file is divided into chunks of about read_chunk_bytes, which are read in parallel.
+ */
+
+class feature_recorder_bin : public feature_recorder_file {
+public:
+    inline static const std::string BIN_MAGIC {"BE20FEAT"};
+    inline static const uint32_t BIN_VERSION {1};
+    inline static const std::string BIN_EXTENSION {".bin"};
+    static const inline char PATH_RECORD {'P'};
+    static const inline char FEATURE_RECORD {'F'};
+    static inline const size_t DEFAULT_READ_CHUNK_BYTES {16 * 1024 * 1024};
+
+    class BinaryFormatError : public std::exception {
+    public:
+        std::string msg {};
+        BinaryFormatError(const std::string &m) : msg(std::string("Binary feature file error: ") + m) {}
+        const char* what() const noexcept override { return msg.c_str(); };
+    };
+
+    /* Called for each feature in a binary feature file.
+     * The views point into the mapped file and are only valid during the callback.
+     */
+    typedef std::function<void(const std::string& path, uint64_t offset,
+                               std::string_view feature, std::string_view context)> record_callback_t;
+
+    feature_recorder_bin(class feature_recorder_set& fs, const feature_recorder_def def);
+    virtual ~feature_recorder_bin();
+    virtual void flush() override;
+
+    size_t read_chunk_bytes {DEFAULT_READ_CHUNK_BYTES};
+
+    /* The binary feature file for this recorder */
+    std::filesystem::path bin_fname() const;
+
+    /* Read every feature record in a binary feature file. Throws BinaryFormatError if the file is damaged. */
+    static void read_records(const std::filesystem::path& fname, record_callback_t cb);
+
+    /* Convert a binary feature file to the classic text format */
+    static void convert_to_text(const std::filesystem::path& fname, std::ostream& os);
+
+    virtual void write0(const pos0_t& pos0, const std::string& feature, const std::string& context) override;
+    virtual void feature_file_for_each(feature_callback_t cb, unsigned int threads) override;
+
+private:
+    std::mutex Mbin{};                                  // protects bin, wbuf and path_ids
+    std::ofstream bin{};                                // where features are written
+    std::string wbuf{};                                 // record being assembled
+    std::unordered_map<std::string, uint32_t> path_ids{}; // the string table
+
+    /* One record of a mapped binary feature file; for a path record, feature is the path */
+    struct record_t {
+        char type {0};
+        uint32_t path_id {0};
+        uint64_t offset {0};
+        std::string_view feature {};
+        std::string_view context {};
+    };
+    static size_t check_header(const class sbuf_t& sbuf, const std::filesystem::path& fname); // returns where the records start
+    static size_t parse_record(const class sbuf_t& sbuf, const std::filesystem::path& fname, size_t i, record_t& r); // returns where the next starts
+
+    virtual void shutdown() override;
+};
+
+#endif
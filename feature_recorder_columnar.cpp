@@ -0,0 +1,303 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <cstring>
+#include <thread>
+
+#include "feature_recorder_columnar.h"
+#include "feature_recorder_set.h"
+#include "formatter.h"
+#include "sbuf.h"
+
+namespace {
+inline size_t pad8(size_t n) { return (n + 7) & ~size_t(7); }
+
+inline void write_padded(std::ofstream& out, const void* p, size_t n) {
+    static const char zeros[8] {};
+    out.write(static_cast<const char*>(p), n);
+    out.write(zeros, pad8(n) - n);
+}
+
+template <typename T> void write_array(std::ofstream& out, const std::vector<T>& v) {
+    write_padded(out, v.data(), v.size() * sizeof(T));
+}
+
+/* Appends s to the bytes of a string column */
+inline void add_string(std::vector<uint32_t>& offsets, std::string& data, const std::string& s) {
+    data.append(s);
+    offsets.push_back(data.size());
+}
+}
+
+feature_recorder_columnar::feature_recorder_columnar(class feature_recorder_set& fs_, const feature_recorder_def def_)
+    : feature_recorder_file(fs_, def_, false) {
+    if (fs.flags.disabled) return;
+
+    /* Like binary feature files, columnar files cannot be restarted. Always start a new file. */
+    const std::lock_guard<std::mutex> lock(Mfile);
+    std::filesystem::path fname = columnar_fname();
+    out.open(fname, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    if (!out.is_open()) {
+        throw std::invalid_argument(Formatter()
+                                    << "*** feature_recorder_columnar: Cannot open columnar feature file for writing "
+                                    << fname << ":" << strerror(errno));
+    }
+    const binary_file_header_t hdr = binary_file_header_t::make(MAGIC, VERSION);
+    write_padded(out, &hdr, sizeof(hdr));
+}
+
+feature_recorder_columnar::~feature_recorder_columnar()
+{
+    if (out.is_open()) {
+        try {
+            flush();
+        } catch (const std::exception& e) {
+            std::cerr << name << ": " << e.what() << "\n";
+        }
+        out.close();
+    }
+}
+
+std::filesystem::path feature_recorder_columnar::columnar_fname() const
+{
+    return get_outdir() / (name + COLUMNAR_EXTENSION);
+}
+
+void feature_recorder_columnar::flush()
+{
+    std::unique_lock<std::mutex> lock(Mbuild);
+    flush_row_group(lock);
+    const std::lock_guard<std::mutex> lock2(Mfile);
+    out.flush();
+}
+
+void feature_recorder_columnar::shutdown()
+{
+    flush();
+    feature_recorder_file::shutdown();  // merges the histograms
+}
+
+/**
+ * Add a feature to the row group being collected, and the path to the dictionary if this is the first time
+ * that it was seen. The feature and context have already been quoted by feature_recorder::write().
+ */
+void feature_recorder_columnar::write0(const pos0_t& pos0, const std::string& feature, const std::string& context)
+{
+    feature_recorder::write0(pos0, feature, context); // call super to increment counter
+    if (fs.flags.disabled) { return; }
+
+    const pos0_t p = pos0.shift(fs.offset_add);
+    const bool with_context = (def.flags.no_context == false) && (context.size() > 0);
+
+    std::unique_lock<std::mutex> lock(Mbuild);
+    if (!out.is_open()) return;
+    row_group_builder& rg = building;
+    auto it = path_ids.find(p.path);
+    if (it == path_ids.end()) {
+        it = path_ids.emplace(p.path, path_ids.size()).first;
+        add_string(rg.path_offsets, rg.path_data, p.path);
+    }
+    rg.offsets.push_back(p.offset);
+    rg.path_ids.push_back(it->second);
+    add_string(rg.feature_offsets, rg.feature_data, feature);
+    add_string(rg.context_offsets, rg.context_data, with_context ? context : std::string());
+
+    if (rg.rows() >= row_group_rows || rg.bytes() >= row_group_bytes) flush_row_group(lock);
+}
+
+/* The next row group is started, and this one written, before other threads can add to either */
+void feature_recorder_columnar::flush_row_group(std::unique_lock<std::mutex>& build_lock)
+{
+    if (building.rows() == 0) {
+        build_lock.unlock();
+        return;
+    }
+    row_group_builder rg;
+    std::swap(rg, building);
+    building.first_new_path = path_ids.size();
+    const std::lock_guard<std::mutex> lock(Mfile);
+    build_lock.unlock();
+    write_row_group(rg);
+}
+
+void feature_recorder_columnar::write_row_group(const row_group_builder& rg)
+{
+    const size_t rows = rg.rows();
+    const size_t new_paths = rg.path_offsets.size() - 1;
+    row_group_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, ROW_GROUP_MAGIC, sizeof(ROW_GROUP_MAGIC));
+    hdr.rows = rows;
+    hdr.first_new_path = rg.first_new_path;
+    hdr.new_paths = new_paths;
+    hdr.path_bytes = rg.path_data.size();
+    hdr.feature_bytes = rg.feature_data.size();
+    hdr.context_bytes = rg.context_data.size();
+    hdr.body_bytes = pad8(rows * sizeof(uint64_t)) + pad8(rows * sizeof(uint32_t)) +
+                     pad8((new_paths + 1) * sizeof(uint32_t)) + pad8(hdr.path_bytes) +
+                     2 * pad8((rows + 1) * sizeof(uint32_t)) + pad8(hdr.feature_bytes) + pad8(hdr.context_bytes);
+
+    write_padded(out, &hdr, sizeof(hdr));
+    write_array(out, rg.offsets);
+    write_array(out, rg.path_ids);
+    write_array(out, rg.path_offsets);
+    write_padded(out, rg.path_data.data(), rg.path_data.size());
+    write_array(out, rg.feature_offsets);
+    write_padded(out, rg.feature_data.data(), rg.feature_data.size());
+    write_array(out, rg.context_offsets);
+    write_padded(out, rg.context_data.data(), rg.context_data.size());
+    if (out.fail()) {
+        throw DiskWriteError(columnar_fname().string());
+    }
+    row_groups_written++;
+}
+
+/****************************************************************
+ *** READING
+ ****************************************************************/
+
+/**
+ * Every section is checked to be within the row group, and every string column's offsets to be in order
+ * and within its bytes, before any of them is used.
+ */
+feature_recorder_columnar::file_reader::file_reader(const std::filesystem::path& fname)
+    : sbuf(sbuf_t::map_file(fname))
+{
+    const char* base = reinterpret_cast<const char*>(sbuf->get_buf());
+    const size_t len = sbuf->bufsize;
+
+    check_binary_file_header<ColumnarFormatError>(base, len, MAGIC, VERSION, fname, "columnar feature file");
+
+    size_t pos = pad8(sizeof(binary_file_header_t));
+    while (pos < len) {
+        row_group_header_t hdr;
+        if (len - pos < sizeof(hdr)) {
+            throw ColumnarFormatError(Formatter() << fname << ": truncated row group at " << pos);
+        }
+        memcpy(&hdr, base + pos, sizeof(hdr));
+        if (memcmp(hdr.magic, ROW_GROUP_MAGIC, sizeof(ROW_GROUP_MAGIC)) != 0 || hdr.first_new_path != paths.size()) {
+            throw ColumnarFormatError(Formatter() << fname << ": bad row group at " << pos);
+        }
+        pos += pad8(sizeof(hdr));
+        if (hdr.body_bytes > len - pos) {
+            throw ColumnarFormatError(Formatter() << fname << ": truncated row group at " << pos);
+        }
+        const size_t end = pos + hdr.body_bytes;
+        auto section = [&](uint64_t bytes) -> const char* {
+            if (bytes > end - pos || pad8(bytes) > end - pos) {
+                throw ColumnarFormatError(Formatter() << fname << ": bad row group section at " << pos);
+            }
+            const char* p = base + pos;
+            pos += pad8(bytes);
+            return p;
+        };
+        auto string_offsets = [&](size_t n, uint64_t bytes) -> const uint32_t* {
+            const uint32_t* offsets = reinterpret_cast<const uint32_t*>(section((n + 1) * sizeof(uint32_t)));
+            if (offsets[0] != 0 || offsets[n] != bytes) {
+                throw ColumnarFormatError(Formatter() << fname << ": bad string offsets at " << pos);
+            }
+            for (size_t i = 0; i < n; i++) {
+                if (offsets[i] > offsets[i + 1]) {
+                    throw ColumnarFormatError(Formatter() << fname << ": bad string offsets at " << pos);
+                }
+            }
+            return offsets;
+        };
+
+        row_group_t rg;
+        rg.rows = hdr.rows;
+        rg.offsets = reinterpret_cast<const uint64_t*>(section(hdr.rows * sizeof(uint64_t)));
+        rg.path_ids = reinterpret_cast<const uint32_t*>(section(hdr.rows * sizeof(uint32_t)));
+        const uint32_t* path_offsets = string_offsets(hdr.new_paths, hdr.path_bytes);
+        const char* path_data = section(hdr.path_bytes);
+        for (size_t i = 0; i < hdr.new_paths; i++) {
+            paths.emplace_back(path_data + path_offsets[i], path_offsets[i + 1] - path_offsets[i]);
+        }
+        for (size_t i = 0; i < rg.rows; i++) {
+            if (rg.path_ids[i] >= paths.size()) {
+                throw ColumnarFormatError(Formatter() << fname << ": bad path id in row group ending at " << end);
+            }
+        }
+        rg.feature_offsets = string_offsets(hdr.rows, hdr.feature_bytes);
+        rg.feature_data = section(hdr.feature_bytes);
+        rg.context_offsets = string_offsets(hdr.rows, hdr.context_bytes);
+        rg.context_data = section(hdr.context_bytes);
+        if (pos != end) {
+            throw ColumnarFormatError(Formatter() << fname << ": bad row group size at " << pos);
+        }
+        row_groups.push_back(rg);
+    }
+}
+
+feature_recorder_columnar::file_reader::~file_reader() {}
+
+size_t feature_recorder_columnar::file_reader::rows() const
+{
+    size_t count = 0;
+    for (const auto& rg : row_groups) count += rg.rows;
+    return count;
+}
+
+void feature_recorder_columnar::read_records(const std::filesystem::path& fname, record_callback_t cb)
+{
+    file_reader reader(fname);
+    for (const auto& rg : reader.row_groups) {
+        for (size_t i = 0; i < rg.rows; i++) {
+            cb(reader.paths[rg.path_ids[i]], rg.offsets[i], rg.feature(i), rg.context(i));
+        }
+    }
+}
+
+/**
+ * Write the features in the same format that feature_recorder_file uses.
+ */
+void feature_recorder_columnar::convert_to_text(const std::filesystem::path& fname, std::ostream& os)
+{
+    os << feature_file_header;
+    read_records(fname, [&os](std::string_view path, uint64_t offset, std::string_view feature, std::string_view context) {
+        if (path.size() > 0) { os << path << "-"; }
+        os << offset << '\t' << feature;
+        if (context.size() > 0) { os << '\t' << context; }
+        os << '\n';
+    });
+}
+
+/**
+ * Histograms are rebuilt from the columnar file rather than the text file.
+ * The row groups are independent, so each thread takes the next one.
+ * The context is unquoted, as it is when it is read from the text file.
+ */
+void feature_recorder_columnar::feature_file_for_each(feature_callback_t cb, unsigned int threads)
+{
+    flush();
+    file_reader reader(columnar_fname());
+    auto each_row = [&](const row_group_t& rg) {
+        for (size_t i = 0; i < rg.rows; i++) {
+            cb(std::string(rg.feature(i)), unquote_string(std::string(rg.context(i))));
+        }
+    };
+    if (threads <= 1 || reader.row_groups.size() <= 1) {
+        for (const auto& rg : reader.row_groups) each_row(rg);
+        return;
+    }
+
+    std::atomic<size_t> next {0};
+    std::mutex Merror;
+    std::exception_ptr error;
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < threads && t < reader.row_groups.size(); t++) {
+        workers.emplace_back([&]() {
+            for (size_t i = next++; i < reader.row_groups.size(); i = next++) {
+                try {
+                    each_row(reader.row_groups[i]);
+                } catch (...) {
+                    const std::lock_guard<std::mutex> lock(Merror);
+                    if (!error) error = std::current_exception();
+                }
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+    if (error) std::rethrow_exception(error);
+}
@@ -0,0 +1,153 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef FEATURE_RECORDER_COLUMNAR_H
+#define FEATURE_RECORDER_COLUMNAR_H
+
+#include "config.h"
+
+#include <atomic>
+#include <cinttypes>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "binary_file_header.h"
+#include "feature_recorder_file.h"
+
+/**
+ * feature_recorder_columnar:
+ * A feature recorder that writes its features column by column, in row groups, so that analysis tools
+ * can load a feature file by mapping it rather than by parsing it.
+ *
+ * Features are collected in a row group in memory, which is written when it holds row_group_rows rows
+ * or row_group_bytes bytes of strings, and by flush(). Within a row group each column is one array,
+ * and the string columns are laid out as in Apache Arrow: an array of rows+1 offsets followed by the bytes.
+ * The path column is dictionary-encoded: it holds path ids, and each row group carries the paths
+ * that it added to the dictionary (a delta), so a path is stored once per file.
+ * Features and contexts are stored exactly as they would appear in the text feature file.
+ *
+ * File layout (native byte order, which reading checks), with every section padded to 8 bytes:
+ *   binary_file_header_t
+ *   row groups, each of which is:
+ *     row_group_header_t
+ *     offset:    uint64[rows]
+ *     path id:   uint32[rows]
+ *     new paths: uint32[new_paths+1] offsets, bytes
+ *     feature:   uint32[rows+1] offsets, bytes
+ *     context:   uint32[rows+1] offsets, bytes
+ *
+ * This is not Parquet or Arrow IPC, whose metadata needs Thrift or FlatBuffers; it needs nothing
+ * but this file. Histograms are handled by feature_recorder_file, which reads the row groups in parallel.
+ */
+class feature_recorder_columnar : public feature_recorder_file {
+public:
+    static inline const char MAGIC[8] {'B', 'E', '2', '0', 'C', 'O', 'L', 'S'};
+    static inline const char ROW_GROUP_MAGIC[4] {'R', 'G', 'R', 'P'};
+    static inline const uint32_t VERSION {1};
+    static inline const std::string COLUMNAR_EXTENSION {".cols"};
+    static inline const size_t DEFAULT_ROW_GROUP_ROWS {64 * 1024};
+    static inline const size_t DEFAULT_ROW_GROUP_BYTES {64 * 1024 * 1024}; // must be below 4GiB
+
+    struct row_group_header_t {
+        char     magic[4];
+        uint32_t rows;
+        uint32_t first_new_path;        // id of the first path that this row group adds to the dictionary
+        uint32_t new_paths;
+        uint64_t path_bytes;
+        uint64_t feature_bytes;
+        uint64_t context_bytes;
+        uint64_t body_bytes;            // what follows this header
+    };
+
+    class ColumnarFormatError : public binary_file_error {
+    public:
+        ColumnarFormatError(const std::string &m) : binary_file_error("Columnar feature file error", m) {}
+    };
+
+    /* A row group of a mapped file */
+    struct row_group_t {
+        size_t rows {0};
+        const uint64_t* offsets {nullptr};
+        const uint32_t* path_ids {nullptr};
+        const uint32_t* feature_offsets {nullptr};
+        const char* feature_data {nullptr};
+        const uint32_t* context_offsets {nullptr};
+        const char* context_data {nullptr};
+        std::string_view feature(size_t i) const {
+            return std::string_view(feature_data + feature_offsets[i], feature_offsets[i + 1] - feature_offsets[i]);
+        }
+        std::string_view context(size_t i) const {
+            return std::string_view(context_data + context_offsets[i], context_offsets[i + 1] - context_offsets[i]);
+        }
+    };
+
+    /* Maps a columnar feature file and checks it; throws ColumnarFormatError if it is damaged.
+     * The views are valid while the file_reader exists.
+     */
+    class file_reader {
+    public:
+        file_reader(const std::filesystem::path& fname);
+        ~file_reader();
+        std::vector<row_group_t> row_groups {};
+        std::vector<std::string_view> paths {}; // the dictionary; a row's path is paths[path_ids[i]]
+        size_t rows() const;
+    private:
+        std::unique_ptr<class sbuf_t> sbuf;
+    };
+
+    typedef std::function<void(std::string_view path, uint64_t offset,
+                               std::string_view feature, std::string_view context)> record_callback_t;
+
+    feature_recorder_columnar(class feature_recorder_set& fs, const feature_recorder_def def);
+    virtual ~feature_recorder_columnar();
+    virtual void flush() override;      // also writes the row group being collected
+
+    size_t row_group_rows {DEFAULT_ROW_GROUP_ROWS};
+    size_t row_group_bytes {DEFAULT_ROW_GROUP_BYTES};
+    std::atomic<uint64_t> row_groups_written {0};
+
+    /* The columnar feature file for this recorder */
+    std::filesystem::path columnar_fname() const;
+
+    /* Read every feature in a columnar feature file, in the order written */
+    static void read_records(const std::filesystem::path& fname, record_callback_t cb);
+
+    /* Convert a columnar feature file to the classic text format */
+    static void convert_to_text(const std::filesystem::path& fname, std::ostream& os);
+
+    virtual void write0(const pos0_t& pos0, const std::string& feature, const std::string& context) override;
+    virtual void feature_file_for_each(feature_callback_t cb, unsigned int threads) override;
+
+private:
+    struct row_group_builder {
+        std::vector<uint64_t> offsets {};
+        std::vector<uint32_t> path_ids {};
+        uint32_t first_new_path {0};
+        std::vector<uint32_t> path_offsets {0};
+        std::string path_data {};
+        std::vector<uint32_t> feature_offsets {0};
+        std::string feature_data {};
+        std::vector<uint32_t> context_offsets {0};
+        std::string context_data {};
+        size_t rows() const { return offsets.size(); }
+        size_t bytes() const { return path_data.size() + feature_data.size() + context_data.size(); }
+    };
+    std::mutex Mbuild{};                // protects building and path_ids
+    row_group_builder building{};
+    std::unordered_map<std::string, uint32_t> path_ids{}; // the dictionary
+    std::mutex Mfile{};                 // protects out; taken before Mbuild is released, so row groups stay in order
+    std::ofstream out{};
+
+    void write_row_group(const row_group_builder& rg); // with Mfile held
+    void flush_row_group(std::unique_lock<std::mutex>& build_lock); // with Mbuild held; releases it
+
+    virtual void shutdown() override;
+};
+
+#endif
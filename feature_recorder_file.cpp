@@ -9,7 +9,10 @@
 #include <cstdarg>
 #include <regex>
 #include <exception>
+#include <queue>
+#include <thread>
 
+#include "feature_reader.h"
 #include "feature_recorder_file.h"
 #include "feature_recorder_set.h"
 #include "unicode_escape.h"
@@ -17,6 +20,8 @@
 #include "word_and_context_list.h"
 #include "formatter.h"
 
+#include "dfxml_cpp/src/dfxml_writer.h"
+
 #ifndef MAXPATHLEN
 #define MAXPATHLEN 65536
 #endif
@@ -89,9 +94,15 @@ bool feature_recorder_file::extract_feature_context(const std::string& line, std
  */
 // TODO - make it register itself with the feature recorder set. and do the stuff that's in init.
 feature_recorder_file::feature_recorder_file(class feature_recorder_set& fs_, const feature_recorder_def def_)
+    : feature_recorder_file(fs_, def_, true) {
+}
+
+feature_recorder_file::feature_recorder_file(class feature_recorder_set& fs_, const feature_recorder_def def_,
+                                             bool open_feature_file)
     : feature_recorder(fs_, def_) {
     /* If the feature recorder set is disabled, just return. */
     if (fs.flags.disabled) return;
+    if (!open_feature_file) return;
 
     /* Open the file recorder for output.
      * If the file exists, seek to the end and find the last complete line, and start there.
@@ -171,7 +182,13 @@ void feature_recorder_file::banner_stamp(std::ostream& os, const std::string& he
 
 /* statics */
 void feature_recorder_file::flush()    { ios.flush(); }
-void feature_recorder_file::shutdown() { ios.flush(); }
+void feature_recorder_file::shutdown()
+{
+    ios.flush();
+    for (auto& h : histograms) {
+        h->merge_thread_local();
+    }
+}
 
 /**
  * We now have three kinds of histograms:
@@ -232,13 +249,18 @@ void feature_recorder_file::write0(const std::string& str)
 void feature_recorder_file::write0(const pos0_t& pos0, const std::string& feature, const std::string& context) {
     feature_recorder::write0(pos0, feature, context); // call super to increment counter
     if (fs.flags.disabled) { return; }
-    std::stringstream ss;
-    ss << pos0.shift(fs.offset_add).str() << '\t' << feature;
+    /* Each thread reuses its line, and the position is shifted as it is rendered */
+    static thread_local std::string line;
+    line.clear();
+    pos0.append_to(line, fs.offset_add);
+    line += '\t';
+    line += feature;
     if ((def.flags.no_context == false) && (context.size() > 0)) {
-        ss << '\t' << context;
+        line += '\t';
+        line += context;
     }
 
-    write0(ss.str());                                 // and do the actual write
+    write0(line);                                     // and do the actual write
 }
 
 /****************************************************************
@@ -258,7 +280,8 @@ void feature_recorder_file::histogram_add(const struct histogram_def& hdef)
     }
     histograms.push_back( std::make_unique<AtomicUnicodeHistogram>(hdef) );
     histograms.back()->debug = debug_histograms;
-
+    histograms.back()->thread_local_threshold = histogram_thread_local_threshold;
+    histogram_spills.push_back( std::make_unique<histogram_spill>(get_outdir() / (name + "_" + hdef.suffix + ".run")) );
 }
 
 
@@ -268,15 +291,59 @@ size_t feature_recorder_file::histogram_count()
     return histograms.size();
 }
 
-bool feature_recorder_file::histograms_write_largest()
+/* Spill the largest histogram to a sorted run, if it has at least min_bytes.
+ * Approximate histograms have bounded memory and are never spilled.
+ */
+bool feature_recorder_file::histograms_write_largest(size_t min_bytes)
 {
-    std::cerr << "TODO: Implement histograms_write_largest\n";
-    return false;                       // need to implement
+    size_t largest = histograms.size();
+    size_t largest_bytes = 0;
+    for (size_t i = 0; i < histograms.size(); i++) {
+        if (histograms[i]->def.approximate_top_n > 0 || histograms[i]->size() == 0) continue;
+        size_t b = histograms[i]->bytes();
+        if (b > largest_bytes) {
+            largest = i;
+            largest_bytes = b;
+        }
+    }
+    if (largest == histograms.size() || largest_bytes < min_bytes) return false;
+    if (debug_histograms) {
+        std::cerr << "feature_recorder_file::histograms_write_largest " << histograms[largest]->def
+                  << " bytes=" << largest_bytes << std::endl;
+    }
+    return histogram_spills[largest]->spill(*histograms[largest]) > 0;
+}
+
+void feature_recorder_file::dump_histogram_stats(dfxml_writer& writer) const
+{
+    for (const auto& h : histograms) {
+        writer.set_oneline(true);
+        writer.push("histogram");
+        writer.xmlout("name", h->def.name);
+        writer.xmlout("feature", name);
+        writer.xmlout("entries", static_cast<uint64_t>(h->size()));
+        writer.xmlout("bytes", static_cast<uint64_t>(h->bytes()));
+        if (h->thread_local_threshold > 0) {
+            auto tls = h->get_thread_local_stats();
+            writer.xmlout("thread_local_tables", static_cast<uint64_t>(tls.tables));
+            writer.xmlout("thread_local_bytes", static_cast<uint64_t>(tls.bytes));
+            writer.xmlout("thread_local_merges", tls.merges);
+            writer.xmlout("thread_local_merge_seconds", static_cast<double>(tls.merge_ns) / 1E9);
+        }
+        writer.pop("histogram");
+        writer.set_oneline(false);
+    }
 }
 
-/* Write all of the histograms associated with this feature recorder. */
+/* Write all of the histograms associated with this feature recorder.
+ * If they were not built incrementally, build them all with a single pass over the feature file.
+ */
 void feature_recorder_file::histograms_write_all()
 {
+    if (disable_incremental_histograms && histograms.size() > 0) {
+        histograms_write_from_file();
+        return;
+    }
     for (auto& h : histograms) {
         this->histogram_write(*h);
     }
@@ -303,6 +370,19 @@ void feature_recorder_file::histogram_write_from_memory(AtomicUnicodeHistogram&
     }
 
     bool first = true;
+    histogram_spill* spill = histogram_spill_for(h);
+    if (spill && spill->runs() > 0) {
+        /* part of the histogram is on disk */
+        spill->merge(h, histogram_memory_budget, [&](const AtomicUnicodeHistogram::auh_t::item& it) {
+            if ( first ) {
+                banner_stamp( hfile, histogram_file_header );
+                first = false;
+            }
+            hfile << it;
+        });
+        hfile.close();
+        return;
+    }
     auto r = h.makeReport(0); // sorted and clear
     for(const auto &it : r){
         if ( first ) {
@@ -315,6 +395,32 @@ void feature_recorder_file::histogram_write_from_memory(AtomicUnicodeHistogram&
     h.clear();                          // free up the memory
 }
 
+histogram_spill* feature_recorder_file::histogram_spill_for(const AtomicUnicodeHistogram& h)
+{
+    for (size_t i = 0; i < histograms.size() && i < histogram_spills.size(); i++) {
+        if (histograms[i].get() == &h) return histogram_spills[i].get();
+    }
+    return nullptr;
+}
+
+/**
+ * Read every feature in the feature file and call cb with the feature and the unquoted context.
+ * With more than one thread, cb is called concurrently.
+ */
+void feature_recorder_file::feature_file_for_each(feature_callback_t cb, unsigned int threads)
+{
+    flush();
+    std::filesystem::path ifname = fname_in_outdir("", NO_COUNT);  // source of features
+    if (!std::filesystem::exists(ifname)) {
+        std::cerr << "Cannot open histogram input file: " << ifname << std::endl;
+        return;
+    }
+    FeatureReader reader(ifname);
+    reader.for_each_parallel([&cb](const FeatureView& fv) {
+        cb(std::string(fv.feature), unquote_string(std::string(fv.context)));
+    }, threads);
+}
+
 void feature_recorder_file::histogram_write_from_file(AtomicUnicodeHistogram& h)
 {
     /* Read each line of the feature file and add it to the histogram.
@@ -324,39 +430,126 @@ void feature_recorder_file::histogram_write_from_file(AtomicUnicodeHistogram& h)
 
     if (debug_histograms) std::cerr << "feature_recorder_file::histogram_write_from_file " << h.def << std::endl;
 
+    int histogram_counter = 0;
+    feature_file_for_each([&](const std::string& feature, const std::string& context) {
+        if (context.size() == 0) return; // lines without context were never histogrammed from the file
+        /* if the feature is in the context, feature is in utf8, otherwise it was utf16 and converted */
+        bool found_utf16 = (context.find(feature) == std::string::npos);
+        try {
+            h.add0( feature, context, found_utf16 );
+        }
+        catch (const std::bad_alloc &e) {
+            histogram_spill* spill = histogram_spill_for(h);
+            if (spill) {
+                /* merged back in by histogram_write_from_memory() */
+                std::cerr << "MEMORY OVERFLOW GENERATING HISTOGRAM  "
+                          << name << ". Spilling run " << histogram_counter++ << std::endl;
+                spill->spill(h);
+            } else {
+                std::cerr << "MEMORY OVERFLOW GENERATING HISTOGRAM  "
+                          << name << ". Dumping Histogram " << histogram_counter++ << std::endl;
+                histogram_write_from_memory(h);
+            }
+        }
+    }, 1);
+    histogram_write_from_memory(h);                // write out the histogram
+}
+
+void feature_recorder_file::histograms_write_from_file()
+{
+    unsigned int partitions = histogram_rebuild_threads ? histogram_rebuild_threads : std::thread::hardware_concurrency();
+    if (partitions == 0) partitions = 1;
 
-    /* This is a file based histogram. We will be reading from one file and writing to another */
-    std::filesystem::path ifname = fname_in_outdir("", NO_COUNT);  // source of features
-    std::ifstream f(ifname.c_str());
-    if(!f.is_open()){
-        std::cerr << "Cannot open histogram input file: " << ifname << std::endl;
-        return;
+    if (debug_histograms) {
+        std::cerr << "feature_recorder_file::histograms_write_from_file " << name
+                  << " histograms=" << histograms.size() << " partitions=" << partitions << std::endl;
     }
-    for (int histogram_counter = 0 ; histogram_counter<MAX_HISTOGRAM_FILES; histogram_counter++){
-        std::string line;
-        while(getline(f,line)){
-            if(line.size()==0) continue; // empty line
-            if(line[0]=='#') continue;   // comment line
-            truncate_at(line,'\r');      // truncate at a \r if there is one.
-
-            std::string feature;
-            std::string context;
-            if (extract_feature_context(line, feature, context)) {
-                /* if the feature is in the context, feature is in utf8, otherwise it was utf16 and converted */
-                bool found_utf16 = (context.find(feature) == std::string::npos);
-                try {
-                    h.add0( feature, context, found_utf16 );
-                }
-                catch (const std::bad_alloc &e) {
-                    std::cerr << "MEMORY OVERFLOW GENERATING HISTOGRAM  "
-                              << name << ". Dumping Histogram " << histogram_counter << std::endl;
-                    histogram_write_from_memory(h);
+
+    std::vector<std::vector<std::unique_ptr<AtomicUnicodeHistogram>>> shards(histograms.size());
+    for (size_t i = 0; i < histograms.size(); i++) {
+        const unsigned int nshards = histograms[i]->def.approximate_top_n > 0 ? 1 : partitions;
+        for (unsigned int p = 0; p < nshards; p++) {
+            shards[i].push_back(std::make_unique<AtomicUnicodeHistogram>(histograms[i]->def));
+        }
+    }
+
+    try {
+        feature_file_for_each([&](const std::string& feature, const std::string& context) {
+            if (context.size() == 0) return; // lines without context were never histogrammed from the file
+            bool found_utf16 = (context.find(feature) == std::string::npos);
+            std::string key;
+            for (size_t i = 0; i < histograms.size(); i++) {
+                if (histograms[i]->make_key(feature, context, key)) {
+                    shards[i][std::hash<std::string>{}(key) % shards[i].size()]->add_key(key, found_utf16);
                 }
             }
+        }, partitions);
+    }
+    catch (const std::bad_alloc &e) {
+        /* Fall back to one histogram at a time, which can dump partial histograms */
+        std::cerr << "MEMORY OVERFLOW GENERATING HISTOGRAMS " << name << ". Building them one at a time." << std::endl;
+        shards.clear();
+        for (auto& h : histograms) {
+            histogram_write_from_file(*h);
         }
+        return;
+    }
+
+    uint64_t total = 0;
+    for (const auto& hs : shards) {
+        for (const auto& shard : hs) total += shard->bytes();
+    }
+    histogram_rebuild_bytes = total;
+    for (size_t i = 0; i < histograms.size(); i++) {
+        histogram_write_shards(histograms[i]->def, shards[i]);
+        shards[i].clear();              // free up the memory
     }
-    f.close();
-    histogram_write_from_memory(h);                // write out the histogram
+}
+
+/**
+ * Sort each shard in its own thread, then merge the sorted reports into the histogram file.
+ * A key is only ever in one shard, so the merge never has to combine tallies.
+ */
+void feature_recorder_file::histogram_write_shards(const histogram_def& def,
+                                                   std::vector<std::unique_ptr<AtomicUnicodeHistogram>>& shards)
+{
+    std::vector<AtomicUnicodeHistogram::FrequencyReportVector> reports(shards.size());
+    std::vector<std::thread> threads;
+    for (size_t p = 0; p < shards.size(); p++) {
+        threads.emplace_back([&reports, &shards, p]() { reports[p] = shards[p]->makeReport(0); });
+    }
+    for (auto& t : threads) t.join();
+
+    typedef std::pair<size_t, size_t> cursor_t; // (shard, position in shard's report)
+    auto after = [&reports](const cursor_t& a, const cursor_t& b) {
+        return AtomicUnicodeHistogram::histogram_compare(reports[b.first][b.second], reports[a.first][a.second]);
+    };
+    std::priority_queue<cursor_t, std::vector<cursor_t>, decltype(after)> heap(after);
+    for (size_t p = 0; p < reports.size(); p++) {
+        if (reports[p].size() > 0) heap.push(cursor_t(p, 0));
+    }
+
+    auto fname = fname_in_outdir(def.suffix, NEXT_COUNT);
+    std::fstream hfile;
+    hfile.open(fname.c_str(), std::ios_base::out);
+    if (!hfile.is_open()) {
+        throw std::runtime_error("Cannot open feature histogram file " + fname.string());
+    }
+    bool first = true;
+    size_t written = 0;
+    while (!heap.empty()) {
+        /* an approximate histogram's top-N table keeps more than N keys, but only N are wanted */
+        if (def.approximate_top_n > 0 && written++ == def.approximate_top_n) break;
+        cursor_t c = heap.top();
+        heap.pop();
+        if (first) {
+            banner_stamp( hfile, histogram_file_header );
+            first = false;
+        }
+        hfile << reports[c.first][c.second];
+        if (c.second + 1 < reports[c.first].size()) heap.push(cursor_t(c.first, c.second + 1));
+    }
+    hfile.close();
 }
 
 void feature_recorder_file::histogram_write(AtomicUnicodeHistogram& h)
@@ -384,7 +577,22 @@ void feature_recorder_file::histograms_incremental_add_feature_context(const std
         std::cerr << "feature_recorder_file::histograms_incremental_add_feature_context feature="
                   << feature << " context=" << context << std::endl;
     }
-    for (auto &h : histograms) {
-        h->add_feature_context(feature, context); // add the original feature
+    if (histograms.size() > 0 && feature.size() > 0) {
+        const histogram_feature f(feature); // normalized once for all of the histograms
+        for (auto &h : histograms) {
+            h->add_feature(f, context);     // add the original feature
+        }
+    }
+
+    /* bytes() takes a lock per stripe, so the budget is only checked now and then */
+    if (histogram_memory_budget > 0 && (++histogram_spill_checks % HISTOGRAM_SPILL_CHECK_INTERVAL) == 0) {
+        std::unique_lock<std::mutex> lock(Mspill, std::try_to_lock);
+        if (!lock.owns_lock()) return;  // another thread is already spilling
+        size_t total = 0;
+        for (const auto& h : histograms) total += h->bytes();
+        while (total > histogram_memory_budget && histograms_write_largest(0)) {
+            total = 0;
+            for (const auto& h : histograms) total += h->bytes();
+        }
     }
 }
@@ -8,6 +8,7 @@
 
 #include <atomic>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <regex>
@@ -17,6 +18,7 @@
 #include <mutex>
 
 #include "feature_recorder.h"
+#include "histogram_spill.h"
 #include "pos0.h"
 #include "sbuf.h"
 
@@ -37,6 +39,12 @@ public:
         return ch>='0' && ch<='7';
     }
 
+protected:
+    /* Subclasses that write their features in a different on-disk format
+     * use this constructor so that the text feature file is not created.
+     */
+    feature_recorder_file(class feature_recorder_set& fs, const feature_recorder_def def, bool open_feature_file);
+
 private:
     std::mutex Mios{};  // mutex for IOS
     std::fstream ios{}; // where features are written
@@ -47,6 +55,7 @@ private:
     //static const std::string feature_file_header;
     //static const std::string bulk_extractor_version_header;
 
+protected:
     virtual void shutdown() override;
 
 public:
@@ -71,6 +80,18 @@ public:
     // the histograms are made in memory with the AtomicUnicodeHistogram object.
     // Each one contains the histogram_def.
     std::vector<std::unique_ptr<AtomicUnicodeHistogram>> histograms{};
+    size_t histogram_thread_local_threshold {0}; // given to histograms as they are added; see AtomicUnicodeHistogram
+
+    /* Spilling. If histogram_memory_budget>0 and the histograms use more than that many bytes, the largest is
+     * spilled to a sorted run with histograms_write_largest(). When the histogram is written, its runs are merged
+     * back in, so each histogram still produces a single file. The budget also bounds the memory used by the merge.
+     */
+    size_t histogram_memory_budget {0};
+    std::vector<std::unique_ptr<histogram_spill>> histogram_spills{}; // one for each histogram
+    std::atomic<uint64_t> histogram_spill_checks {0};
+    std::mutex Mspill{};                // only one thread spills at a time
+    static inline const uint64_t HISTOGRAM_SPILL_CHECK_INTERVAL {1024}; // features between checks of the budget
+    histogram_spill* histogram_spill_for(const AtomicUnicodeHistogram& h); // nullptr for histograms not in this recorder
 
     virtual size_t histogram_count() override;                 // how many histograms it has
     virtual void histogram_add(const struct histogram_def& def) override;   // add a new histogram
@@ -79,10 +100,24 @@ public:
 
     virtual void histogram_write_from_memory(AtomicUnicodeHistogram& h); // actually write this histogram
     virtual void histogram_write_from_file(AtomicUnicodeHistogram& h); // actually write this histogram
+
+    /* Rebuilding histograms from the feature file.
+     * histograms_write_from_file() builds every histogram of this recorder in one pass over the feature file.
+     * Keys are hash-partitioned into shards that are filled concurrently; the shards are then sorted in
+     * parallel and k-way merged into the histogram file. An approximate histogram has a single shard,
+     * so that its memory is bounded by its own sketch and top-N table whatever the number of threads.
+     */
+    typedef std::function<void(const std::string& feature, const std::string& context)> feature_callback_t;
+    unsigned int histogram_rebuild_threads {0}; // 0 means std::thread::hardware_concurrency()
+    std::atomic<uint64_t> histogram_rebuild_bytes {0}; // bytes in the shards of the last rebuild, when full
+    virtual void feature_file_for_each(feature_callback_t cb, unsigned int threads); // context is unquoted
+    virtual void histograms_write_from_file();
+    void histogram_write_shards(const histogram_def& def, std::vector<std::unique_ptr<AtomicUnicodeHistogram>>& shards);
     virtual void histogram_write(AtomicUnicodeHistogram& h); // write this histogram
     virtual void histograms_incremental_add_feature_context(const std::string& feature, const std::string& context) override;
-    virtual bool histograms_write_largest() override;
+    virtual bool histograms_write_largest(size_t min_bytes) override;
     virtual void histograms_write_all() override;
+    virtual void dump_histogram_stats(class dfxml_writer& writer) const override;
 };
 
 /** @} */
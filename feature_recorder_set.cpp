@@ -2,6 +2,11 @@
 
 #include "config.h" // needed for hash_t and feature_recorder_sql.h
 
+#include <algorithm>
+#include <thread>
+
+#include "feature_recorder_bin.h"
+#include "feature_recorder_columnar.h"
 #include "feature_recorder_file.h"
 #include "feature_recorder_set.h"
 #include "feature_recorder_sql.h"
@@ -48,12 +53,30 @@ feature_recorder_set::hash_func_t feature_recorder_set::hash_def::hash_func_for_
     throw std::invalid_argument("invalid hasher name: " + name);
 }
 
+namespace {
+template <typename generator>
+std::string hash_pair(const uint8_t* buf1, size_t bufsize1, const uint8_t* buf2, size_t bufsize2) {
+    generator g;
+    g.update(buf1, bufsize1);
+    g.update(buf2, bufsize2);
+    return g.final().hexdigest();
+}
+}
+
+feature_recorder_set::hash_pair_func_t feature_recorder_set::hash_def::hash_pair_func_for_name(const std::string& name) {
+    if (name == "md5" || name == "MD5") { return hash_pair<dfxml::md5_generator>; }
+    if (name == "sha1" || name == "SHA1" || name == "sha-1" || name == "SHA-1") { return hash_pair<dfxml::sha1_generator>; }
+    if (name == "sha256" || name == "SHA256" || name == "sha-256" || name == "SHA-256") { return hash_pair<dfxml::sha256_generator>; }
+    throw std::invalid_argument("invalid hasher name: " + name);
+}
+
 /**
  * Constructor.
  * Create an empty recorder with no outdir.
  */
 feature_recorder_set::feature_recorder_set(const flags_t& flags_, const scanner_config& sc_)
-    : flags(flags_), sc(sc_), hasher(hash_def(sc_.hash_algorithm, hash_def::hash_func_for_name(sc_.hash_algorithm))) {
+    : flags(flags_), sc(sc_), hasher(hash_def(sc_.hash_algorithm, hash_def::hash_func_for_name(sc_.hash_algorithm),
+                                     hash_def::hash_pair_func_for_name(sc_.hash_algorithm))) {
     namespace fs = std::filesystem;
     if (sc.outdir.empty()) {
         throw std::invalid_argument("feature_recorder_set::feature_recorder_set(): output directory not provided");
@@ -81,27 +104,13 @@ feature_recorder_set::feature_recorder_set(const flags_t& flags_, const scanner_
         tmp.close();
         std::filesystem::remove( testfile );
     }
-
-#if 0
-#if defined(HAVE_SQLITE3_H)
-    if (flag_set(ENABLE_SQLITE3_RECORDERS)) {
-        db_create();
-    }
-#endif
-#endif
-
 }
 
 /*
  * deallocator
  */
 feature_recorder_set::~feature_recorder_set() {
-    frm.clear();                        // be sure all elements are deleted
-#if 0
-#if defined(HAVE_SQLITE3_H)
-    db_close();
-#endif
-#endif
+    frm.clear();                        // be sure all elements are deleted; the SQL recorders submit their rows
 }
 
 /**
@@ -150,10 +159,25 @@ feature_recorder& feature_recorder_set::create_feature_recorder(const feature_re
     }
 
     feature_recorder* fr = nullptr;
-    if (flags.record_files) { fr = new feature_recorder_file(*this, def); }
-#if defined(HAVE_SQLITE3_H) && defined(USE_SQLITE3)
-    if (flags.record_sql) { fr = new feature_recorder_sql(*this, def); }
+    if (flags.record_files) {
+        if (flags.record_binary and flags.record_columnar) {
+            throw std::runtime_error("can only write binary or columnar feature files, not both");
+        }
+        if (flags.record_binary) {
+            fr = new feature_recorder_bin(*this, def);
+        } else if (flags.record_columnar) {
+            fr = new feature_recorder_columnar(*this, def);
+        } else {
+            fr = new feature_recorder_file(*this, def);
+        }
+    }
+    if (flags.record_sql) {
+#if defined(HAVE_SQLITE3_H)
+        fr = new feature_recorder_sql(*this, def);
+#else
+        throw std::runtime_error("cannot record to SQL: compiled without SQLite3");
 #endif
+    }
     fr->context_window = sc.context_window_default;
     fr->carve_mode = def.default_carve_mode; // set the default
     frm.insert(def.name, fr);
@@ -202,11 +226,47 @@ void feature_recorder_set::set_carve_defaults()
     }
 }
 
+/* Called by the memory_monitor when memory is over budget. */
+bool feature_recorder_set::histograms_write_largest(size_t min_bytes)
+{
+    bool spilled = false;
+    for (auto *frp : frm.values()) {
+        if (frp->histograms_write_largest(min_bytes)) spilled = true;
+    }
+    return spilled;
+}
+
+/* After an eviction, an object that was already carved will be carved again under a new name. */
+size_t feature_recorder_set::carve_cache_evict()
+{
+    size_t count = 0;
+    for (auto *frp : frm.values()) {
+        count += frp->carve_cache.size();
+        frp->carve_cache.clear();
+    }
+    return count;
+}
+
+carve_queue& feature_recorder_set::get_carve_queue() {
+    std::call_once(carver_once, [this]() {
+        carver = std::make_unique<carve_queue>(carve_threads, carve_max_bytes_in_flight);
+    });
+    return *carver;
+}
+
+void feature_recorder_set::carve_drain() {
+    if (carver) carver->drain();
+}
+
 // send every enabled scanner the phase message
 void feature_recorder_set::feature_recorders_shutdown() {
+    carve_drain();
     for (auto const& it : frm.values()) {
         it->shutdown();
     }
+#if defined(HAVE_SQLITE3_H)
+    if (sql) sql->create_indexes();
+#endif
 }
 
 /****************************************************************
@@ -227,6 +287,15 @@ void feature_recorder_set::dump_name_count_stats(dfxml_writer& writer) const
     writer.pop();
 }
 
+void feature_recorder_set::dump_histogram_stats(dfxml_writer& writer) const
+{
+    writer.push("histograms");
+    for (auto *frp : frm.values()) {
+        frp->dump_histogram_stats(writer);
+    }
+    writer.pop("histograms");
+}
+
 /****************************************************************
  *** Histogram Support - Called during shutdown of scanner_set.
  ****************************************************************/
@@ -256,9 +325,38 @@ size_t feature_recorder_set::histogram_count() const {
  * Have every feature recorder generate all of its histograms.
  */
 void feature_recorder_set::histograms_generate() {
+    if (!flags.record_sql) {
+        for (auto *frp : frm.values()) {
+            frp->histograms_write_all();
+        }
+        return;
+    }
+
+    /* The SQL recorders count their histograms on connections of their own, so they run concurrently */
+    std::vector<feature_recorder*> todo;
     for (auto *frp : frm.values()) {
-        frp->histograms_write_all();
+        if (frp->histogram_count() > 0) todo.push_back(frp);
     }
+    size_t nthreads = sql_histogram_threads ? sql_histogram_threads : std::thread::hardware_concurrency();
+    nthreads = std::max(size_t(1), std::min(nthreads, todo.size()));
+    std::atomic<size_t> next {0};
+    std::mutex Merror;
+    std::exception_ptr error;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < nthreads; t++) {
+        threads.emplace_back([&]() {
+            for (size_t i = next++; i < todo.size(); i = next++) {
+                try {
+                    todo[i]->histograms_write_all();
+                } catch (...) {
+                    const std::lock_guard<std::mutex> lock(Merror);
+                    if (!error) error = std::current_exception();
+                }
+            }
+        });
+    }
+    for (auto& th : threads) th.join();
+    if (error) std::rethrow_exception(error);
 }
 
 std::vector<std::string> feature_recorder_set::feature_file_list() const {
@@ -277,132 +375,32 @@ void feature_recorder_set::info_feature_recorders( std::ostream &os) const
     os << "Carve mode 0: do not carve; mode 1: carve encoded data; mode 2: carve everything." << std::endl;
 }
 
+/****************************************************************
+ *** SQL Support
+ ****************************************************************/
 
-
-#if 0
-
-/*** SQL Support ***/
-
-/*
- * Time results with ubnist1 on R4:
- * no SQL - 79 seconds
- * no pragmas - 651 seconds
- * "PRAGMA synchronous =  OFF", - 146 second
- * "PRAGMA synchronous =  OFF", "PRAGMA journal_mode=MEMORY", - 79 seconds
- *
- * Time with domexusers:
- * no SQL -
- */
-
-#define SQLITE_EXTENSION ".sqlite"
-#ifndef SQLITE_DETERMINISTIC
-#define SQLITE_DETERMINISTIC 0
+sql_writer& feature_recorder_set::get_sql_writer() {
+#if defined(HAVE_SQLITE3_H)
+    std::call_once(sql_once, [this]() {
+        sql = std::make_unique<sql_writer>(sc.outdir / SQL_DB_NAME, sql_options);
+    });
+    return *sql;
+#else
+    throw std::runtime_error("cannot record to SQL: compiled without SQLite3");
 #endif
-
-static int debug  = 0;
-
-static const char *schema_db[] = {
-    "PRAGMA synchronous =  OFF",
-    "PRAGMA journal_mode=MEMORY",
-    //"PRAGMA temp_store=MEMORY",  // did not improve performance
-    "PRAGMA cache_size = 200000",
-    "CREATE TABLE IF NOT EXISTS db_info (schema_ver INTEGER, bulk_extractor_ver INTEGER)",
-    "INSERT INTO  db_info (schema_ver, bulk_extractor_ver) VALUES (1,1)",
-    "CREATE TABLE IF NOT EXISTS be_features (tablename VARCHAR,comment TEXT)",
-    "CREATE TABLE IF NOT EXISTS be_config (name VARCHAR,value VARCHAR)",
-    0};
-
-/* Create a feature table and note that it has been created in be_features */
-static const char *schema_tbl[] = {
-    "CREATE TABLE IF NOT EXISTS f_%s (offset INTEGER(12), path VARCHAR, feature_eutf8 TEXT, feature_utf8 TEXT, context_eutf8 TEXT)",
-    "CREATE INDEX IF NOT EXISTS f_%s_idx1 ON f_%s(offset)",
-    "CREATE INDEX IF NOT EXISTS f_%s_idx2 ON f_%s(feature_eutf8)",
-    "CREATE INDEX IF NOT EXISTS f_%s_idx3 ON f_%s(feature_utf8)",
-    "INSERT INTO be_features (tablename,comment) VALUES ('f_%s','')",
-    0};
-
-static const char *begin_transaction[] = {"BEGIN TRANSACTION",0};
-static const char *commit_transaction[] = {"COMMIT TRANSACTION",0};
-void feature_recorder_set::db_send_sql(sqlite3 *db,const char **stmts, ...)
-{
-    assert(db!=0);
-    for (int i=0;stmts[i];i++){
-        char *errmsg = 0;
-        char buf[65536];
-
-        va_list ap;
-        va_start(ap,stmts);
-        vsnprintf(buf,sizeof(buf),stmts[i],ap);
-        va_end(ap);
-        if(debug) std::cerr << "SQL: " << buf << "\n";
-        // Don't error on a PRAGMA
-        if((sqlite3_exec(db,buf,NULL,NULL,&errmsg) != SQLITE_OK)  && (strncmp(buf,"PRAGMA",6)!=0)) {
-            fprintf(stderr,"Error executing '%s' : %s\n",buf,errmsg);
-            exit(1);
-        }
-    }
 }
 
-void feature_recorder_set::db_create_table(const std::string &name)
+void feature_recorder_set::dump_sql_stats(dfxml_writer& writer) const
 {
-    std::cerr << "db_create_table\n";
-    assert(name.size()>0);
-    assert(db3!=NULL);
-    db_send_sql(db3,schema_tbl,name.c_str(),name.c_str());
-}
-
-sqlite3 *feature_recorder_set::db_create_empty(const std::string &name)
-{
-    assert(name.size()>0);
-    std::string dbfname  = sc.outdir + "/" + name +  SQLITE_EXTENSION;
-    if(debug) std::cerr << "create_feature_database " << dbfname << "\n";
-    sqlite3 *db=0;
-    if (sqlite3_open_v2(dbfname.c_str(), &db,
-                        SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE|SQLITE_OPEN_FULLMUTEX,
-                        0)!=SQLITE_OK) {
-        std::cerr << "Cannot create database '" << dbfname << "': " << sqlite3_errmsg(db) << "\n";
-        sqlite3_close(db);
-        exit(1);
-    }
-    return db;
-}
-
-void feature_recorder_set::db_create()
-{
-    assert(db3==0);
-    db3 = db_create_empty("report");
-    db_send_sql(db3,schema_db);
-    std::cout << "in db_create called\n";
-}
-
-void feature_recorder_set::db_close()
-{
-    if(db3){
-        if(debug) std::cerr << "db_close()\n";
-        sqlite3_close(db3);
-        db3 = 0;
-    }
-}
-
-void feature_recorder_set::db_transaction_begin()
-{
-    const std::lock_guard<std::mutex> lock(Min_transaction);
-    if(!in_transaction){
-        db_send_sql(db3,begin_transaction);
-        in_transaction = true;
-    }
-}
-
-void feature_recorder_set::db_transaction_commit()
-{
-    const std::lock_guard<std::mutex> lock(Min_transaction);
-    if(in_transaction){
-        db_send_sql(db3,commit_transaction);
-        in_transaction = false;
-    } else {
-        std::cerr << "No transaction to commit\n";
-    }
-}
-
-
+#if defined(HAVE_SQLITE3_H)
+    if (!sql) return;
+    writer.set_oneline(true);
+    writer.push("sql");
+    writer.xmlout("rows_inserted", static_cast<uint64_t>(sql->rows_inserted));
+    writer.xmlout("transactions", static_cast<uint64_t>(sql->transactions));
+    writer.xmlout("inserts_per_second", sql->inserts_per_second());
+    writer.xmlout("index_seconds", static_cast<double>(sql->index_ns) / 1E9);
+    writer.pop("sql");
+    writer.set_oneline(false);
 #endif
+}
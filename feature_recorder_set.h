@@ -5,15 +5,14 @@
 #include <exception>
 #include <filesystem>
 
-#if defined(HAVE_SQLITE3_H)
-#include <sqlite3.h>
-#endif
-
 #include "atomic_map.h"
 #include "atomic_set.h"
+#include "carve_queue.h"
+#include "carve_store.h"
 #include "feature_recorder.h"
 #include "sbuf.h"
 #include "scanner_config.h"
+#include "sql_writer.h"
 
 /** \addtogroup internal_interfaces
  * @{
@@ -58,10 +57,11 @@ private:
     feature_recorder_map_t frm{};
     bool frm_frozen {false};            // once the frm is frozen, it is read-only.
     feature_recorder* stop_list_recorder{nullptr}; // where stopped features get written (if there is one)
-#if defined(HAVE_SQLITE3_H) and defined(HAVE_LIBSQLITE3)
-    /* If we are compiled with SQLite3, this is the handle to the open database */
-    sqlite3* db3{};
-#endif
+    std::unique_ptr<sql_writer> sql{};  // created by get_sql_writer()
+    std::once_flag sql_once{};
+    std::unique_ptr<carve_store> store{};  // set by open_carve_store(); outlives the carver's jobs
+    std::unique_ptr<carve_queue> carver{}; // created by get_carve_queue()
+    std::once_flag carver_once{};
 
 public:
     void frm_freeze() { assert(frm_frozen==false); frm_frozen=true;}
@@ -78,6 +78,8 @@ public:
         bool debug{false};                      // enable debug printing
         bool record_files{true};                // record to files
         bool record_sql{false};                 // record to SQL
+        bool record_binary{false};              // with record_files, write binary feature files (feature_recorder_bin)
+        bool record_columnar{false};            // with record_files, write columnar feature files (feature_recorder_columnar)
     } flags;
 
     static flags_t flags_disabled() {           // return a frs that is disabled
@@ -106,14 +108,18 @@ public:
 
     /* the feature recorder set automatically hashes all of the sbuf's that it processes. */
     typedef std::string (*hash_func_t)(const uint8_t* buf, size_t bufsize);
+    typedef std::string (*hash_pair_func_t)(const uint8_t* buf1, size_t bufsize1, const uint8_t* buf2, size_t bufsize2);
     struct hash_def {
-        hash_def(std::string name_, hash_func_t func_) : name(name_), func(func_){};
+        hash_def(std::string name_, hash_func_t func_, hash_pair_func_t pair_func_)
+            : name(name_), func(func_), pair_func(pair_func_){};
         std::string name; // name of hash
         hash_func_t func; // hash function
+        hash_pair_func_t pair_func; // hashes two buffers as if they were one, without joining them
         static std::string md5_hasher(const uint8_t* buf, size_t bufsize);
         static std::string sha1_hasher(const uint8_t* buf, size_t bufsize);
         static std::string sha256_hasher(const uint8_t* buf, size_t bufsize);
         static hash_func_t hash_func_for_name(const std::string& name);
+        static hash_pair_func_t hash_pair_func_for_name(const std::string& name);
     };
 
     const word_and_context_list* alert_list{}; /* shold be flagged */
@@ -147,6 +153,22 @@ public:
 
     void set_carve_defaults();
 
+    /* Carved files are written by a carve_queue that is created on first use with these settings */
+    size_t carve_threads{carve_queue::DEFAULT_THREADS};                           // 0 to write in carve()
+    size_t carve_max_bytes_in_flight{carve_queue::DEFAULT_MAX_BYTES_IN_FLIGHT};
+    carve_queue& get_carve_queue();
+    void carve_drain();              // waits until every carved file has been written
+
+    /* Optionally, carved files go in a content-addressed store shared by every recorder and every run that
+     * opens it, instead of in the output directory; see carve_store. Open it before carving starts.
+     */
+    void open_carve_store(const std::filesystem::path& dir) { store = std::make_unique<carve_store>(dir); }
+    carve_store* get_carve_store() const { return store.get(); }
+
+    /* Relief under memory pressure; see memory_monitor */
+    bool histograms_write_largest(size_t min_bytes); // spills the largest histogram of each feature recorder, if it has min_bytes; true if any were spilled
+    size_t carve_cache_evict();      // empties the carve caches and returns the number of hashes dropped
+
     // called when scanner_set shuts down:
     void feature_recorders_shutdown();
     void histograms_generate(); // make the histograms in the output directory (and optionally in the database)
@@ -191,6 +213,8 @@ public:
     virtual std::vector<std::string> feature_file_list() const; // returns a list of feature file names
 
     void dump_name_count_stats(class dfxml_writer& writer) const; // dumps the standard dfxml
+    void dump_histogram_stats(class dfxml_writer& writer) const;  // dumps histogram sizes and merge costs
+    void dump_sql_stats(class dfxml_writer& writer) const;        // dumps SQL rows and inserts per second
 
     void info_feature_recorders( std::ostream &os) const;
 
@@ -198,17 +222,15 @@ public:
      *** DB interface
      ****************************************************************/
 
-#if 0
-#if defined(HAVE_SQLITE3_H) and defined(HAVE_LIBSQLITE3)
-    virtual  void db_send_sql(sqlite3 *db3,const char **stmts, ...) ;
-    virtual  sqlite3 *db_create_empty(const std::string &name) ;
-    void     db_create_table(const std::string &name) ;
-    void     db_create() ;
-    void     db_transaction_begin() ;
-    void     db_transaction_commit() ;               // commit current transaction
-    void     db_close() ;                            //
-#endif
-#endif
+    /* With flags.record_sql, features are written into {outdir}/report.sqlite by an sql_writer
+     * that is created when the first recorder is, with these options. histograms_generate() makes
+     * the histograms of up to sql_histogram_threads recorders at once (0 means hardware_concurrency()).
+     */
+    static inline const std::string SQL_DB_NAME {"report.sqlite"};
+    sql_writer::options_t sql_options{};
+    size_t sql_histogram_threads{0};
+    sql_writer& get_sql_writer();
+
     /****************************************************************
      *** External Functions
      ****************************************************************/
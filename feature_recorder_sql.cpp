@@ -6,177 +6,266 @@
 
 #include "config.h"
 
-#ifdef HAVE_SQLITE3_H
+#if defined(HAVE_SQLITE3_H) && defined(HAVE_LIBSQLITE3)
+#include <sqlite3.h>
 
-#include <cstdio>
-#include <cstdlib>
-#include <cstring>
-#include <unistd.h>
+#include <algorithm>
+#include <unordered_map>
 
+#include "feature_recorder_file.h"
 #include "feature_recorder_set.h"
 #include "feature_recorder_sql.h"
-#include "sbuf.h"
+#include "formatter.h"
+#include "unicode_escape.h"
 
 feature_recorder_sql::feature_recorder_sql(class feature_recorder_set& fs_, const feature_recorder_def def_)
-    : feature_recorder(fs_, def_) {
+    : feature_recorder(fs_, def_), serial(next_serial++) {
     /*
      * If the feature recorder set is disabled, just return.
      */
     if (fs.flags.disabled) return;
-        /* write to a database? Create tables if necessary and create a prepared statement */
+    writer = &fs.get_sql_writer();
+    writer->create_feature_table(name);
+}
 
-#if 0
-    char buf[1024];
-    fs.db_create_table(name);
-    snprintf( buf, sizeof(buf), db_insert_stmt,name.c_str() );
-    bs = new besql_stmt( fs.db3, buf );
-#endif
+/* Rows that were never flushed are still written, since the set's writer outlives its recorders */
+feature_recorder_sql::~feature_recorder_sql() {
+    try {
+        submit_all();
+    } catch (const std::exception& e) {
+        std::cerr << name << ": " << e.what() << "\n";
+    }
 }
 
-feature_recorder_sql::~feature_recorder_sql() {}
-
-#if 0
-#define DB_INSERT_STMT                                                                                                 \
-    "INSERT INTO f_%s (offset,path,feature_eutf8,feature_utf8,context_eutf8) VALUES (?1, ?2, ?3, ?4, ?5)"
-const char *feature_recorder::db_insert_stmt = DB_INSERT_STMT;
-
-void feature_recorder::besql_stmt::insert_feature(const pos0_t &pos,
-                                                        const std::string &feature,
-                                                        const std::string &feature8, const std::string &context)
-{
-    assert(stmt!=0);
-    const std::lock_guard<std::mutex> lock(Mstmt);           // grab a lock
-    const std::string &path = pos.str();
-    sqlite3_bind_int64(stmt, 1, pos.imageOffset()); // offset
-    sqlite3_bind_text(stmt, 2, path.data(), path.size(), SQLITE_STATIC); // path
-    sqlite3_bind_text(stmt, 3, feature.data(), feature.size(), SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 4, feature8.data(), feature8.size(), SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 5, context.data(), context.size(), SQLITE_STATIC);
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
-        fprintf(stderr,"sqlite3_step failed\n");
+/* Each thread caches its buffers by recorder serial number, not address, and prunes the buffers
+ * of deleted recorders as it grows; see AtomicUnicodeHistogram::local_table()
+ */
+feature_recorder_sql::LocalRows& feature_recorder_sql::local_buffer() {
+    struct cached_t {
+        LocalRows* rows;
+        std::weak_ptr<LocalRows> owner;
+    };
+    thread_local std::unordered_map<uint64_t, cached_t> buffers;
+    thread_local size_t prune_at {16};
+    auto it = buffers.find(serial);
+    if (it != buffers.end()) return *it->second.rows;
+
+    if (buffers.size() >= prune_at) {
+        for (auto i = buffers.begin(); i != buffers.end();) {
+            i = i->second.owner.expired() ? buffers.erase(i) : std::next(i);
+        }
+        prune_at = std::max(size_t(16), buffers.size() * 2);
     }
-    sqlite3_reset(stmt);
-};
+    std::shared_ptr<LocalRows> lr(new LocalRows());
+    {
+        const std::lock_guard<std::mutex> lock(Mlocal);
+        local_rows.push_back(lr);
+    }
+    buffers[serial] = cached_t{lr.get(), lr};
+    return *lr;
+}
 
-feature_recorder::besql_stmt::besql_stmt(sqlite3 *db3,const char *sql):Mstmt(),stmt()
-{
-    assert(db3!=0);
-    assert(sql!=0);
-    sqlite3_prepare_v2(db3,sql, strlen(sql), &stmt, NULL);
-    assert(stmt!=0);
+void feature_recorder_sql::submit_all() {
+    if (writer == nullptr) return;
+    const std::lock_guard<std::mutex> lock(Mlocal);
+    for (auto& lr : local_rows) {
+        std::vector<sql_writer::row_t> rows;
+        {
+            const std::lock_guard<std::mutex> lock2(lr->M);
+            rows.swap(lr->rows);
+        }
+        writer->submit(name, std::move(rows));
+    }
 }
 
-feature_recorder::besql_stmt::~besql_stmt()
-{
-    assert(stmt!=0);
-    sqlite3_finalize(stmt);
-    stmt = 0;
+void feature_recorder_sql::flush() {
+    submit_all();
+    if (writer) writer->flush();
+}
+
+void feature_recorder_sql::shutdown() {
+    flush();
 }
 
 /* Hook for writing feature to SQLite3 database */
-void feature_recorder::write0_sqlite3(const pos0_t &pos0,const std::string &feature,const std::string &context)
-{
-    /**
-     * Note: this is not very efficient, passing through a quoted feature and then unquoting it.
-     * We could make this more efficient.
-     */
-    std::string *feature8 = AtomicUnicodeHistogram::convert_utf16_to_utf8(feature_recorder::unquote_string(feature));
-    assert(bs!=0);
-    bs->insert_feature(pos0,feature,
-                         feature8 ? *feature8 : feature,
-                         flag_set(feature_recorder::FLAG_NO_CONTEXT) ? "" : context);
-    if (feature8) delete feature8;
+void feature_recorder_sql::write0(const pos0_t& pos0, const std::string& feature, const std::string& context) {
+    feature_recorder::write0(pos0, feature, context); // call super to increment counter
+    if (writer == nullptr) return;
+
+    sql_writer::row_t row;
+    row.offset = pos0.imageOffset();
+    pos0.append_to(row.path, fs.offset_add);
+    row.feature_eutf8 = feature;
+    /* The feature has been quoted for the feature file; feature_utf8 is what it was */
+    const std::string unquoted = feature_recorder_file::unquote_string(feature);
+    if (!utf16_to_utf8_if_utf16(unquoted, row.feature_utf8)) row.feature_utf8 = unquoted;
+    if (def.flags.no_context == false) row.context_eutf8 = context;
+
+    std::vector<sql_writer::row_t> batch;
+    {
+        LocalRows& lr = local_buffer();
+        const std::lock_guard<std::mutex> lock(lr.M);
+        if (lr.rows.empty()) lr.rows.reserve(writer->opts.batch_rows);
+        lr.rows.push_back(std::move(row));
+        if (lr.rows.size() < writer->opts.batch_rows) return;
+        batch.swap(lr.rows);
+    }
+    writer->submit(name, std::move(batch));
 }
 
-/*** SQL Routines Follow ***
- *
- * Time results with ubnist1 on R4:
- * no SQL - 79 seconds
- * no pragmas - 651 seconds
- * "PRAGMA synchronous =  OFF", - 146 second
- * "PRAGMA synchronous =  OFF", "PRAGMA journal_mode=MEMORY", - 79 seconds
- *
- * Time with domexusers:
- * no SQL -
- */
+/****************************************************************
+ *** HISTOGRAMS
+ ****************************************************************/
+
+std::string feature_recorder_sql::histogram_table(const histogram_def& def) {
+    std::string hname = "h_" + def.feature;
+    if (def.suffix.size() > 0) hname += "_" + def.suffix;
+    return hname;
+}
+
+void feature_recorder_sql::histogram_add(const histogram_def& def) {
+    histogram_defs.push_back(def);
+}
 
-#define SQLITE_EXTENSION ".sqlite"
 #ifndef SQLITE_DETERMINISTIC
 #define SQLITE_DETERMINISTIC 0
 #endif
 
-/* This creates the base histogram. Note that the SQL fails if the histogram exists */
-static const char *schema_hist[] = {
-    "CREATE TABLE h_%s (count INTEGER(12), feature_utf8 TEXT)",
-    "CREATE INDEX h_%s_idx1 ON h_%s(count)",
-    "CREATE INDEX h_%s_idx2 ON h_%s(feature_utf8)",
-    0};
-
-/* This performs the histogram operation */
-static const char *schema_hist1[] = {
-    "INSERT INTO h_%s select COUNT(*),feature_utf8 from f_%s GROUP BY feature_utf8",
-    0};
-
-static const char *schema_hist2[] = {
-    "INSERT INTO h_%s select sum(count),BEHIST(feature_utf8) from h_%s where BEHIST(feature_utf8)!='' GROUP BY BEHIST(feature_utf8)",
-    0};
-
+namespace {
+/* What BEHIST() works with. The strings are reused from row to row, so a call allocates nothing once they have grown. */
+struct behist_t {
+    behist_t(const histogram_def& def) : matcher(def) {}
+    const histogram_matcher matcher;
+    std::string key {};
+    std::string context {};
+    std::string display {};
+};
 
+void assign_text(std::string& s, sqlite3_value* v) {
+    const unsigned char* p = sqlite3_value_text(v); // before sqlite3_value_bytes(), which then does not convert
+    if (p == nullptr) {
+        s.clear();
+        return;
+    }
+    s.assign(reinterpret_cast<const char*>(p), sqlite3_value_bytes(v));
+}
 
-void feature_recorder::dump_histogram_sqlite3(const histogram_def &def,void *user,feature_recorder::dump_callback_t cb) const
-{
-    /* First check to see if there exists a feature histogram summary. If not, make it */
-    std::string query = "SELECT name FROM sqlite_master WHERE type='table' AND name='h_" + def.feature +"'";
-    char *errmsg=0;
-    int rowcount=0;
-    if ( sqlite3_exec(fs.db3,query.c_str(),callback_counter,&rowcount,&errmsg)){
-        std::cerr << "sqlite3: " << errmsg << "\n";
+/* BEHIST(feature_utf8 [,context_eutf8]): the histogram key of the feature, or NULL if it has none */
+void behist(sqlite3_context* ctx, int argc, sqlite3_value** argv) {
+    behist_t& bh = *static_cast<behist_t*>(sqlite3_user_data(ctx));
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(ctx);
         return;
     }
-    if (rowcount==0){
-        const char *feature = def.feature.c_str();
-        fs.db_send_sql( fs.db3, schema_hist, feature, feature); // creates the histogram
-        fs.db_send_sql( fs.db3, schema_hist1, feature, feature); // creates the histogram
+    assign_text(bh.key, argv[0]);
+    if (argc > 1) assign_text(bh.context, argv[1]);
+    if (bh.matcher.match(bh.key, &bh.display, bh.context)) {
+        sqlite3_result_text(ctx, bh.display.data(), bh.display.size(), SQLITE_TRANSIENT);
+    } else {
+        sqlite3_result_null(ctx);
     }
-    /* Now create the summarized histogram for the regex, if it is not existing, but only if we have
-     * sqlite3_create_function_v2
-     */
-    if (def.pattern.size()>0){
-        /* Create the database where we will add the histogram */
-        std::string hname = def.feature + "_" + def.suffix;
+}
+}
 
-        /* Remove any "-" characters if present */
-        for(size_t i=0;i<hname.size();i++){
-            if (hname[i]=='-') hname[i]='_';
+/*
+ * Counts a histogram's keys on a connection of its own. A histogram that keeps the whole feature is a GROUP BY.
+ * The others use the BEHIST() function, which applies the histogram's pattern, flags and required text
+ * with a histogram_matcher, as the file recorder does. Unless the histogram requires text in the context,
+ * BEHIST() is called once for each distinct feature, not once for each row.
+ * The required text is looked for in the quoted context.
+ */
+feature_recorder_sql::histogram_rows_t feature_recorder_sql::histogram_query(sqlite3* reader, const histogram_def& def) const {
+    const std::string ftable = sql_writer::feature_table(name);
+    behist_t bh(def);
+    std::string sql;
+    if (def.pattern.empty() && def.require.empty() && !def.flags.lowercase && !def.flags.numeric) {
+        sql = "SELECT feature_utf8,COUNT(*) FROM " + ftable + " GROUP BY feature_utf8";
+    } else if (def.require.size() > 0 && def.flags.require_context) {
+        sql = "SELECT k,COUNT(*) FROM (SELECT BEHIST(feature_utf8,context_eutf8) AS k FROM " + ftable + ") "
+              "WHERE k IS NOT NULL GROUP BY k";
+    } else {
+        sql = "SELECT k,SUM(n) FROM (SELECT BEHIST(feature_utf8) AS k,n FROM (SELECT feature_utf8,COUNT(*) AS n FROM " +
+              ftable + " GROUP BY feature_utf8)) WHERE k IS NOT NULL GROUP BY k";
+    }
+    for (int nargs = 1; nargs <= 2; nargs++) {
+        if (sqlite3_create_function(reader, "BEHIST", nargs, SQLITE_UTF8 | SQLITE_DETERMINISTIC, &bh, behist, nullptr,
+                                    nullptr) != SQLITE_OK) {
+            throw sql_writer::SQLError(std::string("cannot register BEHIST: ") + sqlite3_errmsg(reader));
         }
+    }
 
-        if(debug) std::cerr << "CREATING TABLE = " << hname << "\n";
-        if (sqlite3_create_function_v2(fs.db3,"BEHIST",1,SQLITE_UTF8|SQLITE_DETERMINISTIC,
-                                       (void *)&def,dump_hist,0,0,0)) {
-            std::cerr << "could not register function BEHIST\n";
-            return;
+    histogram_rows_t rows;
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(reader, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        throw sql_writer::SQLError(Formatter() << "cannot prepare '" << sql << "': " << sqlite3_errmsg(reader));
+    }
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const unsigned char* key = sqlite3_column_text(stmt, 0);
+        rows.emplace_back(std::string(reinterpret_cast<const char*>(key), sqlite3_column_bytes(stmt, 0)),
+                          sqlite3_column_int64(stmt, 1));
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        throw sql_writer::SQLError(Formatter() << "'" << sql << "': " << sqlite3_errmsg(reader));
+    }
+    return rows;
+}
+
+/* Replaces the histogram's table with rows, in one transaction, and indexes it once it is full */
+void feature_recorder_sql::histogram_store(sqlite3* db, const histogram_def& def, const histogram_rows_t& rows) {
+    const std::string hname = histogram_table(def);
+    const std::string htable = sql_writer::quote_identifier(hname);
+    writer->exec(db, "BEGIN TRANSACTION");
+    try {
+        writer->exec(db, "DROP TABLE IF EXISTS " + htable);
+        writer->exec(db, "CREATE TABLE " + htable + " (count INTEGER(12), feature_utf8 TEXT)");
+        const std::string sql = "INSERT INTO " + htable + " (count,feature_utf8) VALUES (?1,?2)";
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            throw sql_writer::SQLError(Formatter() << "cannot prepare '" << sql << "': " << sqlite3_errmsg(db));
         }
-        const char *fn = def.feature.c_str();
-        const char *hn = hname.c_str();
-        fs.db_send_sql(fs.db3,schema_hist, hn , hn); // create the table
-        fs.db_send_sql(fs.db3,schema_hist2, hn , fn); // select into it from a function of the old histogram table
-
-        /* erase the user defined function */
-        if (sqlite3_create_function_v2(fs.db3,"BEHIST",1,SQLITE_UTF8|SQLITE_DETERMINISTIC,
-                                       (void *)&def,0,0,0,0)) {
-            std::cerr << "could not remove function BEHIST\n";
-            return;
+        for (const auto& it : rows) {
+            sqlite3_bind_int64(stmt, 1, it.second);
+            sqlite3_bind_text(stmt, 2, it.first.data(), it.first.size(), SQLITE_STATIC);
+            const int rc = sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+            if (rc != SQLITE_DONE) {
+                sqlite3_finalize(stmt);
+                throw sql_writer::SQLError(Formatter() << "cannot insert into " << htable << ": " << sqlite3_errmsg(db));
+            }
         }
+        sqlite3_finalize(stmt);
+        writer->exec(db, "CREATE INDEX " + sql_writer::quote_identifier(hname + "_idx1") + " ON " + htable + "(count)");
+        writer->exec(db, "CREATE INDEX " + sql_writer::quote_identifier(hname + "_idx2") + " ON " + htable +
+                             "(feature_utf8)");
+        writer->exec(db, "COMMIT TRANSACTION");
+    } catch (...) {
+        sqlite3_exec(db, "ROLLBACK TRANSACTION", nullptr, nullptr, nullptr);
+        throw;
     }
 }
 
-void feature_recorder::write(const pos0_t &pos0, const std::string &feature, const std::string &context)
-{
-    if ( fs.flag_set(feature_recorder_set::ENABLE_SQLITE3_RECORDERS ) &&
-         this->flag_notset(feature_recorder::FLAG_NO_FEATURES_SQL) ) {
-        write0_sqlite3( pos0, feature, context);
-    }
+/*
+ * The histograms are counted on a connection of this recorder's own, so the recorders of a set can make
+ * their histograms at the same time (see feature_recorder_set::histograms_generate()); only storing
+ * the counts uses the writer's connection. The price is that every histogram's counts are in memory
+ * until they are stored.
+ */
+void feature_recorder_sql::histograms_write_all() {
+    if (writer == nullptr || histogram_defs.empty()) return;
+    flush();
+    std::vector<histogram_rows_t> counts;
+    writer->with_reader([&](sqlite3* reader) {
+        for (const auto& def : histogram_defs) {
+            counts.push_back(histogram_query(reader, def));
+        }
+    });
+    writer->with_db([&](sqlite3* db) {
+        for (size_t i = 0; i < histogram_defs.size(); i++) {
+            histogram_store(db, histogram_defs[i], counts[i]);
+        }
+    });
 }
-#endif
 
 #endif
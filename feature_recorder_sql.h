@@ -1,36 +1,70 @@
+#ifndef FEATURE_RECORDER_SQL_H
+#define FEATURE_RECORDER_SQL_H
+
 #include <cassert>
 #include <cinttypes>
 
 #include <atomic>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include "feature_recorder.h"
+#include "histogram_def.h"
 #include "pos0.h"
+#include "sql_writer.h"
 
-#ifdef HAVE_SQLITE3_H
-#include <sqlite3.h>
-
+/**
+ * feature_recorder_sql:
+ * Writes features into the f_<name> table of the feature recorder set's SQLite3 database.
+ *
+ * Each thread adds its rows to a buffer of its own, which is handed to the set's sql_writer when it holds
+ * batch_rows rows, and by flush(). The histograms are made in SQL from the table when they are written,
+ * into h_<name> tables of the same database, so nothing is kept in memory while features are recorded.
+ * Writing them does hold every distinct key of each histogram in memory: the keys are counted on a
+ * connection of the recorder's own, so that the recorders of a set can count at the same time, and are
+ * then stored with the writer's connection. The table's indexes may not exist until the set's sql_writer
+ * builds them at shutdown; see sql_writer::options_t::defer_indexes.
+ */
 class feature_recorder_sql : public feature_recorder {
-    struct besql_stmt {
-        besql_stmt(const besql_stmt&) = delete;
-        besql_stmt& operator=(const besql_stmt&) = delete;
-        std::mutex Mstmt{};
-        sqlite3_stmt* stmt{}; // the prepared statement
-        besql_stmt(sqlite3* db3, const char* sql);
-        virtual ~besql_stmt();
-        void insert_feature(const pos0_t& pos, // insert it into this table!
-                            const std::string& feature, const std::string& feature8, const std::string& context);
-    };
-#if defined(HAVE_SQLITE3_H) and defined(HAVE_LIBSQLITE3)
-    // virtual void dump_histogram_sqlite3(const histogram_def &def,void *user,feature_recorder::dump_callback_t cb)
-    // const;
-#endif
 public:
     feature_recorder_sql(class feature_recorder_set& fs, feature_recorder_def def);
     virtual ~feature_recorder_sql();
-    //virtual void histogram_write(AtomicUnicodeHistogram& h) override; // flush a specific histogram
+
+    virtual void flush() override;
+    virtual void write0(const pos0_t& pos0, const std::string& feature, const std::string& context) override;
+
+    static std::string histogram_table(const histogram_def& def); // h_<feature>, or h_<feature>_<suffix>
+    std::vector<histogram_def> histogram_defs {};
+    virtual size_t histogram_count() override { return histogram_defs.size(); }
+    virtual void histogram_add(const histogram_def& def) override;
+    virtual void histograms_incremental_add_feature_context(const std::string& feature,
+                                                            const std::string& context) override {}
+    virtual bool histograms_write_largest(size_t) override { return false; } // nothing is kept in memory
+    virtual void histograms_write_all() override;
+    typedef std::vector<std::pair<std::string, int64_t>> histogram_rows_t; // (key, count)
+    histogram_rows_t histogram_query(struct sqlite3* reader, const histogram_def& def) const;
+    void histogram_store(struct sqlite3* db, const histogram_def& def, const histogram_rows_t& rows);
+
+protected:
+    virtual void shutdown() override;
+
+private:
+    struct LocalRows {
+        std::mutex M {};                // only contended while another thread flushes this buffer
+        std::vector<sql_writer::row_t> rows {};
+    };
+    static inline std::atomic<uint64_t> next_serial {0};
+    const uint64_t serial;              // identifies this recorder in each thread's buffer cache
+    std::mutex Mlocal {};               // protects local_rows
+    std::vector<std::shared_ptr<LocalRows>> local_rows {}; // each thread's cache holds a weak_ptr
+    class sql_writer* writer {nullptr}; // the set's; nullptr if the set is disabled
+    LocalRows& local_buffer();          // the calling thread's buffer
+    void submit_all();                  // hands every thread's rows to the writer
 };
+
 #endif
@@ -1,3 +1,5 @@
+#include <cstring>
+
 #include "histogram_def.h"
 
 histogram_def::histogram_def(const std::string& name_,
@@ -57,6 +59,107 @@ bool histogram_def::match(std::string u32key, std::string* displayString, const
     return match(convert_utf8_to_utf32(u32key), displayString, context);
 }
 
+histogram_matcher::histogram_matcher(const histogram_def& def_) : def(def_)
+{
+    whole_feature = !def.flags.lowercase && !def.flags.numeric && def.pattern.size() == 0 && def.require.size() == 0;
+}
+
+/* Checks eight bytes at a time */
+bool histogram_matcher::is_ascii(const std::string& str)
+{
+    const char* p = str.data();
+    size_t n = str.size();
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        if (w & 0x8080808080808080ULL) return false;
+    }
+    for (; n > 0; p++, n--) {
+        if (*p & 0x80) return false;
+    }
+    return true;
+}
+
+/* For ASCII, lowercase and numeric extraction are the same as utf32_lowercase() and utf32_extract_numeric() */
+namespace {
+std::string ascii_lowercase(const std::string& str) {
+    std::string ret(str);
+    for (auto& ch : ret) ch = tolower(ch);
+    return ret;
+}
+}
+
+bool histogram_matcher::match(const std::string& u8key, std::string* displayString, const std::string& context) const
+{
+    if (!is_ascii(u8key)) return def.match(u8key, displayString, context);
+    if (def.flags.lowercase) return match_ascii(ascii_lowercase(u8key), displayString, context);
+    return match_ascii(u8key, displayString, context);
+}
+
+bool histogram_matcher::match(const histogram_feature& f, std::string* displayString, const std::string& context) const
+{
+    if (!f.ascii) return def.match(f.u8, displayString, context);
+    return match_ascii(def.flags.lowercase ? f.lowercase() : f.u8, displayString, context);
+}
+
+bool histogram_matcher::match_ascii(const std::string& key_, std::string* displayString, const std::string& context) const
+{
+    if (whole_feature) {
+        if (displayString) { *displayString = key_; }
+        return true;
+    }
+
+    const std::string* key = &key_;
+    std::string digits;
+    if (def.flags.numeric) {
+        digits.reserve(key_.size());
+        for (char ch : key_) {
+            if (ch >= '0' && ch <= '9') digits.push_back(ch);
+        }
+        key = &digits;
+    }
+
+    if (def.require.size() > 0) {
+        if (def.flags.require_feature && key->find(def.require) == std::string::npos) return false;
+        if (def.flags.require_context && context.find(def.require) == std::string::npos) return false;
+    }
+
+    if (def.pattern.size() > 0) {
+        std::smatch m{};
+        if (!std::regex_search(key->cbegin(), key->cend(), m, def.reg)) return false;
+        if (displayString) { *displayString = m.str(); }
+        return true;
+    }
+    if (displayString) { *displayString = *key; }
+    return true;
+}
+
+/* Non-ASCII UTF-8 is passed through UTF-32, as AtomicUnicodeHistogram::add_feature_context() always did,
+ * so that invalid UTF-8 is rejected the same way.
+ */
+histogram_feature::histogram_feature(const std::string& key_unknown_encoding)
+{
+    if (utf16_to_utf8_if_utf16(key_unknown_encoding, u8)) {
+        found_utf16 = true;
+    } else if (histogram_matcher::is_ascii(key_unknown_encoding)) {
+        u8 = key_unknown_encoding;
+        ascii = true;
+        return;
+    } else {
+        u8 = convert_utf32_to_utf8(convert_utf8_to_utf32(key_unknown_encoding));
+    }
+    ascii = histogram_matcher::is_ascii(u8);
+}
+
+const std::string& histogram_feature::lowercase() const
+{
+    if (!have_lower) {
+        lower = ascii_lowercase(u8);
+        have_lower = true;
+    }
+    return lower;
+}
+
 std::ostream& operator<<(std::ostream& os, const histogram_def::flags_t& f) {
     os << "<histogram_def::flags(";
     if (f.lowercase) os << " lowercase";
@@ -70,6 +173,8 @@ std::ostream& operator<<(std::ostream& os, const histogram_def::flags_t& f) {
 
 std::ostream& operator<<(std::ostream& os, const histogram_def& hd) {
     os << "<histogram_def( name:" << hd.name << " feature:" << hd.feature << " pattern:" << hd.pattern
-       << " require:" << hd.require << " suffix:" << hd.suffix << ")>";
+       << " require:" << hd.require << " suffix:" << hd.suffix;
+    if (hd.approximate_top_n > 0) os << " approximate_top_n:" << hd.approximate_top_n;
+    os << ")>";
     return os;
 }
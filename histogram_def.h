@@ -81,6 +81,12 @@ struct histogram_def {
     /* flags */
     struct flags_t flags {};
 
+    /* If approximate_top_n>0, the histogram is only required to report its approximate top approximate_top_n entries.
+     * It is counted in bounded memory with a count-min sketch and a top-K table rather than exactly,
+     * so it never needs to be spilled. See AtomicUnicodeHistogram.
+     */
+    size_t approximate_top_n {0};
+
     /* default copy construction and assignment */
     histogram_def(const histogram_def& a) {
         this->name = a.name;
@@ -90,6 +96,7 @@ struct histogram_def {
         this->require = a.require;
         this->suffix = a.suffix;
         this->flags = a.flags;
+        this->approximate_top_n = a.approximate_top_n;
     };
 
     /* assignment operator */
@@ -101,12 +108,14 @@ struct histogram_def {
         this->require = a.require;
         this->suffix = a.suffix;
         this->flags = a.flags;
+        this->approximate_top_n = a.approximate_top_n;
         return *this;
     }
 
     bool operator==(const histogram_def& a) const {
         return (this->name == a.name) && (this->feature == a.feature) && (this->pattern == a.pattern) &&
-               (this->require == a.require) && (this->suffix == a.suffix) && (this->flags == a.flags);
+               (this->require == a.require) && (this->suffix == a.suffix) && (this->flags == a.flags) &&
+               (this->approximate_top_n == a.approximate_top_n);
     }
 
     bool operator!=(const histogram_def& a) const { return !(*this == a); }
@@ -126,6 +135,8 @@ struct histogram_def {
         if (this->suffix < a.suffix) return true;
         if (this->suffix > a.suffix) return false;
         if (this->flags < a.flags) return true;
+        if (a.flags < this->flags) return false;
+        if (this->approximate_top_n < a.approximate_top_n) return true;
         return false;
     }
 
@@ -138,6 +149,44 @@ struct histogram_def {
     bool match(std::string u32key,    std::string* displayString, const std::string &context) const;
 };
 
+/**
+ * histogram_feature is a feature normalized once for all of a recorder's histograms.
+ * UTF-16 is detected and converted to UTF-8, and the lowercase form of an ASCII feature is made
+ * the first time a histogram asks for it. A histogram_feature is used by one thread.
+ */
+class histogram_feature {
+    mutable bool have_lower {false};
+    mutable std::string lower {};
+
+public:
+    histogram_feature(const std::string& key_unknown_encoding);
+    std::string u8 {};                  // the feature in UTF-8
+    bool found_utf16 {false};           // it was converted from UTF-16
+    bool ascii {false};                 // u8 is entirely ASCII
+    const std::string& lowercase() const; // only for ASCII features
+};
+
+/**
+ * histogram_matcher is a histogram_def compiled for matching a stream of features.
+ * It is made once per histogram, when the histogram is added, and returns the same results as histogram_def::match().
+ *
+ * Features that are entirely ASCII (nearly all of them) are lowercased, reduced to digits and searched
+ * without the round trip through UTF-32. If the histogram has no pattern, no required text and no flags
+ * that change the feature, an ASCII feature is its own key. Other features take the general path.
+ */
+class histogram_matcher {
+    bool whole_feature {false};         // the feature is the key
+    bool match_ascii(const std::string& key, std::string* displayString, const std::string& context) const; // key is already lowercased
+
+public:
+    histogram_matcher(const histogram_def& def_);
+    const histogram_def def;
+
+    static bool is_ascii(const std::string& str);
+    bool match(const std::string& u8key, std::string* displayString, const std::string& context) const;
+    bool match(const histogram_feature& f, std::string* displayString, const std::string& context) const;
+};
+
 std::ostream& operator<<(std::ostream& os, const histogram_def::flags_t& f);
 std::ostream& operator<<(std::ostream& os, const histogram_def& hd);
 
@@ -0,0 +1,208 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <queue>
+
+#include "formatter.h"
+#include "histogram_spill.h"
+
+namespace {
+inline void put32(std::string& buf, uint32_t v) {
+    for (int i = 0; i < 4; i++) buf.push_back(static_cast<char>((v >> (i * 8)) & 0xff));
+}
+
+inline uint32_t get32(const char* p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) v |= static_cast<uint32_t>(static_cast<uint8_t>(p[i])) << (i * 8);
+    return v;
+}
+
+/* The order in which AtomicUnicodeHistogram::makeReport() returns entries */
+bool report_order(const histogram_spill::run_entry_t& a, const histogram_spill::run_entry_t& b) {
+    if (a.second.count > b.second.count) return true;
+    if (a.second.count < b.second.count) return false;
+    return a.first < b.first;
+}
+}
+
+histogram_spill::histogram_spill(const std::filesystem::path& prefix_) : prefix(prefix_)
+{
+}
+
+histogram_spill::~histogram_spill()
+{
+    std::error_code ec;
+    for (const auto& fname : run_files) {
+        std::filesystem::remove(fname, ec);
+    }
+}
+
+/* Names are reserved in run_files before the run is written, so that the destructor removes partial runs. */
+std::filesystem::path histogram_spill::new_run_fname()
+{
+    const std::lock_guard<std::mutex> lock(M);
+    run_files.push_back(prefix.string() + std::to_string(next_run++));
+    return run_files.back();
+}
+
+size_t histogram_spill::runs() const
+{
+    const std::lock_guard<std::mutex> lock(M);
+    return run_files.size();
+}
+
+void histogram_spill::write_run(const std::filesystem::path& fname, const std::vector<run_entry_t>& entries)
+{
+    std::ofstream out(fname, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    if (!out.is_open()) {
+        throw SpillError(Formatter() << "cannot create " << fname << ": " << strerror(errno));
+    }
+    std::string buf;
+    for (const auto& e : entries) {
+        put32(buf, e.second.count);
+        put32(buf, e.second.count16);
+        put32(buf, e.first.size());
+        buf.append(e.first);
+        if (buf.size() > 65536) {
+            out.write(buf.data(), buf.size());
+            buf.clear();
+        }
+    }
+    out.write(buf.data(), buf.size());
+    out.close();
+    if (out.fail()) {
+        throw SpillError(Formatter() << "cannot write " << fname);
+    }
+}
+
+histogram_spill::run_reader::run_reader(const std::filesystem::path& fname)
+    : in(fname, std::ios_base::in | std::ios_base::binary)
+{
+    if (!in.is_open()) {
+        throw SpillError(Formatter() << "cannot open " << fname);
+    }
+}
+
+bool histogram_spill::run_reader::next(run_entry_t& e)
+{
+    char hdr[12];
+    in.read(hdr, sizeof(hdr));
+    if (in.gcount() == 0 && in.eof()) return false;
+    if (in.gcount() != sizeof(hdr)) throw SpillError("truncated run");
+    e.second.count   = get32(hdr);
+    e.second.count16 = get32(hdr + 4);
+    e.first.resize(get32(hdr + 8));
+    in.read(e.first.data(), e.first.size());
+    if (static_cast<size_t>(in.gcount()) != e.first.size()) throw SpillError("truncated run");
+    return true;
+}
+
+size_t histogram_spill::spill(AtomicUnicodeHistogram& h)
+{
+    std::vector<run_entry_t> entries = h.drain();
+    if (entries.empty()) return 0;
+    std::filesystem::path fname = new_run_fname();
+    write_run(fname, entries);
+    spilled_entries += entries.size();
+    spilled_bytes += std::filesystem::file_size(fname);
+    return entries.size();
+}
+
+void histogram_spill::merge(AtomicUnicodeHistogram& h, size_t memory_budget, item_callback_t cb)
+{
+    std::vector<run_entry_t> last = h.drain(); // what never left memory, merged as one more run
+    std::vector<std::filesystem::path> key_runs;
+    {
+        const std::lock_guard<std::mutex> lock(M);
+        key_runs = run_files;
+    }
+
+    /* Pass 1: merge the runs by key, combining the tallies of equal keys.
+     * The combined entries are put in report order in batches; every batch but the last is spilled.
+     */
+    std::vector<std::unique_ptr<run_reader>> readers;
+    for (const auto& fname : key_runs) {
+        readers.push_back(std::make_unique<run_reader>(fname));
+    }
+    std::vector<run_entry_t> heads(readers.size() + 1);
+    size_t last_pos = 0;
+    auto advance = [&](size_t src) {
+        if (src < readers.size()) return readers[src]->next(heads[src]);
+        if (last_pos == last.size()) return false;
+        heads[src] = std::move(last[last_pos++]);
+        return true;
+    };
+    auto after = [&heads](size_t a, size_t b) { return heads[b].first < heads[a].first; };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(after)> heap(after);
+    for (size_t src = 0; src < heads.size(); src++) {
+        if (advance(src)) heap.push(src);
+    }
+
+    std::vector<run_entry_t> batch;
+    size_t batch_bytes = 0;
+    std::vector<std::filesystem::path> count_runs;
+    auto spill_batch = [&]() {
+        std::sort(batch.begin(), batch.end(), report_order);
+        count_runs.push_back(new_run_fname());
+        write_run(count_runs.back(), batch);
+        batch.clear();
+        batch_bytes = 0;
+    };
+
+    while (!heap.empty()) {
+        size_t src = heap.top();
+        heap.pop();
+        run_entry_t e = std::move(heads[src]);
+        if (advance(src)) heap.push(src);
+        while (!heap.empty() && heads[heap.top()].first == e.first) {
+            src = heap.top();
+            heap.pop();
+            e.second.count   += heads[src].second.count;
+            e.second.count16 += heads[src].second.count16;
+            if (advance(src)) heap.push(src);
+        }
+        batch_bytes += sizeof(e) + e.first.size();
+        batch.push_back(std::move(e));
+        if (memory_budget > 0 && batch_bytes > memory_budget) spill_batch();
+    }
+    readers.clear();
+    std::vector<run_entry_t>().swap(last);
+
+    /* Pass 2: if everything fit in one batch, it is already sorted; otherwise merge the batches */
+    if (count_runs.empty()) {
+        std::sort(batch.begin(), batch.end(), report_order);
+        for (auto& e : batch) {
+            cb(AtomicUnicodeHistogram::auh_t::item(e.first, &e.second));
+        }
+    } else {
+        if (!batch.empty()) spill_batch();
+        for (const auto& fname : count_runs) {
+            readers.push_back(std::make_unique<run_reader>(fname));
+        }
+        heads.resize(readers.size());
+        auto later = [&heads](size_t a, size_t b) { return report_order(heads[b], heads[a]); };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(later)> rheap(later);
+        for (size_t src = 0; src < readers.size(); src++) {
+            if (readers[src]->next(heads[src])) rheap.push(src);
+        }
+        while (!rheap.empty()) {
+            size_t src = rheap.top();
+            rheap.pop();
+            cb(AtomicUnicodeHistogram::auh_t::item(heads[src].first, &heads[src].second));
+            if (readers[src]->next(heads[src])) rheap.push(src);
+        }
+        readers.clear();
+    }
+
+    /* All of the runs have been consumed */
+    const std::lock_guard<std::mutex> lock(M);
+    std::error_code ec;
+    for (const auto& fname : run_files) {
+        std::filesystem::remove(fname, ec);
+    }
+    run_files.clear();
+}
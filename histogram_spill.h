@@ -0,0 +1,80 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef HISTOGRAM_SPILL_H
+#define HISTOGRAM_SPILL_H
+
+#include <atomic>
+#include <cinttypes>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "atomic_unicode_histogram.h"
+
+/**
+ * histogram_spill:
+ * Builds a histogram that is larger than memory.
+ *
+ * When memory runs short, spill() drains an AtomicUnicodeHistogram into a run file sorted by key,
+ * and the histogram starts over empty. At shutdown, merge() reads the runs and what is left in the
+ * histogram in a single k-way merge by key, adding the tallies of a key that appears in several runs.
+ * The combined entries are then put in report order (high counts first) in memory_budget-sized batches,
+ * which are spilled again if there is more than one, and merged a second time.
+ * The result is the same histogram that would have been made if everything had fit in memory.
+ *
+ * Run files are named <prefix><n> and are deleted by merge() and by the destructor.
+ *
+ * Run file layout (all integers are little-endian), repeated for each entry:
+ *   uint32 count, uint32 count16, uint32 len, key bytes
+ */
+class histogram_spill {
+    histogram_spill(const histogram_spill&) = delete;
+    histogram_spill& operator=(const histogram_spill&) = delete;
+
+public:
+    typedef AtomicUnicodeHistogram::run_entry_t run_entry_t;
+    typedef std::function<void(const AtomicUnicodeHistogram::auh_t::item&)> item_callback_t;
+
+    class SpillError : public std::exception {
+    public:
+        std::string msg {};
+        SpillError(const std::string &m) : msg(std::string("Histogram spill error: ") + m) {}
+        const char* what() const noexcept override { return msg.c_str(); };
+    };
+
+    histogram_spill(const std::filesystem::path& prefix_);
+    ~histogram_spill();
+
+    /* Drain h into a new run. Threadsafe; returns the number of entries spilled. */
+    size_t spill(AtomicUnicodeHistogram& h);
+    size_t runs() const;
+    uint64_t entries_spilled() const { return spilled_entries; }
+    uint64_t bytes_spilled() const { return spilled_bytes; }
+
+    /* Drain h, merge it with the runs, and call cb for every entry in report order.
+     * At most about memory_budget bytes of entries are held at once; 0 means no limit.
+     */
+    void merge(AtomicUnicodeHistogram& h, size_t memory_budget, item_callback_t cb);
+
+    /* Sequential access to one run */
+    class run_reader {
+        std::ifstream in;
+    public:
+        run_reader(const std::filesystem::path& fname);
+        bool next(run_entry_t& e);      // false at the end of the run
+    };
+    static void write_run(const std::filesystem::path& fname, const std::vector<run_entry_t>& entries);
+
+private:
+    const std::filesystem::path prefix;
+    mutable std::mutex M {};            // protects run_files and next_run
+    std::vector<std::filesystem::path> run_files {};
+    unsigned int next_run {0};
+    std::atomic<uint64_t> spilled_entries {0};
+    std::atomic<uint64_t> spilled_bytes {0};
+    std::filesystem::path new_run_fname();
+};
+
+#endif
@@ -0,0 +1,185 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <queue>
+
+#include "literal_prefilter.h"
+
+namespace {
+inline uint8_t lower(uint8_t ch) { return (ch >= 'A' && ch <= 'Z') ? ch + ('a' - 'A') : ch; }
+}
+
+/**
+ * Scan the regex at the top level, collecting runs of literal characters.
+ * A run ends at anything that is not a required literal: a class, an escape such as \d, '.', an anchor, or a group.
+ * Groups are skipped entirely, since they may contain alternatives; so are classes, wherever they are. A character followed by '*', '?' or '{'
+ * may not be present, so it is not part of a run; with '+' it is required, but ends the run.
+ * An alternation at the top level means nothing is required. Escapes that this does not understand end the scan.
+ */
+std::string literal_prefilter::required_literal(const std::string& re)
+{
+    std::string best;
+    std::string run;
+    auto end_run = [&]() {
+        if (run.size() > best.size()) best = run;
+        run.clear();
+    };
+    int depth = 0;
+    for (size_t i = 0; i < re.size(); i++) {
+        char ch = re[i];
+        if (ch == '\\' && depth > 0) {   // skip escaped characters inside groups
+            i++;
+            continue;
+        }
+        if (ch == '[') {                // skip the class, at any depth, since it may hold '(', ')' or '|'
+            end_run();
+            i++;
+            if (i < re.size() && re[i] == '^') i++;
+            if (i < re.size() && re[i] == ']') i++;
+            for (; i < re.size() && re[i] != ']'; i++) {
+                if (re[i] == '\\') i++;
+            }
+            continue;
+        }
+        if (ch == '(') { depth++; end_run(); continue; }
+        if (ch == ')') { depth--; end_run(); continue; }
+        if (depth > 0) continue;
+        if (ch == '|') return "";
+
+        if (ch == '{') {                // a repeat count applies to what came before, which is no longer in the run
+            end_run();
+            while (i < re.size() && re[i] != '}') i++;
+            continue;
+        }
+
+        char lit = ch;
+        bool literal = true;
+        if (ch == '\\') {
+            if (i + 1 >= re.size()) break;
+            char n = re[++i];
+            if (n != 0 && strchr("dDwWsSbBAz", n)) {
+                literal = false;
+            } else if (isalnum(static_cast<unsigned char>(n)) || (n & 0x80)) {
+                break;                  // \x41, \pL, \Q...\E, \1 and so on
+            } else {
+                lit = n;                // an escaped punctuation character
+            }
+        } else if (strchr(".^$*+?", ch)) {
+            literal = false;
+        }
+        if (!literal || (lit & 0x80)) {
+            end_run();
+            continue;
+        }
+
+        char q = (i + 1 < re.size()) ? re[i + 1] : 0;
+        if (q == '*' || q == '?' || q == '{') {
+            end_run();                  // the character is optional
+            continue;
+        }
+        run.push_back(lower(lit));
+        if (q == '+') end_run();
+    }
+    end_run();
+    return best;
+}
+
+/* Checks eight bytes at a time */
+bool literal_prefilter::is_ascii(const std::string& str)
+{
+    const char* p = str.data();
+    size_t n = str.size();
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        if (w & 0x8080808080808080ULL) return false;
+    }
+    for (; n > 0; p++, n--) {
+        if (*p & 0x80) return false;
+    }
+    return true;
+}
+
+void literal_prefilter::add(const std::string& literal, uint32_t id)
+{
+    if (literal.size() < MIN_LITERAL) {
+        always.push_back(id);
+        return;
+    }
+    int32_t state = 0;
+    for (char c : literal) {
+        uint8_t ch = lower(c);
+        int32_t next = -1;
+        for (const auto& e : nodes[state].next) {
+            if (e.first == ch) {
+                next = e.second;
+                break;
+            }
+        }
+        if (next < 0) {
+            next = nodes.size();
+            nodes[state].next.push_back(std::make_pair(ch, next));
+            nodes.emplace_back();
+        }
+        state = next;
+    }
+    nodes[state].ids.push_back(id);
+}
+
+int32_t literal_prefilter::go(int32_t state, uint8_t ch) const
+{
+    if (state == 0) return root_next[ch];
+    for (const auto& e : nodes[state].next) {
+        if (e.first == ch) return e.second;
+    }
+    return -1;
+}
+
+/* Breadth-first, so that each node's fail link is computed after those of all shorter nodes */
+void literal_prefilter::compile()
+{
+    root_next.fill(0);
+    std::queue<int32_t> q;
+    for (const auto& e : nodes[0].next) {
+        root_next[e.first] = e.second;
+        nodes[e.second].fail = 0;
+        nodes[e.second].dict = 0;
+        q.push(e.second);
+    }
+    while (!q.empty()) {
+        int32_t u = q.front();
+        q.pop();
+        for (const auto& e : nodes[u].next) {
+            int32_t f = nodes[u].fail;
+            int32_t g;
+            while ((g = go(f, e.first)) < 0) f = nodes[f].fail;
+            nodes[e.second].fail = g;
+            nodes[e.second].dict = nodes[g].ids.empty() ? nodes[g].dict : g;
+            q.push(e.second);
+        }
+    }
+    std::sort(always.begin(), always.end());
+}
+
+void literal_prefilter::candidates(const std::string& probe, std::vector<uint32_t>& ids) const
+{
+    ids.assign(always.begin(), always.end());
+    int32_t state = 0;
+    for (char c : probe) {
+        uint8_t ch = lower(c);
+        int32_t next;
+        while ((next = go(state, ch)) < 0) state = nodes[state].fail;
+        state = next;
+        for (int32_t n = nodes[state].ids.empty() ? nodes[state].dict : state; n > 0; n = nodes[n].dict) {
+            ids.insert(ids.end(), nodes[n].ids.begin(), nodes[n].ids.end());
+        }
+    }
+    if (ids.size() > always.size()) {
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    }
+}
@@ -0,0 +1,51 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef LITERAL_PREFILTER_H
+#define LITERAL_PREFILTER_H
+
+#include <array>
+#include <cinttypes>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * literal_prefilter:
+ * Decides which of a set of regular expressions could possibly match a string, by looking for
+ * a literal that each one requires, so that only those regexes need to be run.
+ *
+ * required_literal() finds the longest run of literal characters that every match of a regex must contain.
+ * The literals are put in an Aho-Corasick automaton, which finds all of them in one pass over the probe.
+ * Regexes without a usable literal are always candidates.
+ *
+ * Matching ignores ASCII case, because regex_vector's regexes are case-insensitive. Case-insensitive
+ * regexes can also match some non-ASCII characters (KELVIN SIGN matches 'k'), so the prefilter is
+ * only exact for ASCII probes; callers must not use it for anything else.
+ */
+class literal_prefilter {
+    struct node_t {
+        std::vector<std::pair<uint8_t, int32_t>> next {}; // goto edges
+        int32_t fail {0};                // longest proper suffix that is in the trie
+        int32_t dict {0};                // nearest node on the fail chain that ends a literal; 0 if none
+        std::vector<uint32_t> ids {};    // ids of the literals that end here
+    };
+    std::vector<node_t> nodes {1};       // nodes[0] is the root
+    std::array<int32_t, 256> root_next {}; // the root's edges, dense; filled by compile()
+    std::vector<uint32_t> always {};     // ids without a literal
+    int32_t go(int32_t state, uint8_t ch) const; // -1 if there is no edge
+
+public:
+    static inline const size_t MIN_LITERAL {3}; // shorter literals are not worth checking
+
+    /* The longest literal that every match of regex must contain, lowercased; "" if there is none. */
+    static std::string required_literal(const std::string& regex);
+    static bool is_ascii(const std::string& str);
+
+    void add(const std::string& literal, uint32_t id); // "" or a literal shorter than MIN_LITERAL: always a candidate
+    void compile();                     // call after the last add()
+    size_t always_count() const { return always.size(); }
+
+    /* Set ids to the sorted ids of the regexes that could match probe, which must be ASCII */
+    void candidates(const std::string& probe, std::vector<uint32_t>& ids) const;
+};
+
+#endif
@@ -18,30 +18,44 @@
 #include <sys/vmmeter.h>
 #endif
 
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+
+#include <chrono>
 #include <cmath>
+#include <mutex>
 #include <unistd.h>
 
 /**
- * return the CPU percentage (0-100) used by the current process. Use 'ps -O %cpu <pid> if system call not available.
- * The popen implementation is not meant to be efficient.
+ * Memory and CPU statistics for the current process.
+ * None of these fork; they are cheap enough to be sampled several times a second (see memory_monitor).
  */
 struct machine_stats {
+    /**
+     * return the CPU percentage (0-100 per core) used by the current process since the previous call.
+     * The first call returns 0. Uses getrusage(), so nothing is forked.
+     */
     static float get_cpu_percentage() {
-        char buf[100];
-        snprintf(buf,sizeof(buf),"ps -O %ccpu %d",'%',getpid());
-        FILE *f = popen(buf,"r");
-        if(f==nullptr){
-            perror("popen failed\n");
-            return(0);
+#ifdef HAVE_SYS_RESOURCE_H
+        static std::mutex M;
+        static double last_cpu  = -1;
+        static double last_wall = 0;
+        struct rusage ru;
+        if (getrusage(RUSAGE_SELF, &ru) != 0) return nan("getrusage");
+        double cpu  = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1E6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1E6;
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        const std::lock_guard<std::mutex> lock(M);
+        float ret = 0;
+        if (last_cpu >= 0 && wall > last_wall) {
+            ret = static_cast<float>((cpu - last_cpu) * 100.0 / (wall - last_wall));
         }
-        if (fgets(buf,sizeof(buf),f)==NULL) return nan("error1");           /* read the first line */
-        if (fgets(buf,sizeof(buf),f)==NULL) return nan("error2");           /* read the second line */
-        pclose(f);
-        buf[sizeof(buf)-1] = 0;             // in case it needs termination
-        int pid=0;
-        float ff = 0;
-        int count = sscanf(buf,"%d %f",&pid,&ff);
-        return (count==2) ? ff : nan("get_cpu_percentage");
+        last_cpu  = cpu;
+        last_wall = wall;
+        return ret;
+#else
+        return nan("get_cpu_percentage");
+#endif
     };
 
     static uint64_t get_available_memory() {
@@ -102,13 +116,12 @@ struct machine_stats {
 	if(f){
 	    unsigned long size, resident, share, text, lib, data, dt;
 	    if(fscanf(f,"%ld %ld %ld %ld %ld %ld %ld", &size,&resident,&share,&text,&lib,&data,&dt) == 7){
-		*virtual_size  = size * 4096;
-		*resident_size = resident * 4096;
-                fclose(f);
-		return ;
+                static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+		*virtual_size  = size * page_size;
+		*resident_size = resident * page_size;
 	    }
+	    fclose(f);
 	}
-	fclose(f);
 	return ;
     };
 };
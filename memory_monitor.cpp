@@ -0,0 +1,137 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include "aftimer.h"
+#include "formatter.h"
+#include "machine_stats.h"
+#include "memory_monitor.h"
+
+#include "dfxml_cpp/src/dfxml_writer.h"
+
+memory_monitor::memory_monitor(uint64_t budget_, class dfxml_writer* writer_) : budget(budget_), writer(writer_)
+{
+}
+
+memory_monitor::~memory_monitor()
+{
+    stop();
+}
+
+memory_monitor::sample_t memory_monitor::sample()
+{
+    sample_t s;
+    machine_stats::get_memory(&s.virtual_size, &s.resident);
+    s.available = machine_stats::get_available_memory();
+    return s;
+}
+
+void memory_monitor::start()
+{
+    const std::lock_guard<std::mutex> lock(M);
+    if (thread) return;
+    stopping = false;
+    thread = new std::thread(&memory_monitor::run, this);
+}
+
+/* Stop the thread. Producers are released, since nothing will release them later. */
+void memory_monitor::stop()
+{
+    bool running = false;
+    {
+        const std::lock_guard<std::mutex> lock(M);
+        running = thread != nullptr;
+        stopping = true;
+    }
+    if (running) {
+        wakeup.notify_all();
+        thread->join();
+        delete thread;
+        thread = nullptr;
+        if (throttled && throttle) {
+            throttle(false);
+            throttled = false;
+        }
+    }
+    write_log();
+}
+
+void memory_monitor::run()
+{
+    std::unique_lock<std::mutex> lock(M);
+    while (!stopping) {
+        lock.unlock();
+        check();
+        lock.lock();
+        wakeup.wait_for(lock, interval, [this] { return stopping; });
+    }
+}
+
+void memory_monitor::check()
+{
+    const sample_t s = sampler();
+    samples++;
+    if (s.resident > budget) {
+        const uint64_t over = s.resident - budget;
+        if (next_relief == SPILL) {
+            next_relief = EVICT;
+            if (spill && spill(over)) {
+                spills++;
+                log("spill", s, Formatter() << "over='" << over << "' ");
+                return;
+            }
+        }
+        if (next_relief == EVICT) {
+            next_relief = THROTTLE;
+            if (evict) {
+                size_t n = evict();
+                if (n > 0) {
+                    evictions++;
+                    log("evict", s, Formatter() << "entries='" << n << "' ");
+                    return;
+                }
+            }
+        }
+        if (throttle && !throttled) {
+            throttle(true);
+            throttled = true;
+            throttles++;
+            log("throttle", s);
+        }
+    } else {
+        next_relief = SPILL;
+        if (throttled && s.resident < budget * low_water) {
+            throttle(false);
+            throttled = false;
+            log("release", s);
+        }
+    }
+}
+
+/* Called by check(), so the event is only queued; write_log() writes it */
+void memory_monitor::log(const std::string& action, const sample_t& s, const std::string& detail)
+{
+    if (writer == nullptr) return;
+    std::string attrs = Formatter()
+        << "action='" << action << "' "
+        << "budget='" << budget << "' "
+        << "rss='" << s.resident << "' "
+        << "vss='" << s.virtual_size << "' "
+        << "available='" << s.available << "' "
+        << detail
+        << aftimer::now_str("t='", "'");
+    const std::lock_guard<std::mutex> lock(M);
+    events.push_back(std::move(attrs));
+}
+
+void memory_monitor::write_log()
+{
+    std::vector<std::string> pending;
+    {
+        const std::lock_guard<std::mutex> lock(M);
+        pending.swap(events);
+    }
+    for (const auto& attrs : pending) {
+        writer->xmlout("memory_monitor", "", attrs, true);
+    }
+}
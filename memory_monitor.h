@@ -0,0 +1,86 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef MEMORY_MONITOR_H
+#define MEMORY_MONITOR_H
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * memory_monitor:
+ * A background thread that samples the process's memory use and enforces a memory budget.
+ *
+ * Samples come from machine_stats (/proc/self/statm and /proc/meminfo on Linux, task_info on macOS);
+ * nothing is forked, so the default interval is short.
+ *
+ * While the resident size is over the budget, each sample applies the first relief that does something:
+ *   spill    - spill the largest histograms to disk (feature_recorder_set::histograms_write_largest),
+ *              but only those at least as large as the overage
+ *   evict    - drop caches (feature_recorder_set::carve_cache_evict)
+ *   throttle - hold back producers in the thread_pool until the resident size falls below low_water * budget
+ * Freed memory is seldom returned to the system, so a relief is not tried again while the samples
+ * stay over budget: the next one is. Going under budget starts again with spilling.
+ * Reliefs that are not set are skipped. Every decision is logged to the DFXML file, if there is one.
+ * The decisions are kept until stop() or write_log() writes them, on the thread that calls it, so that
+ * the monitor's thread never writes to the DFXML file while the scanners may be in the middle of an element.
+ */
+class memory_monitor {
+    memory_monitor(const memory_monitor&) = delete;
+    memory_monitor& operator=(const memory_monitor&) = delete;
+
+public:
+    struct sample_t {
+        uint64_t resident {0};
+        uint64_t virtual_size {0};
+        uint64_t available {0};         // memory available to the system; 0 if unknown
+    };
+    typedef std::function<sample_t()> sampler_t;
+    typedef std::function<bool(uint64_t)> spill_t;  // spills something of at least this many bytes; true if it did
+    typedef std::function<size_t()> evict_t;        // returns the number of entries evicted
+    typedef std::function<void(bool)> throttle_t;   // true to hold back producers, false to release them
+
+    memory_monitor(uint64_t budget_, class dfxml_writer* writer_ = nullptr);
+    ~memory_monitor();                  // stops the thread
+
+    const uint64_t budget;
+    double low_water {0.9};             // fraction of the budget at which throttling stops
+    std::chrono::milliseconds interval {100};
+
+    sampler_t  sampler {sample};        // replaceable for testing
+    spill_t    spill {};
+    evict_t    evict {};
+    throttle_t throttle {};
+
+    static sample_t sample();           // the process's current memory use
+
+    void start();
+    void stop();                        // also writes the log
+    void check();                       // take one sample and act on it; called by the thread
+    void write_log();                   // write the decisions logged so far to the DFXML file
+
+    std::atomic<uint64_t> samples {0};
+    std::atomic<uint64_t> spills {0};
+    std::atomic<uint64_t> evictions {0};
+    std::atomic<uint64_t> throttles {0};
+    std::atomic<bool>     throttled {false};
+
+private:
+    class dfxml_writer* writer {nullptr};
+    std::thread* thread {nullptr};
+    std::mutex M {};                    // protects stopping and events
+    std::condition_variable wakeup {};
+    bool stopping {false};
+    std::vector<std::string> events {}; // attributes of the logged decisions not yet written
+    enum relief_t {SPILL, EVICT, THROTTLE};
+    relief_t next_relief {SPILL};       // the relief to try while over budget; used by check()
+    void run();
+    void log(const std::string& action, const sample_t& s, const std::string& detail = "");
+};
+
+#endif
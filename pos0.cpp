@@ -1,6 +1,123 @@
+#include <array>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+
 #include "pos0.h"
 
 /**
  *  Map a file; falls back to read if mmap is not available
  */
 std::string pos0_t::map_file_delimiter(pos0_t::U10001C);
+
+namespace {
+/* The parts of path that pos0_t reports, computed once per interned path */
+std::string calc_first_part(const std::string& path) {
+    size_t p = path.find('-');
+    if (p == std::string::npos) return std::string("");
+    return path.substr(0, p);
+}
+
+std::string calc_last_added_part(const std::string& path) {
+    size_t p = path.rfind('-');
+    if (p == std::string::npos) return std::string("");
+    return path.substr(p + 1);
+}
+
+std::string calc_alpha_part(const std::string& path) {
+    std::string desc;
+    bool inalpha = false;
+    /* Now get the std::string part of pos0 */
+    for (const auto &it : path) {
+        if ((it) == '-') {
+            if (desc.size() > 0 && desc.at(desc.size() - 1) != '/') desc += '/';
+            inalpha = false;
+        }
+        if (isalpha(it) || (inalpha && isdigit(it))) {
+            desc += it;
+            inalpha = true;
+        }
+    }
+    return desc;
+}
+
+/* Keyed by views of the interned paths themselves. Never destroyed, so that pos0_t objects
+ * with static storage duration can still release their paths at exit.
+ * The table is divided into STRIPES stripes, selected by the hash of the path, each with its own lock,
+ * so that scanner threads working on different paths seldom wait for each other.
+ */
+struct intern_table_t {
+    static inline const size_t STRIPES {16};
+    struct stripe_t {
+        std::mutex M {};
+        std::unordered_map<std::string_view, pos0_t::interned_path_t*> paths {};
+    };
+    std::array<stripe_t, STRIPES> stripes {};
+    stripe_t& stripe(std::string_view path) { return stripes[std::hash<std::string_view>()(path) % STRIPES]; }
+};
+
+intern_table_t& intern_table() {
+    static intern_table_t* table = new intern_table_t();
+    return *table;
+}
+}
+
+pos0_t::interned_path_t::interned_path_t(const std::string& p) :
+    path(p),
+    depth(pos0_t::calc_depth(p)),
+    first_part(calc_first_part(p)),
+    last_added_part(calc_last_added_part(p)),
+    alpha_part(calc_alpha_part(p)),
+    image_offset(p.empty() ? 0 : stoi64(p))
+{
+}
+
+const pos0_t::interned_path_t* pos0_t::empty_path()
+{
+    static const interned_path_t* empty = new interned_path_t("");
+    return empty;
+}
+
+const pos0_t::interned_path_t* pos0_t::intern(const std::string& path)
+{
+    if (path.empty()) return empty_path();
+    auto& stripe = intern_table().stripe(path);
+    const std::lock_guard<std::mutex> lock(stripe.M);
+    auto it = stripe.paths.find(path);
+    if (it != stripe.paths.end()) {
+        it->second->refs.fetch_add(1, std::memory_order_relaxed);
+        return it->second;
+    }
+    auto* ip = new interned_path_t(path);
+    ip->refs.store(1, std::memory_order_relaxed);
+    stripe.paths.emplace(std::string_view(ip->path), ip);
+    return ip;
+}
+
+/* A count only goes from 1 to 0, or from 0 to 1 in intern(), with the path's stripe locked,
+ * so an interned path is never found by intern() while it is being freed.
+ */
+void pos0_t::release(const interned_path_t* ip)
+{
+    if (ip == empty_path()) return;
+    uint64_t n = ip->refs.load(std::memory_order_relaxed);
+    while (n > 1) {
+        if (ip->refs.compare_exchange_weak(n, n - 1, std::memory_order_acq_rel)) return;
+    }
+    auto& stripe = intern_table().stripe(ip->path);
+    const std::lock_guard<std::mutex> lock(stripe.M);
+    if (ip->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        stripe.paths.erase(std::string_view(ip->path));
+        delete ip;
+    }
+}
+
+size_t pos0_t::interned_count()
+{
+    size_t count = 0;
+    for (auto& stripe : intern_table().stripes) {
+        const std::lock_guard<std::mutex> lock(stripe.M);
+        count += stripe.paths.size();
+    }
+    return count;
+}
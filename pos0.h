@@ -3,11 +3,14 @@
 
 #include <exception>
 #include <algorithm>
+#include <atomic>
+#include <charconv>
 #include <cinttypes>
 #include <cctype>
 #include <sstream>
 #include <string>
 #include <filesystem>
+#include <functional>
 
 /****************************************************************
  *** pos0_t
@@ -27,8 +30,12 @@
  *       unzip, go 300 bytes into the decompressed stream, un-BASE64, and
  *       go 30 bytes into that.
  *
- * pos0_t uses a string to hold the base path and the offset into that path
- * in a 64-bit number.
+ * pos0_t holds the base path as an interned path, which is shared by every pos0_t
+ * with the same path, and the offset into that path in a 64-bit number.
+ * The parts of the path (depth, first part, last added part, alpha part and image offset)
+ * are worked out once, when the path is interned, so copying a pos0_t, comparing two for
+ * equality and hashing one are pointer and integer operations.
+ * Interned paths are reference counted and freed when the last pos0_t that uses them goes away.
  */
 
 inline int64_t stoi64(std::string str) {
@@ -39,25 +46,50 @@ inline int64_t stoi64(std::string str) {
 }
 
 class pos0_t {
-    mutable int depth_ {-1};               // if -1, it needs to be calculated. 0 is top.
+public:
+    /* One distinct forensic path and its parts; see intern() */
+    struct interned_path_t {
+        explicit interned_path_t(const std::string& p);
+        interned_path_t(const interned_path_t&) = delete;
+        interned_path_t& operator=(const interned_path_t&) = delete;
+        const std::string path;
+        const unsigned int depth;
+        const std::string first_part;
+        const std::string last_added_part;
+        const std::string alpha_part;
+        const uint64_t image_offset;
+        mutable std::atomic<uint64_t> refs {0}; // the empty path is never counted
+    };
+
+    /* The interned copy of path, with a reference added for the caller; threadsafe */
+    static const interned_path_t* intern(const std::string& path);
+    static void release(const interned_path_t* ip); // drop a reference from intern() or a copy
+    static size_t interned_count();                 // the number of distinct non-empty paths in use
+
+private:
+    static const interned_path_t* empty_path();
+    static const interned_path_t* add_ref(const interned_path_t* ip) {
+        if (ip != empty_path()) ip->refs.fetch_add(1, std::memory_order_relaxed);
+        return ip;
+    }
+    const interned_path_t* const ip;
 
 public:
     inline static const std::string U10001C = "\xf4\x80\x80\x9c"; // default delimeter character in bulk_extractor
     static std::string map_file_delimiter;                        // character placed
     static void set_map_file_delimiter(const std::string new_delim) { map_file_delimiter = new_delim; }
-    const std::string path{}; /* forensic path of decoders*/
+    const std::string& path;  /* forensic path of decoders; lives in the interned path */
     const uint64_t offset{0}; /* location of buf[0] */
 
-    explicit pos0_t() {}                                                 // the beginning of a nothing
-    explicit pos0_t(std::string s, uint64_t o = 0) : path(s), offset(o) {}        // s can be a full path
+    explicit pos0_t() : ip(empty_path()), path(ip->path) {}          // the beginning of a nothing
+    explicit pos0_t(const std::string& s, uint64_t o = 0) : ip(intern(s)), path(ip->path), offset(o) {} // s can be a full path
     explicit pos0_t(std::filesystem::path fn, std::string s, uint64_t o = 0) :
-        path(fn.string() + pos0_t::map_file_delimiter + s), offset(o) {}
-    pos0_t(const pos0_t& obj) : path(obj.path), offset(obj.offset) {}    // copy operator
+        ip(intern(fn.string() + pos0_t::map_file_delimiter + s)), path(ip->path), offset(o) {}
+    pos0_t(const pos0_t& obj) : ip(add_ref(obj.ip)), path(ip->path), offset(obj.offset) {} // copy operator
+    pos0_t(const pos0_t& obj, uint64_t o) : ip(add_ref(obj.ip)), path(ip->path), offset(o) {} // same path, new offset
+    ~pos0_t() { release(ip); }
 
-    /* Every new layer is indicated by a "-" followed by a letter.
-     * This threadsafe, but it may need to be computed twice if two
-     * computations are happening at the same time.
-     */
+    /* Every new layer is indicated by a "-" followed by a letter. */
     static unsigned int calc_depth(const std::string& s)  {
         if (s.size()<2) {
             return 0;
@@ -70,18 +102,48 @@ public:
         }
         return cdepth;
     }
-    unsigned int depth() const {
-        if (depth_ == -1 ){
-            depth_ = calc_depth(path);
+    unsigned int depth() const { return ip->depth; }
+    bool same_path(const pos0_t& other) const { return ip == other.ip; }
+    size_t hash() const { return std::hash<const void*>()(ip) ^ (std::hash<uint64_t>()(offset) * 0x9e3779b97f4a7c15ULL); }
+
+    /* The most that to_chars() writes: the path, two numbers and a '-' */
+    size_t max_chars() const { return path.size() + 42; }
+    /**
+     * Write str() of shift(s) into [first, last) without making either, like std::to_chars();
+     * returns std::errc::value_too_large if it does not fit, which it does in max_chars().
+     */
+    std::to_chars_result to_chars(char* first, char* last, int64_t s = 0) const {
+        size_t p = std::string::npos;
+        if (s != 0) {
+            p = path.find('-');
+            if (p == std::string::npos) return std::to_chars(first, last, offset + s); // no path
+            int64_t baseOffset = 0;
+            std::from_chars(path.data(), path.data() + p, baseOffset);
+            std::to_chars_result r = std::to_chars(first, last, baseOffset + s);
+            if (r.ec != std::errc()) return r;
+            first = r.ptr;
+        } else {
+            p = 0;
+        }
+        const size_t rest = path.size() - p;
+        if (rest > 0) {
+            if (size_t(last - first) < rest + 1) return {last, std::errc::value_too_large};
+            first = std::copy(path.data() + p, path.data() + path.size(), first);
+            *first++ = '-';
         }
-        return depth_;
+        return std::to_chars(first, last, offset);
+    }
+    /* Append str() of shift(s) to out */
+    void append_to(std::string& out, int64_t s = 0) const {
+        const size_t start = out.size();
+        out.resize(start + max_chars());
+        std::to_chars_result r = to_chars(out.data() + start, out.data() + out.size(), s);
+        out.resize(r.ptr - out.data());
     }
-
     std::string str() const { // convert to a string, with offset included
-        std::stringstream ss;
-        if (path.size() > 0) { ss << path << "-"; }
-        ss << offset;
-        return ss.str();
+        std::string ret;
+        append_to(ret);
+        return ret;
     }
     bool isRecursive() const { // is there a path?
         return path.size() > 0;
@@ -90,34 +152,11 @@ public:
         return (path.find(name) != std::string::npos);
     }
 
-    std::string firstPart() const { // the first part of the path
-        size_t p = path.find('-');
-        if (p == std::string::npos) return std::string("");
-        return path.substr(0, p);
-    }
-    std::string lastAddedPart() const { // the last part of the path, before the offset
-        size_t p = path.rfind('-');
-        if (p == std::string::npos) return std::string("");
-        return path.substr(p + 1);
-    }
-    std::string alphaPart() const { // return the non-numeric parts, with /'s between each
-        std::string desc;
-        bool inalpha = false;
-        /* Now get the std::string part of pos0 */
-        for (const auto &it : path) {
-            if ((it) == '-') {
-                if (desc.size() > 0 && desc.at(desc.size() - 1) != '/') desc += '/';
-                inalpha = false;
-            }
-            if (isalpha(it) || (inalpha && isdigit(it))) {
-                desc += it;
-                inalpha = true;
-            }
-        }
-        return desc;
-    }
+    const std::string& firstPart() const { return ip->first_part; }          // the first part of the path
+    const std::string& lastAddedPart() const { return ip->last_added_part; } // the last part of the path, before the offset
+    const std::string& alphaPart() const { return ip->alpha_part; } // the non-numeric parts, with /'s between each
     uint64_t imageOffset() const { // return the offset from start of disk
-        if (path.size() > 0) return stoi64(path);
+        if (path.size() > 0) return ip->image_offset;
         return offset;
     }
 
@@ -131,10 +170,9 @@ public:
             return pos0_t("", offset + s);
         }
         /* Figure out the value of the shift */
-        int64_t baseOffset = stoi64(path.substr(0, p - 1));
-        std::stringstream ss;
-        ss << (baseOffset + s) << path.substr(p);
-        return pos0_t(ss.str(), offset);
+        int64_t baseOffset = 0;
+        std::from_chars(path.data(), path.data() + p, baseOffset);
+        return pos0_t(std::to_string(baseOffset + s) + path.substr(p), offset);
     }
 };
 
@@ -154,37 +192,41 @@ inline class pos0_t operator+(pos0_t pos, const std::string& subdir) {
 };
 
 /** Adding an offset */
-inline class pos0_t operator+(pos0_t pos, size_t delta) {
-    return pos0_t(pos.path, pos.offset + delta);
+inline class pos0_t operator+(const pos0_t& pos, size_t delta) {
+    return pos0_t(pos, pos.offset + delta);
 };
 
 /** Subtracting an offset */
-inline class pos0_t operator-(pos0_t pos, size_t delta) {
+inline class pos0_t operator-(const pos0_t& pos, size_t delta) {
     if (delta > pos.offset) {
         throw std::runtime_error("attempt to subtract a delta from an pos0_t that is larger that pos.offset");
     }
-    return pos0_t(pos.path, pos.offset - delta);
+    return pos0_t(pos, pos.offset - delta);
 };
 
 /** \name Comparision operations
  * @{
  */
 inline bool operator<(const class pos0_t& pos0, const class pos0_t& pos1) {
-    if (pos0.path.size() == 0 && pos1.path.size() == 0) return pos0.offset < pos1.offset;
-    if (pos0.path == pos1.path) return pos0.offset < pos1.offset;
+    if (pos0.same_path(pos1)) return pos0.offset < pos1.offset;
     return pos0.path < pos1.path;
 };
 
 inline bool operator>(const class pos0_t& pos0, const class pos0_t& pos1) {
-    if (pos0.path.size() == 0 && pos1.path.size() == 0) return pos0.offset > pos1.offset;
-    if (pos0.path == pos1.path) return pos0.offset > pos1.offset;
+    if (pos0.same_path(pos1)) return pos0.offset > pos1.offset;
     return pos0.path > pos1.path;
 };
 
 inline bool operator==(const class pos0_t& pos0, const class pos0_t& pos1) {
-    return pos0.path == pos1.path && pos0.offset == pos1.offset;
+    return pos0.same_path(pos1) && pos0.offset == pos1.offset;
 };
 
 inline bool operator!=(const class pos0_t& pos0, const class pos0_t& pos1) { return !(pos0 == pos1); };
 /** @} */
+
+namespace std {
+template <> struct hash<pos0_t> {
+    size_t operator()(const pos0_t& pos0) const { return pos0.hash(); }
+};
+}
 #endif
@@ -1,5 +1,7 @@
 /* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 
+#include <algorithm>
+
 #include "regex_vector.h"
 
 /* rewritten to use C++11's regex */
@@ -50,6 +52,8 @@ void regex_vector::push_back(const std::string& val) {
             throw std::runtime_error(std::string("RE2 compilation failed"));
         }
         re2_regex_comps.push_back( re );
+        required_literals.push_back(literal_prefilter::required_literal(val));
+        delete_compiled();              // recompiled on the next search
         return;
     }
 #else
@@ -64,9 +68,75 @@ void regex_vector::clear() {
         delete re;
     }
     re2_regex_comps.clear();
+    required_literals.clear();
+    delete_compiled();
 #endif
 }
 
+#ifdef HAVE_RE2
+/* Like push_back(), this is not threadsafe */
+void regex_vector::delete_compiled() {
+    delete re2_set.exchange(nullptr);
+    re2_set_failed = false;
+    delete literals.exchange(nullptr);
+}
+
+const literal_prefilter *regex_vector::compiled_prefilter() const {
+    literal_prefilter *pf = literals;
+    if (pf) return pf;
+
+    const std::lock_guard<std::mutex> lock(Mset);
+    if (literals) return literals;
+    pf = new literal_prefilter();
+    for (size_t i = 0; i < required_literals.size(); i++) {
+        pf->add(required_literals[i], i);
+    }
+    pf->compile();
+    literals = pf;
+    return pf;
+}
+
+/* Compile the set the first time it is needed. Returns nullptr if it cannot be compiled. */
+const RE2::Set *regex_vector::compiled_set() const {
+    RE2::Set *set = re2_set;
+    if (set || re2_set_failed) return set;
+
+    const std::lock_guard<std::mutex> lock(Mset);
+    if (re2_set || re2_set_failed) return re2_set;
+    RE2::Options options;
+    options.set_case_sensitive(false);
+    options.set_max_mem(SET_MAX_MEM);
+    set = new RE2::Set(options, RE2::UNANCHORED);
+    for (RE2 *re: re2_regex_comps) {
+        std::string error;
+        if (set->Add(re->pattern(), &error) < 0) {
+            std::cerr << "RE2::Set cannot add " << re->pattern() << ": " << error << std::endl;
+            delete set;
+            re2_set_failed = true;
+            return nullptr;
+        }
+    }
+    if (!set->Compile()) {
+        delete set;
+        re2_set_failed = true;
+        return nullptr;
+    }
+    re2_set = set;
+    return set;
+}
+
+bool regex_vector::search_one(const RE2 &re, const std::string& probe, std::string* found, size_t* offset, size_t* len) {
+    re2::StringPiece sp;
+    if (RE2::PartialMatch( probe, re, &sp) ){
+        if (found)  *found  = std::string(sp.data(), sp.size());
+        if (offset) *offset = sp.data() - probe.data(); // this is so gross
+        if (len)    *len    = sp.length();
+        return true;
+    }
+    return false;
+}
+#endif
+
 size_t regex_vector::size() const {
 #ifdef HAVE_RE2
     return re2_regex_comps.size();
@@ -82,14 +152,36 @@ size_t regex_vector::size() const {
  */
 bool regex_vector::search_all(const std::string& probe, std::string* found, size_t* offset, size_t* len) const {
 #ifdef HAVE_RE2
-    for (RE2 *re: re2_regex_comps) {
-        re2::StringPiece sp;
-        if (RE2::PartialMatch( probe, *re, &sp) ){
-            if (found)  *found  = std::string(sp.data(), sp.size());
-            if (offset) *offset = sp.data() - probe.data(); // this is so gross
-            if (len)    *len    = sp.length();
-            return true;
+    if (multi_pattern && re2_regex_comps.size() > 1) {
+        if (prefilter && literal_prefilter::is_ascii(probe)) {
+            const literal_prefilter *pf = compiled_prefilter();
+            if (pf->always_count() <= PREFILTER_MAX_CANDIDATES) {
+                thread_local std::vector<uint32_t> candidates;
+                pf->candidates(probe, candidates);
+                if (candidates.size() <= PREFILTER_MAX_CANDIDATES) {
+                    /* candidates are in order, so the first to match wins */
+                    for (uint32_t i : candidates) {
+                        if (search_one(*re2_regex_comps[i], probe, found, offset, len)) return true;
+                    }
+                    return false;
+                }
+            }
         }
+        const RE2::Set *set = compiled_set();
+        if (set) {
+            std::vector<int> hits;
+            RE2::Set::ErrorInfo error_info;
+            if (set->Match(probe, &hits, &error_info)) {
+                /* the first regex in the vector wins, as it does when they are tried in order */
+                int first = *std::min_element(hits.begin(), hits.end());
+                return search_one(*re2_regex_comps[first], probe, found, offset, len);
+            }
+            if (error_info.kind == RE2::Set::kNoError) return false;
+            /* otherwise fall through and try them one at a time */
+        }
+    }
+    for (RE2 *re: re2_regex_comps) {
+        if (search_one(*re, probe, found, offset, len)) return true;
     }
 #endif
     return false;
@@ -12,19 +12,23 @@
 #ifndef REGEX_VECTOR_H
 #define REGEX_VECTOR_H
 
+#include <atomic>
 #include <cassert>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <set>
 #include <string>
 #include <vector>
 #include <cstdlib>
 
 #include "config.h"
+#include "literal_prefilter.h"
 
 #ifdef HAVE_RE2
 #include <re2/re2.h>            // it's always here.
+#include <re2/set.h>
 #endif
 
 /**
@@ -32,18 +36,41 @@
  * We might want to change this to handle ASCII, UTF-16 and UTF-8 characters simultaneously.
  * Only RE2 is supported because it is the only regular expression library that doesn't die on large segments.
  * See: https://swtch.com/~rsc/regexp/regexp3.html#caveats
+ *
+ * With more than one regex, search_all() first searches for all of them at once with an RE2::Set,
+ * which is compiled the first time it is needed. Only the first regex that the set reports is then run
+ * on its own, to find where it matched. If the set cannot be compiled, or runs out of memory
+ * while matching, the regexes are tried one at a time.
+ *
+ * Before that, a literal_prefilter looks for the literal that each regex requires (a domain suffix, say).
+ * If only a few regexes could match, just those are run, so a feature that matches nothing is
+ * usually rejected after a single pass over it. The prefilter is only used for ASCII probes.
  */
 
 class regex_vector {
     std::vector<std::string> regex_strings; // the original regex strings
 #ifdef HAVE_RE2
     std::vector<RE2 *> re2_regex_comps;     // the compiled regular expressions
+    mutable std::mutex Mset {};             // protects compiling re2_set
+    mutable std::atomic<RE2::Set *> re2_set {nullptr}; // all of re2_regex_comps in one automaton
+    mutable std::atomic<bool> re2_set_failed {false};  // could not be compiled
+    std::vector<std::string> required_literals;        // literal_prefilter::required_literal() of each regex
+    mutable std::atomic<literal_prefilter *> literals {nullptr}; // compiled from required_literals
+    const RE2::Set *compiled_set() const;
+    const literal_prefilter *compiled_prefilter() const;
+    void delete_compiled();
+    static bool search_one(const RE2 &re, const std::string& probe, std::string* found, size_t* offset, size_t* len);
 #endif
     regex_vector(const regex_vector&) = delete;
     regex_vector& operator=(const regex_vector&) = delete;
     static const std::string RE_ENGINE;
 
 public:
+    static inline const int64_t SET_MAX_MEM {256 * 1024 * 1024}; // for the RE2::Set's DFA
+    static inline const size_t PREFILTER_MAX_CANDIDATES {8}; // more than this, and the RE2::Set is used
+    bool multi_pattern {true};          // search with the RE2::Set; if false, always one regex at a time
+    bool prefilter {true};              // with multi_pattern, check the required literals first
+
     static bool engine_enabled(const std::string engine) {
         /** each engine is enabled if it is the first to check, or if it is specified */
         return std::getenv(RE_ENGINE.c_str()) == nullptr ||
@@ -52,6 +79,7 @@ public:
     regex_vector() : regex_strings()
 #ifdef HAVE_RE2
                    , re2_regex_comps()
+                   , required_literals()
 #endif
     {};
     ~regex_vector();
@@ -8,6 +8,7 @@
 
 #include <algorithm>
 #include <cctype>
+#include <cstdint>
 #include <cstdio>
 #include <filesystem>
 #include <algorithm>
@@ -406,6 +407,16 @@ sbuf_t* sbuf_t::map_file(const std::filesystem::path fname) {
 }
 
 
+bool sbuf_t::file_extent(int& fd_, uint64_t& offset) const
+{
+    const sbuf_t* hp = highest_parent();
+    if (hp->fd <= NO_FD || hp->malloced != nullptr) return false;
+    if (buf < hp->buf || buf + bufsize > hp->buf + hp->bufsize) return false;
+    fd_ = hp->fd;
+    offset = buf - hp->buf;
+    return true;
+}
+
 /*
  * Allocate a new sbuf with a malloc and return a writable buffer.
  * In the future we will add guard bytes. Byte 0 is at pos0.
@@ -726,41 +737,42 @@ std::string sbuf_t::getUTF8(size_t i) const
     return utf8_string;
 }
 
-/**
- * Read the requested number of UTF-16 format code units into wstring including any \U0000.
+namespace {
+/* Up to max_units whole code units starting at i, stopping before any \U0000 if stop_at_nul;
+ * the bounds are worked out once, and the \U0000 is found eight bytes at a time.
  */
-std::wstring sbuf_t::getUTF16(size_t i, size_t num_code_units_requested) const
+std::wstring utf16_units(const uint8_t* buf, size_t bufsize, size_t i, size_t max_units, bool stop_at_nul,
+                         sbuf_t::byte_order_t bo)
 {
-    // clear any residual value
     std::wstring utf16_string;
-
-    while (i+1 < bufsize && num_code_units_requested > 0) {
-        utf16_string.push_back(get16u(i));
-        i += 2;
-        num_code_units_requested -= 1;
+    if (i >= bufsize) return utf16_string;
+    const uint8_t* p = buf + i;
+    size_t n = std::min((bufsize - i) / 2, max_units);
+    if (stop_at_nul) n = utf16_find_nul(p, n);
+    utf16_string.resize(n);
+    if (bo == sbuf_t::BO_LITTLE_ENDIAN) {
+        for (size_t k = 0; k < n; k++) utf16_string[k] = p[k * 2] | (p[k * 2 + 1] << 8);
+    } else {
+        for (size_t k = 0; k < n; k++) utf16_string[k] = (p[k * 2] << 8) | p[k * 2 + 1];
     }
     return utf16_string;
 }
+}
+
+/**
+ * Read the requested number of UTF-16 format code units into wstring including any \U0000.
+ */
+std::wstring sbuf_t::getUTF16(size_t i, size_t num_code_units_requested) const
+{
+    return utf16_units(buf, bufsize, i, num_code_units_requested, false, BO_LITTLE_ENDIAN);
+}
 
 /**
  * Read UTF-16 format code units into wstring up to but not including \U0000.
  */
 std::wstring sbuf_t::getUTF16(size_t i) const
 {
-    std::wstring utf16_string;
-
-    while (i+1 < bufsize) {
-        uint16_t code_unit = get16u(i);
-        // stop before \U0000
-        if (code_unit == 0) {
-            // at \U0000
-            break;
-        }
-        // accept the code unit
-        utf16_string.push_back(code_unit);
-        i+=2;
-    }
-    return utf16_string;
+    return utf16_units(buf, bufsize, i, SIZE_MAX, true, BO_LITTLE_ENDIAN);
 }
 
 /**
@@ -769,14 +781,7 @@ std::wstring sbuf_t::getUTF16(size_t i) const
  */
 std::wstring sbuf_t::getUTF16(size_t i, size_t num_code_units_requested, byte_order_t bo) const
 {
-    // clear any residual value
-    std::wstring utf16_string;
-    while (i+1 < bufsize && num_code_units_requested > 0) {
-        utf16_string.push_back(get16u(i, bo));
-        i += 2;
-        num_code_units_requested -= 1;
-    }
-    return utf16_string;
+    return utf16_units(buf, bufsize, i, num_code_units_requested, false, bo);
 }
 
 /**
@@ -784,20 +789,7 @@ std::wstring sbuf_t::getUTF16(size_t i, size_t num_code_units_requested, byte_or
  */
 std::wstring sbuf_t::getUTF16(size_t i, byte_order_t bo) const
 {
-    std::wstring utf16_string;
-
-    while (i+1 < bufsize) {
-        uint16_t code_unit = get16u(i, bo);
-        // stop before \U0000
-        if (code_unit == 0) {
-            // at \U0000
-            break;
-        }
-        // accept the code unit
-        utf16_string.push_back(code_unit);
-        i+=2;
-    }
-    return utf16_string;
+    return utf16_units(buf, bufsize, i, SIZE_MAX, true, bo);
 }
 
 std::string sbuf_t::hash() const
@@ -559,6 +559,10 @@ public:;
         return hp;
     }
     bool has_parent() const { return parent!=nullptr; }
+    /* If the bytes of this sbuf are in a file that it or a parent has mapped (see map_file()),
+     * set fd_ to the file and offset to where they start in it, and return true.
+     */
+    bool file_extent(int& fd_, uint64_t& offset) const;
 
     // tracking allocations and frees
 
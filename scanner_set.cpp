@@ -28,6 +28,7 @@
 #endif
 
 #include "machine_stats.h"
+#include "memory_monitor.h"
 #include "utils.h"
 #include "formatter.h"
 
@@ -84,6 +85,8 @@ scanner_set::~scanner_set()
         delete benchmark_cpu_thread;
         benchmark_cpu_thread = nullptr;
     }
+    delete monitor;                     // stops it if it is still running
+    monitor = nullptr;
     /* Delete all of the scanner info blocks */
 
     const std::lock_guard<std::mutex> lock(Mscanner_info_db);
@@ -654,6 +657,13 @@ void scanner_set::phase_scan() {
         void *arg = static_cast<void *>(this);
         benchmark_cpu_thread = new std::thread( scanner_set::launch_cpu_benchmark_thread, arg);
     }
+    if (memory_budget > 0) {
+        monitor = new memory_monitor(memory_budget, writer);
+        monitor->spill    = [this](uint64_t min_bytes) { return fs.histograms_write_largest(min_bytes); };
+        monitor->evict    = [this]() { return fs.carve_cache_evict(); };
+        monitor->throttle = [this](bool t) { pool.set_throttle(t); };
+        monitor->start();
+    }
 }
 
 // https://stackoverflow.com/questions/16190078/how-to-atomically-update-a-maximum-value
@@ -1086,6 +1096,7 @@ void scanner_set::shutdown()
         throw std::runtime_error("shutdown can only be called in scanner_params::PHASE_SCAN");
     }
     current_phase = scanner_params::PHASE_SHUTDOWN;
+    if (monitor) monitor->stop();
 
     /* Tell the scanners we are shutting down */
     scanner_params sp(sc, this, nullptr, scanner_params::PHASE_SHUTDOWN, nullptr);
@@ -114,6 +114,7 @@ class scanner_set {
     class thread_pool pool;
     std::atomic<bool> threading {false};       // are we threading?
     std::thread *benchmark_cpu_thread {nullptr};
+    class memory_monitor *monitor {nullptr};   // running during PHASE_SCAN if memory_budget>0
     void *cpu_benchmark();
     static void launch_cpu_benchmark_thread(void *arg);
     class feature_recorder_set fs;      // the feature recorders
@@ -202,6 +203,7 @@ public:
     std::atomic<int>      sbufs_in_queue {0};
     std::atomic<uint64_t> bytes_in_queue {0};
     std::atomic<int>      disk_write_errors {0};
+    uint64_t memory_budget {0};         // if >0, resident bytes allowed during PHASE_SCAN; see memory_monitor
     mutable std::atomic<uint64_t> max_offset {0}; // largest offset read by any of the threads.
 
     // to get a copy of thread_status, use get_stats, which also returns information about the queue
@@ -226,6 +228,8 @@ public:
     size_t histogram_count() const        { return fs.histogram_count(); }; // passthrough, mostly for debugging
     size_t feature_recorder_count() const { return fs.feature_recorder_count(); };
     void   dump_name_count_stats() const  { if (writer) fs.dump_name_count_stats(*writer); }; // passthrough
+    void   dump_histogram_stats() const   { if (writer) fs.dump_histogram_stats(*writer); };  // passthrough
+    void   dump_sql_stats() const         { if (writer) fs.dump_sql_stats(*writer); };        // passthrough
 
     std::string get_help() const          { return sc.get_help(); }
 
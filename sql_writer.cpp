@@ -0,0 +1,277 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include "sql_writer.h"
+
+#if defined(HAVE_SQLITE3_H) && defined(HAVE_LIBSQLITE3)
+#include <sqlite3.h>
+
+#include <chrono>
+
+#include "formatter.h"
+
+namespace {
+const char* schema_db[] = {
+    "CREATE TABLE IF NOT EXISTS db_info (schema_ver INTEGER, bulk_extractor_ver INTEGER)",
+    "INSERT INTO db_info (schema_ver, bulk_extractor_ver) SELECT 1,1 WHERE NOT EXISTS (SELECT 1 FROM db_info)",
+    "CREATE TABLE IF NOT EXISTS be_features (tablename VARCHAR,comment TEXT)",
+    "CREATE TABLE IF NOT EXISTS be_config (name VARCHAR,value VARCHAR)",
+    nullptr};
+}
+
+sql_writer::sql_writer(const std::filesystem::path& fname_, const options_t& opts_) : fname(fname_), opts(opts_)
+{
+    if (sqlite3_open_v2(fname.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX,
+                        nullptr) != SQLITE_OK) {
+        std::string msg = Formatter() << "cannot open " << fname << ": " << sqlite3_errmsg(db);
+        sqlite3_close(db);
+        throw SQLError(msg);
+    }
+    sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+    try {
+        /* The pragmas are a request; a database that cannot honor them is still written */
+        if (opts.wal) sqlite3_exec(db, "PRAGMA journal_mode=WAL", nullptr, nullptr, nullptr);
+        if (opts.synchronous_off) sqlite3_exec(db, "PRAGMA synchronous=OFF", nullptr, nullptr, nullptr);
+        for (int i = 0; schema_db[i]; i++) {
+            exec(db, schema_db[i]);
+        }
+    } catch (...) {
+        sqlite3_close(db);
+        throw;
+    }
+    writer = std::thread(&sql_writer::run, this);
+}
+
+sql_writer::~sql_writer()
+{
+    {
+        const std::lock_guard<std::mutex> lock(M);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    writer.join();
+    for (auto& it : inserts) {
+        sqlite3_finalize(it.second);
+    }
+    sqlite3_close(db);
+}
+
+std::string sql_writer::quote_identifier(const std::string& name)
+{
+    std::string ret {"\""};
+    for (char ch : name) {
+        if (ch == '"') ret += '"';
+        ret += ch;
+    }
+    ret += '"';
+    return ret;
+}
+
+void sql_writer::exec(sqlite3* db_, const std::string& sql)
+{
+    char* errmsg = nullptr;
+    if (sqlite3_exec(db_, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK) {
+        std::string msg = Formatter() << "'" << sql << "': " << (errmsg ? errmsg : sqlite3_errmsg(db_));
+        sqlite3_free(errmsg);
+        throw SQLError(msg);
+    }
+}
+
+void sql_writer::with_db(std::function<void(sqlite3*)> fn)
+{
+    const std::lock_guard<std::mutex> lock(Mdb);
+    fn(db);
+}
+
+void sql_writer::with_reader(std::function<void(sqlite3*)> fn)
+{
+    sqlite3* reader = nullptr;
+    if (sqlite3_open_v2(fname.c_str(), &reader, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK) {
+        std::string msg = Formatter() << "cannot open " << fname << ": " << sqlite3_errmsg(reader);
+        sqlite3_close(reader);
+        throw SQLError(msg);
+    }
+    sqlite3_busy_timeout(reader, BUSY_TIMEOUT_MS);
+    try {
+        fn(reader);
+    } catch (...) {
+        sqlite3_close(reader);
+        throw;
+    }
+    sqlite3_close(reader);
+}
+
+void sql_writer::create_feature_table(const std::string& recorder_name)
+{
+    const std::string table = feature_table(recorder_name);
+    const std::string index = FEATURE_TABLE_PREFIX + recorder_name + "_idx";
+    const std::string indexes[] = {
+        "CREATE INDEX IF NOT EXISTS " + quote_identifier(index + "1") + " ON " + table + "(offset)",
+        "CREATE INDEX IF NOT EXISTS " + quote_identifier(index + "2") + " ON " + table + "(feature_eutf8)",
+        "CREATE INDEX IF NOT EXISTS " + quote_identifier(index + "3") + " ON " + table + "(feature_utf8)"};
+    with_db([&](sqlite3* db_) {
+        exec(db_, "CREATE TABLE IF NOT EXISTS " + table +
+                      " (offset INTEGER(12), path VARCHAR, feature_eutf8 TEXT, feature_utf8 TEXT, context_eutf8 TEXT)");
+        for (const auto& sql : indexes) {
+            if (opts.defer_indexes) {
+                deferred_indexes.push_back(sql);
+            } else {
+                exec(db_, sql);
+            }
+        }
+        sqlite3_stmt* stmt = nullptr;
+        sqlite3_prepare_v2(db_,
+                           "INSERT INTO be_features (tablename,comment) SELECT ?1,'' "
+                           "WHERE NOT EXISTS (SELECT 1 FROM be_features WHERE tablename=?1)",
+                           -1, &stmt, nullptr);
+        const std::string tablename = FEATURE_TABLE_PREFIX + recorder_name;
+        sqlite3_bind_text(stmt, 1, tablename.data(), tablename.size(), SQLITE_STATIC);
+        const int rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) throw SQLError(Formatter() << "cannot add " << tablename << ": " << sqlite3_errmsg(db_));
+    });
+}
+
+void sql_writer::create_indexes()
+{
+    flush();
+    with_db([&](sqlite3* db_) {
+        if (deferred_indexes.empty()) return;
+        const auto t0 = std::chrono::steady_clock::now();
+        exec(db_, "BEGIN TRANSACTION");
+        try {
+            for (const auto& sql : deferred_indexes) {
+                exec(db_, sql);
+            }
+            exec(db_, "COMMIT TRANSACTION");
+        } catch (...) {
+            sqlite3_exec(db_, "ROLLBACK TRANSACTION", nullptr, nullptr, nullptr);
+            throw;
+        }
+        deferred_indexes.clear();
+        index_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+    });
+}
+
+void sql_writer::rethrow_error()
+{
+    if (error) {
+        std::exception_ptr e = error;
+        error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+void sql_writer::submit(const std::string& recorder_name, std::vector<row_t>&& rows)
+{
+    if (rows.empty()) return;
+    std::unique_lock<std::mutex> lock(M);
+    rethrow_error();
+    if (batches.size() >= opts.max_queued_batches) {
+        waits++;
+        room.wait(lock, [&] { return batches.size() < opts.max_queued_batches; });
+    }
+    batches.push_back(batch_t{feature_table(recorder_name), std::move(rows)});
+    lock.unlock();
+    work_ready.notify_one();
+}
+
+void sql_writer::flush()
+{
+    std::unique_lock<std::mutex> lock(M);
+    room.wait(lock, [&] { return batches.empty() && writing == 0; });
+    rethrow_error();
+}
+
+double sql_writer::inserts_per_second() const
+{
+    const uint64_t ns = insert_ns;
+    return ns == 0 ? 0.0 : rows_inserted * 1.0e9 / ns;
+}
+
+/* Batches that are queued when the writer stops are still written */
+void sql_writer::run()
+{
+    for (;;) {
+        batch_t batch;
+        {
+            std::unique_lock<std::mutex> lock(M);
+            work_ready.wait(lock, [&] { return stopping || !batches.empty(); });
+            if (batches.empty()) return;
+            batch = std::move(batches.front());
+            batches.pop_front();
+            writing++;
+        }
+        room.notify_all();
+        try {
+            write_batch(batch);
+        } catch (...) {
+            const std::lock_guard<std::mutex> lock(M);
+            if (!error) error = std::current_exception();
+        }
+        {
+            const std::lock_guard<std::mutex> lock(M);
+            writing--;
+        }
+        room.notify_all();
+    }
+}
+
+sqlite3_stmt* sql_writer::insert_statement(const std::string& table)
+{
+    auto it = inserts.find(table);
+    if (it != inserts.end()) return it->second;
+
+    const std::string sql = "INSERT INTO " + table +
+                            " (offset,path,feature_eutf8,feature_utf8,context_eutf8) VALUES (?1,?2,?3,?4,?5)";
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        throw SQLError(Formatter() << "cannot prepare '" << sql << "': " << sqlite3_errmsg(db));
+    }
+    inserts[table] = stmt;
+    return stmt;
+}
+
+void sql_writer::write_batch(batch_t& batch)
+{
+    const std::lock_guard<std::mutex> lock(Mdb);
+    const auto t0 = std::chrono::steady_clock::now();
+    sqlite3_stmt* stmt = insert_statement(batch.table);
+    exec(db, "BEGIN TRANSACTION");
+    try {
+        for (const auto& row : batch.rows) {
+            sqlite3_bind_int64(stmt, 1, row.offset);
+            sqlite3_bind_text(stmt, 2, row.path.data(), row.path.size(), SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, row.feature_eutf8.data(), row.feature_eutf8.size(), SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 4, row.feature_utf8.data(), row.feature_utf8.size(), SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 5, row.context_eutf8.data(), row.context_eutf8.size(), SQLITE_STATIC);
+            const int rc = sqlite3_step(stmt);
+            sqlite3_reset(stmt);
+            if (rc != SQLITE_DONE) {
+                throw SQLError(Formatter() << "cannot insert into " << batch.table << ": " << sqlite3_errmsg(db));
+            }
+        }
+        exec(db, "COMMIT TRANSACTION");
+    } catch (...) {
+        sqlite3_exec(db, "ROLLBACK TRANSACTION", nullptr, nullptr, nullptr);
+        throw;
+    }
+    rows_inserted += batch.rows.size();
+    transactions++;
+    insert_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+}
+
+#else
+
+/* Without SQLite3 a writer cannot be made; feature_recorder_set only needs to be able to destroy one */
+sql_writer::sql_writer(const std::filesystem::path& fname_, const options_t& opts_) : fname(fname_), opts(opts_)
+{
+    throw SQLError("compiled without SQLite3");
+}
+
+sql_writer::~sql_writer()
+{
+}
+
+#endif
@@ -0,0 +1,121 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef SQL_WRITER_H
+#define SQL_WRITER_H
+
+#include <atomic>
+#include <cinttypes>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+/**
+ * sql_writer:
+ * Writes feature rows into an SQLite3 database on a single writer thread.
+ *
+ * SQLite3 allows one writer at a time, and each statement outside of a transaction is a transaction of
+ * its own, with its own journal write. So the feature_recorder_sql objects collect rows in per-thread
+ * buffers and submit() them in batches of options_t::batch_rows; the writer thread inserts each batch
+ * in one explicit transaction, with a prepared INSERT statement that is cached for each table.
+ * submit() waits while max_queued_batches batches are waiting to be written.
+ *
+ * The database is opened in WAL mode with synchronous=OFF unless the options say otherwise.
+ * With defer_indexes, the feature tables are created without their indexes, which create_indexes() builds
+ * once the rows are in; building an index in bulk is much cheaper than keeping it up to date row by row.
+ * A database error is kept and rethrown, as an SQLError, by the next submit() or flush().
+ * with_db() runs other SQL (creating tables, making histograms) between batches. with_reader() runs
+ * queries on a connection of their own, so several threads can read the database at once.
+ */
+class sql_writer {
+    sql_writer(const sql_writer&) = delete;
+    sql_writer& operator=(const sql_writer&) = delete;
+
+public:
+    static inline const size_t DEFAULT_BATCH_ROWS {10000};
+    static inline const size_t DEFAULT_MAX_QUEUED_BATCHES {8};
+    static inline const std::string FEATURE_TABLE_PREFIX {"f_"};
+    static inline const int BUSY_TIMEOUT_MS {60000}; // how long a connection waits for another's lock
+
+    struct options_t {
+        bool wal {true};                // PRAGMA journal_mode=WAL
+        bool synchronous_off {true};    // PRAGMA synchronous=OFF
+        size_t batch_rows {DEFAULT_BATCH_ROWS};
+        size_t max_queued_batches {DEFAULT_MAX_QUEUED_BATCHES};
+        bool defer_indexes {true};      // feature table indexes are built by create_indexes()
+    };
+    struct row_t {
+        int64_t offset {0};
+        std::string path {};
+        std::string feature_eutf8 {};   // the feature as written to a feature file
+        std::string feature_utf8 {};    // unquoted, and converted from UTF-16 if it was UTF-16
+        std::string context_eutf8 {};
+    };
+
+    class SQLError : public std::exception {
+    public:
+        std::string msg {};
+        SQLError(const std::string& m) : msg(std::string("SQLite3 error: ") + m) {}
+        const char* what() const noexcept override { return msg.c_str(); };
+    };
+
+    sql_writer(const std::filesystem::path& fname_, const options_t& opts_);
+    ~sql_writer();                      // writes everything submitted, then closes the database
+
+    const std::filesystem::path fname;
+    const options_t opts;
+
+    static std::string quote_identifier(const std::string& name); // "name", with embedded quotes doubled
+    static std::string feature_table(const std::string& recorder_name) {
+        return quote_identifier(FEATURE_TABLE_PREFIX + recorder_name);
+    }
+
+    void create_feature_table(const std::string& recorder_name);
+    void create_indexes();              // builds the deferred indexes; called at shutdown
+    void submit(const std::string& recorder_name, std::vector<row_t>&& rows);
+    void flush();                       // waits until everything submitted has been written
+    void with_db(std::function<void(sqlite3*)> fn); // runs fn on the database between batches
+    void with_reader(std::function<void(sqlite3*)> fn); // runs fn on a new read-only connection
+    void exec(sqlite3* db, const std::string& sql); // throws SQLError
+
+    std::atomic<uint64_t> rows_inserted {0};
+    std::atomic<uint64_t> transactions {0};
+    std::atomic<uint64_t> insert_ns {0}; // time spent in the insert transactions
+    std::atomic<uint64_t> waits {0};     // times that submit() waited for room
+    std::atomic<uint64_t> index_ns {0};  // time spent in create_indexes()
+    double inserts_per_second() const;
+
+private:
+    struct batch_t {
+        std::string table {};
+        std::vector<row_t> rows {};
+    };
+    sqlite3* db {nullptr};
+    std::mutex Mdb {};                  // held while db is in use
+    std::map<std::string, sqlite3_stmt*> inserts {}; // table -> prepared INSERT statement; protected by Mdb
+    std::vector<std::string> deferred_indexes {};    // CREATE INDEX statements; protected by Mdb
+
+    std::mutex M {};                    // protects everything below
+    std::condition_variable work_ready {};
+    std::condition_variable room {};
+    std::deque<batch_t> batches {};
+    size_t writing {0};
+    bool stopping {false};
+    std::exception_ptr error {};
+    std::thread writer {};
+
+    void run();
+    void write_batch(batch_t& batch);
+    sqlite3_stmt* insert_statement(const std::string& table); // with Mdb held
+    void rethrow_error();               // with M held
+};
+
+#endif
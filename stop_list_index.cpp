@@ -0,0 +1,366 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+#include "formatter.h"
+#include "sbuf.h"
+#include "stop_list_index.h"
+
+namespace {
+inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+const uint32_t MAX_SEED = 1 << 16;      // tries per bucket before the table is made larger
+
+/* Give each bucket, largest first, a seed that puts all of its keys in free slots */
+bool place(const std::vector<std::vector<uint32_t>>& buckets, const std::vector<uint64_t>& hashes,
+           size_t nslots, std::vector<uint32_t>& seeds, std::vector<int64_t>& slot_key,
+           size_t (*slot_of)(uint64_t, uint32_t, size_t))
+{
+    std::vector<size_t> order(buckets.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(),
+                     [&buckets](size_t a, size_t b) { return buckets[a].size() > buckets[b].size(); });
+    seeds.assign(buckets.size(), 0);
+    slot_key.assign(nslots, -1);
+    std::vector<size_t> tried;
+    for (size_t b : order) {
+        if (buckets[b].empty()) break;
+        bool placed = false;
+        for (uint32_t seed = 0; seed < MAX_SEED && !placed; seed++) {
+            tried.clear();
+            placed = true;
+            for (uint32_t k : buckets[b]) {
+                size_t s = slot_of(hashes[k], seed, nslots);
+                if (slot_key[s] >= 0 || std::find(tried.begin(), tried.end(), s) != tried.end()) {
+                    placed = false;
+                    break;
+                }
+                tried.push_back(s);
+            }
+            if (placed) {
+                for (size_t i = 0; i < tried.size(); i++) slot_key[tried[i]] = buckets[b][i];
+                seeds[b] = seed;
+            }
+        }
+        if (!placed) return false;
+    }
+    return true;
+}
+
+inline size_t align64(size_t n) { return (n + 63) & ~size_t(63); }
+}
+
+stop_list_index::stop_list_index()
+{
+}
+
+stop_list_index::~stop_list_index()
+{
+}
+
+/* Eight bytes at a time; stable across runs, but not across byte orders */
+uint64_t stop_list_index::hash(std::string_view s)
+{
+    const char* p = s.data();
+    size_t n = s.size();
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ n;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        h = mix64(h ^ w);
+    }
+    uint64_t w = 0;
+    memcpy(&w, p, n);
+    return mix64(h ^ w ^ (static_cast<uint64_t>(n) << 56));
+}
+
+/* The original sliding window never looked at the last position, so neither does this */
+size_t stop_list_index::locate(std::string_view feature, std::string_view ctx)
+{
+    if (feature.size() > ctx.size()) return std::string_view::npos;
+    size_t pos = ctx.find(feature);
+    if (pos != std::string_view::npos && pos < ctx.size() - feature.size()) return pos;
+    return std::string_view::npos;
+}
+
+size_t stop_list_index::slot_of(uint64_t h, uint32_t seed, size_t nslots)
+{
+    return mix64(h ^ (seed * 0x9e3779b97f4a7c15ULL)) % nslots;
+}
+
+void stop_list_index::clear()
+{
+    arena_v.clear();
+    seeds_v.clear();
+    slots_v.clear();
+    entries_v.clear();
+    mapped.reset();
+    arena = std::string_view();
+    seeds = nullptr;
+    slots = nullptr;
+    entries = nullptr;
+    n_seeds = n_slots = n_entries = n_features = 0;
+    bloom.clear();
+}
+
+size_t stop_list_index::bytes() const
+{
+    return arena.size() + n_seeds * sizeof(uint32_t) + n_slots * sizeof(slot_t)
+        + n_entries * sizeof(entry_t) + bloom.bytes();
+}
+
+void stop_list_index::build(const std::vector<input_t>& inputs)
+{
+    clear();
+
+    /* Group the contexts by feature, keeping the features in the order they were first seen */
+    std::unordered_map<std::string_view, uint32_t> key_of;
+    std::vector<std::string_view> keys;
+    std::vector<std::vector<size_t>> contexts;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        auto it = key_of.try_emplace(inputs[i].feature, keys.size()).first;
+        if (it->second == keys.size()) {
+            keys.push_back(inputs[i].feature);
+            contexts.emplace_back();
+        }
+        contexts[it->second].push_back(i);
+    }
+    n_features = keys.size();
+    if (n_features == 0) return;
+    bloom.init(n_features);
+
+    std::vector<uint64_t> hashes(n_features);
+    for (size_t k = 0; k < n_features; k++) {
+        hashes[k] = hash(keys[k]);
+        bloom.add(hashes[k]);
+    }
+
+    const size_t nbuckets = n_features / 2 + 1;
+    std::vector<std::vector<uint32_t>> buckets(nbuckets);
+    for (size_t k = 0; k < n_features; k++) buckets[hashes[k] % nbuckets].push_back(k);
+
+    /* Start a little larger than minimal, so that the last buckets find free slots quickly */
+    size_t nslots = n_features + n_features / 8 + 1;
+    std::vector<int64_t> slot_key;
+    for (int attempt = 0; !place(buckets, hashes, nslots, seeds_v, slot_key, slot_of); attempt++) {
+        if (attempt == 8) throw IndexError("cannot build a perfect hash");
+        nslots = nslots * 3 / 2;
+    }
+
+    auto append = [this](std::string_view s) {
+        if (arena_v.size() + s.size() > UINT32_MAX) throw IndexError("stop list too large");
+        uint32_t off = arena_v.size();
+        arena_v.append(s);
+        return off;
+    };
+    slots_v.assign(nslots, slot_t());
+    for (size_t s = 0; s < nslots; s++) {
+        if (slot_key[s] < 0) continue;
+        const size_t k = slot_key[s];
+        slot_t& slot = slots_v[s];
+        slot.feature_off = append(keys[k]);
+        slot.feature_len = keys[k].size();
+        slot.first_entry = entries_v.size();
+        slot.n_entries = contexts[k].size();
+        for (size_t i : contexts[k]) {
+            entry_t e;
+            e.before_off = append(inputs[i].before);
+            e.before_len = inputs[i].before.size();
+            e.after_off = append(inputs[i].after);
+            e.after_len = inputs[i].after.size();
+            entries_v.push_back(e);
+        }
+    }
+
+    arena = arena_v;
+    seeds = seeds_v.data();
+    n_seeds = seeds_v.size();
+    slots = slots_v.data();
+    n_slots = slots_v.size();
+    entries = entries_v.data();
+    n_entries = entries_v.size();
+}
+
+bool stop_list_index::is_index_file(const std::filesystem::path& fname)
+{
+    std::ifstream in(fname, std::ios_base::in | std::ios_base::binary);
+    char magic[sizeof(MAGIC)];
+    in.read(magic, sizeof(magic));
+    return in.gcount() == sizeof(magic) && memcmp(magic, MAGIC, sizeof(magic)) == 0;
+}
+
+void stop_list_index::write(const std::filesystem::path& fname, const std::string& patterns_text) const
+{
+    file_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.common = binary_file_header_t::make(MAGIC, VERSION);
+    hdr.n_features = n_features;
+    hdr.n_seeds = n_seeds;
+    hdr.n_slots = n_slots;
+    hdr.n_entries = n_entries;
+    hdr.n_blocks = bloom.blocks();
+    hdr.arena_bytes = arena.size();
+    hdr.patterns_bytes = patterns_text.size();
+
+    std::ofstream out(fname, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    if (!out.is_open()) {
+        throw IndexError(Formatter() << "cannot create " << fname << ": " << strerror(errno));
+    }
+    auto section = [&out](const void* p, size_t len) {
+        static const char zeros[64] {};
+        out.write(static_cast<const char*>(p), len);
+        out.write(zeros, align64(len) - len);
+    };
+    section(&hdr, sizeof(hdr));
+    section(bloom.data(), bloom.bytes());
+    section(seeds, n_seeds * sizeof(uint32_t));
+    section(slots, n_slots * sizeof(slot_t));
+    section(entries, n_entries * sizeof(entry_t));
+    section(arena.data(), arena.size());
+    section(patterns_text.data(), patterns_text.size());
+    out.close();
+    if (out.fail()) {
+        throw IndexError(Formatter() << "cannot write " << fname);
+    }
+}
+
+/* Nothing is copied: the checks use the mapped file in place */
+std::string_view stop_list_index::read(const std::filesystem::path& fname)
+{
+    clear();
+    if (std::filesystem::file_size(fname) < sizeof(file_header_t)) {
+        throw IndexError(Formatter() << fname << " is too short");
+    }
+    mapped.reset(sbuf_t::map_file(fname));
+    const char* base = reinterpret_cast<const char*>(mapped->get_buf());
+    const size_t len = mapped->bufsize;
+    try {
+        check_binary_file_header<IndexError>(base, len, MAGIC, VERSION, fname, "stop list index");
+    } catch (const IndexError&) {
+        clear();
+        throw;
+    }
+    file_header_t hdr;
+    memcpy(&hdr, base, sizeof(hdr));
+
+    /* Check that every section is within the file before using any of them */
+    size_t pos = align64(sizeof(hdr));
+    auto section = [&](uint64_t n, size_t size) -> const char* {
+        if (n > len / (size ? size : 1) || pos + n * size > len) {
+            clear();
+            throw IndexError(Formatter() << fname << " is truncated");
+        }
+        const char* p = base + pos;
+        pos += align64(n * size);
+        return p;
+    };
+    const char* blocks_p   = section(hdr.n_blocks, blocked_bloom_filter::BLOCK_WORDS * sizeof(uint64_t));
+    const char* seeds_p    = section(hdr.n_seeds, sizeof(uint32_t));
+    const char* slots_p    = section(hdr.n_slots, sizeof(slot_t));
+    const char* entries_p  = section(hdr.n_entries, sizeof(entry_t));
+    const char* arena_p    = section(hdr.arena_bytes, 1);
+    const char* patterns_p = section(hdr.patterns_bytes, 1);
+    const bool empty = hdr.n_slots == 0;
+    if (empty != (hdr.n_seeds == 0) || (empty && hdr.n_blocks > 0) ||
+        reinterpret_cast<uintptr_t>(base) % alignof(uint64_t) != 0) {
+        clear();
+        throw IndexError(Formatter() << fname << " cannot be used");
+    }
+
+    /* Check every offset into the entries and the arena, so that the checks need not */
+    auto in_arena = [&](uint32_t off, uint32_t len) { return off <= hdr.arena_bytes && len <= hdr.arena_bytes - off; };
+    const slot_t* slots_in = reinterpret_cast<const slot_t*>(slots_p);
+    for (uint64_t s = 0; s < hdr.n_slots; s++) {
+        const slot_t& slot = slots_in[s];
+        if (slot.n_entries == 0) continue;
+        if (!in_arena(slot.feature_off, slot.feature_len) || slot.first_entry > hdr.n_entries ||
+            slot.n_entries > hdr.n_entries - slot.first_entry) {
+            clear();
+            throw IndexError(Formatter() << fname << ": bad slot " << s);
+        }
+    }
+    const entry_t* entries_in = reinterpret_cast<const entry_t*>(entries_p);
+    for (uint64_t i = 0; i < hdr.n_entries; i++) {
+        const entry_t& e = entries_in[i];
+        if (!in_arena(e.before_off, e.before_len) || !in_arena(e.after_off, e.after_len)) {
+            clear();
+            throw IndexError(Formatter() << fname << ": bad entry " << i);
+        }
+    }
+
+    bloom.attach(blocks_p, hdr.n_blocks);
+    seeds = reinterpret_cast<const uint32_t*>(seeds_p);
+    n_seeds = hdr.n_seeds;
+    slots = reinterpret_cast<const slot_t*>(slots_p);
+    n_slots = hdr.n_slots;
+    entries = reinterpret_cast<const entry_t*>(entries_p);
+    n_entries = hdr.n_entries;
+    arena = std::string_view(arena_p, hdr.arena_bytes);
+    n_features = hdr.n_features;
+    return std::string_view(patterns_p, hdr.patterns_bytes);
+}
+
+void stop_list_index::dump(std::ostream& os) const
+{
+    for (size_t s = 0; s < n_slots; s++) {
+        const slot_t& slot = slots[s];
+        for (uint32_t i = slot.first_entry; i < slot.first_entry + slot.n_entries; i++) {
+            os << view(slot.feature_off, slot.feature_len) << " = context["
+               << view(entries[i].before_off, entries[i].before_len) << "|"
+               << view(slot.feature_off, slot.feature_len) << "|"
+               << view(entries[i].after_off, entries[i].after_len) << "]\n";
+        }
+    }
+}
+
+const stop_list_index::slot_t* stop_list_index::find(std::string_view probe, uint64_t h) const
+{
+    if (!bloom.maybe_contains(h)) return nullptr;
+    const slot_t& slot = slots[slot_of(h, seeds[h % n_seeds], n_slots)];
+    if (slot.n_entries == 0 || view(slot.feature_off, slot.feature_len) != probe) return nullptr;
+    return &slot;
+}
+
+bool stop_list_index::matches(const slot_t& slot, std::string_view before, std::string_view after) const
+{
+    for (uint32_t i = slot.first_entry; i < slot.first_entry + slot.n_entries; i++) {
+        const entry_t& e = entries[i];
+        if (rsuffix_equal(view(e.before_off, e.before_len), before) &&
+            rsuffix_equal(view(e.after_off, e.after_len), after)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool stop_list_index::check(std::string_view probe, std::string_view before, std::string_view after, uint64_t h) const
+{
+    const slot_t* slot = find(probe, h);
+    return slot && matches(*slot, before, after);
+}
+
+/* The feature is only located in the context once it is known to be on the list */
+bool stop_list_index::check_feature_context(std::string_view probe, std::string_view ctx, uint64_t h) const
+{
+    const slot_t* slot = find(probe, h);
+    if (slot == nullptr) return false;
+    std::string_view before, after;
+    size_t pos = locate(probe, ctx);
+    if (pos != std::string_view::npos) {
+        before = ctx.substr(0, pos);
+        after = ctx.substr(pos + probe.size());
+    }
+    return matches(*slot, before, after);
+}
@@ -0,0 +1,141 @@
+/* -*- mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef STOP_LIST_INDEX_H
+#define STOP_LIST_INDEX_H
+
+#include <cinttypes>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "binary_file_header.h"
+#include "bloom_filter.h"
+
+/**
+ * stop_list_index:
+ * The read-only, compiled form of a word_and_context_list's features and contexts.
+ *
+ * Every distinct feature gets its own slot in a perfect hash table (hash and displace): the feature's hash
+ * picks a bucket, and the bucket's seed picks the slot, so a lookup hashes the probe once and compares it
+ * with one stored feature. The slot points to the feature's (before, after) contexts. All of the strings
+ * are kept in one arena, and checks work on string_views, so nothing is allocated per check.
+ * A blocked Bloom filter of the features in front of the table rejects most probes with one cache miss.
+ *
+ * The checks have the same results as word_and_context_list's uncompiled checks:
+ * the feature is located in the context with the same sliding window, and before and after
+ * are compared right-aligned, like rstrcmp().
+ *
+ * write() saves the index in a file that read() maps rather than parses, so that processes that
+ * use the same stop list share it through the page cache and start up without building it.
+ * File layout (native byte order, which read() checks), each section starting on a 64-byte boundary:
+ *   file_header_t, Bloom filter blocks, bucket seeds, slots, entries, string arena,
+ *   and the regular expressions of the list, one per line.
+ * read() checks the header, that every section is within the file, and that every offset in the slots
+ * and entries is within its section, once, so that the checks can use them as they are.
+ */
+class stop_list_index {
+public:
+    struct entry_t {                    // one context of a feature; offsets into the arena
+        uint32_t before_off {0};
+        uint32_t before_len {0};
+        uint32_t after_off {0};
+        uint32_t after_len {0};
+    };
+    struct slot_t {
+        uint32_t feature_off {0};
+        uint32_t feature_len {0};
+        uint32_t first_entry {0};
+        uint32_t n_entries {0};         // 0 if the slot is empty
+    };
+    struct input_t {                    // what build() is given
+        std::string_view feature;
+        std::string_view before;
+        std::string_view after;
+    };
+    struct file_header_t {
+        binary_file_header_t common;
+        uint64_t n_features;
+        uint64_t n_seeds;
+        uint64_t n_slots;
+        uint64_t n_entries;
+        uint64_t n_blocks;
+        uint64_t arena_bytes;
+        uint64_t patterns_bytes;
+        uint64_t reserved[7];
+    };
+
+    class IndexError : public binary_file_error {
+    public:
+        IndexError(const std::string &m) : binary_file_error("Stop list index error", m) {}
+    };
+
+    static inline const char MAGIC[8] {'B', 'E', '2', '0', 'S', 'T', 'O', 'P'};
+    static inline const uint32_t VERSION {1};
+
+    stop_list_index();
+    ~stop_list_index();
+    stop_list_index(const stop_list_index&) = delete;
+    stop_list_index& operator=(const stop_list_index&) = delete;
+
+    static uint64_t hash(std::string_view s);
+    /* Where the original sliding window finds feature in ctx; npos if it doesn't */
+    static size_t locate(std::string_view feature, std::string_view ctx);
+    /* True if the shorter of a and b is a suffix of the longer one, which is rstrcmp(a, b)==0 */
+    static bool rsuffix_equal(std::string_view a, std::string_view b) {
+        size_t len = a.size() < b.size() ? a.size() : b.size();
+        return a.substr(a.size() - len) == b.substr(b.size() - len);
+    }
+    static bool is_index_file(const std::filesystem::path& fname); // starts with MAGIC
+
+    void build(const std::vector<input_t>& inputs);
+    void clear();
+    /* Save the index and the list's regular expressions (one per line) in fname */
+    void write(const std::filesystem::path& fname, const std::string& patterns_text) const;
+    /* Map an index written by write(); returns the regular expressions */
+    std::string_view read(const std::filesystem::path& fname);
+    bool is_mapped() const { return mapped != nullptr; }
+
+    size_t features() const { return n_features; }
+    size_t size() const { return n_entries; }                // the number of (feature, context) entries
+    size_t bytes() const;
+    double bloom_false_positive_rate() const { return bloom.false_positive_rate(); }
+    void dump(std::ostream& os) const;
+
+    /* h, if given, is hash(probe) */
+    bool check(std::string_view probe, std::string_view before, std::string_view after) const {
+        return check(probe, before, after, hash(probe));
+    }
+    bool check(std::string_view probe, std::string_view before, std::string_view after, uint64_t h) const;
+    bool check_feature_context(std::string_view probe, std::string_view ctx) const {
+        return check_feature_context(probe, ctx, hash(probe));
+    }
+    bool check_feature_context(std::string_view probe, std::string_view ctx, uint64_t h) const;
+
+private:
+    /* filled by build() */
+    std::string arena_v {};
+    std::vector<uint32_t> seeds_v {};
+    std::vector<slot_t> slots_v {};
+    std::vector<entry_t> entries_v {};
+    std::unique_ptr<class sbuf_t> mapped; // or by read()
+
+    /* what the checks use: either of the above */
+    std::string_view arena {};
+    const uint32_t* seeds {nullptr};    // per bucket
+    size_t n_seeds {0};
+    const slot_t* slots {nullptr};
+    size_t n_slots {0};
+    const entry_t* entries {nullptr};
+    size_t n_entries {0};
+    size_t n_features {0};
+    blocked_bloom_filter bloom {};
+
+    static size_t slot_of(uint64_t h, uint32_t seed, size_t nslots);
+    const slot_t* find(std::string_view probe, uint64_t h) const;
+    bool matches(const slot_t& slot, std::string_view before, std::string_view after) const;
+    std::string_view view(uint32_t off, uint32_t len) const { return arena.substr(off, len); }
+};
+
+#endif
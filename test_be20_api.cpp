@@ -27,6 +27,7 @@
 #include <fcntl.h>
 #include <filesystem>
 #include <functional>
+#include <future>
 #include <iostream>
 #include <random>
 #include <string>
@@ -224,6 +225,39 @@ TEST_CASE("histogram_def-8", "[histogram_def]") {
     REQUIRE(s1 == "abcde");
 };
 
+TEST_CASE("histogram_matcher", "[histogram_def]") {
+    /* The compiled matcher must agree with histogram_def::match() */
+    histogram_def::flags_t require_context;
+    require_context.require_feature = false;
+    require_context.require_context = true;
+    std::vector<histogram_def> defs {
+        histogram_def("whole", "f", "", "", "s", histogram_def::flags_t()),
+        histogram_def("lower", "f", "", "", "s", histogram_def::flags_t(true, false)),
+        histogram_def("numeric", "f", "", "", "s", histogram_def::flags_t(false, true)),
+        histogram_def("domain", "f", "@(.*)", "", "s", histogram_def::flags_t(true, false)),
+        histogram_def("require", "f", "", "Bob", "s", histogram_def::flags_t()),
+        histogram_def("context", "f", "", "ctx", "s", require_context),
+    };
+    std::vector<std::string> features { "Bob@Example.COM", "(555) 123-4567", "Ünïcödé@Dömain.de", "", "no digits",
+                                        "A longer feature that is more than eight bytes" };
+    REQUIRE(histogram_matcher::is_ascii(features[0]) == true);
+    REQUIRE(histogram_matcher::is_ascii(features[2]) == false);
+    REQUIRE(histogram_matcher::is_ascii("12345678\xc3\xa9") == false);
+    for (const auto& def : defs) {
+        histogram_matcher m(def);
+        for (const auto& f : features) {
+            for (const std::string context : {"", "a ctx"}) {
+                std::string s1 {"unset"}, s2 {"unset"};
+                bool r1 = def.match(f, &s1, context);
+                bool r2 = m.match(f, &s2, context);
+                INFO("def=" << def.name << " feature=" << f);
+                REQUIRE(r1 == r2);
+                if (r1) REQUIRE(s1 == s2);
+            }
+        }
+    }
+}
+
 /****************************************************************
  * atomic_unicode_histogram.h
  */
@@ -338,6 +372,202 @@ TEST_CASE("AtomicUnicodeHistogram_3", "[histogram]") {
     }
 }
 
+TEST_CASE("AtomicUnicodeHistogram_threads", "[histogram]") {
+    /* Many threads adding to the striped histogram must produce exact counts, sorted as before */
+    histogram_def d1("name", "feature_file", "", "", "suffix1", histogram_def::flags_t());
+    AtomicUnicodeHistogram h(d1);
+    const int THREADS = 8;
+    const int N = 20000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; t++) {
+        threads.emplace_back([&h, t]() {
+            for (int i = 0; i < N; i++) {
+                h.add0("key" + std::to_string(i % 5000), "", (i + t) % 7 == 0);
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    REQUIRE(h.size() == 5000);
+
+    std::map<std::string, int> counts;
+    for (int i = 0; i < N; i++) counts["key" + std::to_string(i % 5000)] += THREADS;
+
+    auto r = h.makeReport(0);
+    REQUIRE(r.size() == 5000);
+    size_t errors = 0;
+    for (size_t i = 0; i < r.size(); i++) {
+        if (r[i].value->count != uint32_t(counts[r[i].key])) errors++;
+        if (i > 0 && !AtomicUnicodeHistogram::histogram_compare(r[i - 1], r[i])) errors++;
+    }
+    REQUIRE(errors == 0);
+    auto top = h.makeReport(10);
+    REQUIRE(top.size() == 10);
+    for (size_t i = 0; i < top.size(); i++) REQUIRE(top[i].key == r[i].key);
+    REQUIRE(h.bytes() > 5000 * 4);
+    h.clear();
+    REQUIRE(h.empty());
+}
+
+TEST_CASE("AtomicUnicodeHistogram_thread_local", "[histogram]") {
+    /* Thread-local tables must give the same report as the shared histogram */
+    histogram_def d1("name", "feature_file", "", "", "suffix1", histogram_def::flags_t());
+    AtomicUnicodeHistogram shared(d1);
+    AtomicUnicodeHistogram local(d1);
+    local.thread_local_threshold = 300;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&shared, &local, t]() {
+            for (int i = 0; i < 10000; i++) {
+                std::string key = "key" + std::to_string((i * (t + 1)) % 1000);
+                shared.add0(key, "", i % 5 == 0);
+                local.add0(key, "", i % 5 == 0);
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+
+    auto stats = local.get_thread_local_stats();
+    REQUIRE(stats.tables == 4);
+    REQUIRE(stats.merges > 0);
+    REQUIRE(local.bytes() > stats.bytes);
+
+    std::stringstream s1, s2;
+    s1 << shared.makeReport(0);
+    s2 << local.makeReport(0);   // merges the outstanding tables
+    REQUIRE(s1.str() == s2.str());
+    REQUIRE(local.get_thread_local_stats().bytes < stats.bytes);
+    REQUIRE(local.size() == 1000);
+
+    /* Histograms that come and go on one thread each get a table of their own */
+    for (int i = 0; i < 100; i++) {
+        AtomicUnicodeHistogram h(d1);
+        h.thread_local_threshold = 300;
+        h.add0("key" + std::to_string(i), "", false);
+        REQUIRE(h.get_thread_local_stats().tables == 1);
+        REQUIRE(h.get_thread_local_stats().bytes > 0);
+    }
+}
+
+TEST_CASE("AtomicUnicodeHistogram_approximate", "[histogram]") {
+    /* A skewed distribution: key k occurs 1+1000/(k+1) times, so there is a long tail of keys that occur once.
+     * The keys are added round-robin so the heavy hitters have to displace the tail.
+     */
+    histogram_def d1("name", "feature_file", "", "", "suffix1", histogram_def::flags_t());
+    histogram_def d2(d1);
+    d2.approximate_top_n = 10;
+    REQUIRE(d1 != d2);
+    AtomicUnicodeHistogram exact(d1);
+    AtomicUnicodeHistogram approx(d2);
+
+    const int keys = 10000;
+    auto occurs = [](int k) { return 1 + 1000 / (k + 1); };
+    uint64_t total = 0;
+    for (int round = 0; round < occurs(0); round++) {
+        for (int k = 0; k < keys && occurs(k) > round; k++) {
+            std::string key = "key" + std::to_string(k);
+            exact.add0(key, "", false);
+            approx.add0(key, "", false);
+            total++;
+        }
+    }
+    REQUIRE(exact.size() == keys);
+    REQUIRE(approx.size() <= 20);
+    REQUIRE(approx.bytes() < exact.bytes() / 4);
+
+    auto r = approx.makeReport(0);
+    REQUIRE(r.size() == 10);
+    REQUIRE(approx.makeReport(3).size() == 3);
+    const double bound = 2.72 * total / 1024; // e/width of the total
+    for (size_t i = 0; i < r.size(); i++) {
+        REQUIRE(r[i].key == "key" + std::to_string(i));
+        REQUIRE(r[i].value->count >= uint32_t(occurs(i)));
+        REQUIRE(r[i].value->count <= occurs(i) + bound);
+    }
+
+    approx.clear();
+    REQUIRE(approx.size() == 0);
+}
+
+/* Features like those a recorder sees: mostly ASCII, some UTF-8, a few UTF-16 */
+static std::vector<std::string> histogram_test_features(size_t count) {
+    std::vector<std::string> ret;
+    for (size_t i = 0; i < count; i++) {
+        std::string f = "User" + std::to_string(i % 997) + "@Domain" + std::to_string(i % 31) + ".COM";
+        if (i % 50 == 0) f = "Ünïcödé" + std::to_string(i % 7) + "@Dömain.de";
+        if (i % 100 == 1) {
+            std::string u16;
+            for (char ch : f) { u16.push_back(ch); u16.push_back('\0'); }
+            f = u16;
+        }
+        ret.push_back(f);
+    }
+    return ret;
+}
+
+static std::vector<histogram_def> histogram_test_defs() {
+    return std::vector<histogram_def> {
+        histogram_def("email", "email", "", "", "histogram", histogram_def::flags_t(true, false)),
+        histogram_def("domain", "email", "@(.*)", "", "domain_histogram", histogram_def::flags_t(true, false)),
+        histogram_def("user", "email", "^[^@]*", "", "user_histogram", histogram_def::flags_t()),
+        histogram_def("numbers", "email", "", "", "numeric_histogram", histogram_def::flags_t(false, true)),
+        histogram_def("com", "email", "", ".COM", "com_histogram", histogram_def::flags_t()),
+        histogram_def("raw", "email", "", "", "raw_histogram", histogram_def::flags_t()),
+    };
+}
+
+TEST_CASE("AtomicUnicodeHistogram_add_feature", "[histogram]") {
+    /* A shared histogram_feature gives the same histograms as normalizing for each histogram */
+    auto features = histogram_test_features(5000);
+    for (const auto& def : histogram_test_defs()) {
+        AtomicUnicodeHistogram separate(def);
+        AtomicUnicodeHistogram shared(def);
+        for (const auto& f : features) {
+            separate.add_feature_context(f, "context");
+            shared.add_feature(histogram_feature(f), "context");
+        }
+        std::stringstream s1, s2;
+        s1 << separate.makeReport(0);
+        s2 << shared.makeReport(0);
+        INFO("def=" << def.name);
+        REQUIRE(separate.size() > 0);
+        REQUIRE(s1.str() == s2.str());
+    }
+    histogram_feature f16(features[1]);
+    REQUIRE(f16.found_utf16 == true);
+    REQUIRE(f16.u8 == "User1@Domain1.COM");
+    REQUIRE(f16.lowercase() == "user1@domain1.com");
+}
+
+TEST_CASE("AtomicUnicodeHistogram_add_feature_benchmark", "[.][benchmark]") {
+    /* Run with: test_be20_api "[benchmark]" */
+    auto features = histogram_test_features(200000);
+    auto defs = histogram_test_defs();
+    std::vector<std::unique_ptr<AtomicUnicodeHistogram>> separate, shared;
+    for (const auto& def : defs) {
+        separate.push_back(std::make_unique<AtomicUnicodeHistogram>(def));
+        shared.push_back(std::make_unique<AtomicUnicodeHistogram>(def));
+    }
+    aftimer t1;
+    t1.start();
+    for (const auto& f : features) {
+        for (auto& h : separate) h->add_feature_context(f, "context");
+    }
+    t1.stop();
+    aftimer t2;
+    t2.start();
+    for (const auto& f : features) {
+        const histogram_feature hf(f);
+        for (auto& h : shared) h->add_feature(hf, "context");
+    }
+    t2.stop();
+    std::cout << features.size() << " features, " << defs.size() << " histograms: "
+              << "normalized per histogram=" << t1.elapsed_seconds() << "s "
+              << "normalized once=" << t2.elapsed_seconds() << "s\n";
+    for (size_t i = 0; i < defs.size(); i++) {
+        REQUIRE(separate[i]->size() == shared[i]->size());
+    }
+}
+
 /****************************************************************
  * hash_t.h
  */
@@ -445,6 +675,323 @@ TEST_CASE("feature_recorder_tests", "[feature_recorder]") {
 
 }
 
+#include "carve_queue.h"
+TEST_CASE("carve_queue", "[feature_recorder]") {
+    std::filesystem::path tmpdir = NamedTemporaryDirectory();
+    {
+        /* a bound smaller than two jobs keeps one job in flight at a time */
+        carve_queue q(2, 1000);
+        for (size_t i = 0; i < 50; i++) {
+            carve_queue::job_t job;
+            job.path = tmpdir / "q" / std::to_string(i % 3) / (std::to_string(i) + ".bin");
+            job.bytes.assign(600 + i, uint8_t(i));
+            q.enqueue(std::move(job));
+            REQUIRE(q.bytes_in_flight() <= 1000 + 600 + i);
+        }
+        q.drain();
+        REQUIRE(q.bytes_in_flight() == 0);
+        REQUIRE(q.files_written == 50);
+        REQUIRE(std::filesystem::file_size(tmpdir / "q" / "1" / "49.bin") == 649);
+
+        /* an error is rethrown by drain(), once */
+        carve_queue::job_t bad;
+        bad.path = tmpdir / "q" / "1" / "49.bin" / "x"; // under a file
+        q.enqueue(std::move(bad));
+        REQUIRE_THROWS_AS(q.drain(), feature_recorder::DiskWriteError);
+        REQUIRE_NOTHROW(q.drain());
+    }
+    {
+        /* file-backed jobs count toward the bound, so a second one waits while the first is written */
+        std::ofstream(tmpdir / "source.bin") << std::string(1000, 'x');
+        carve_queue q(1, 1000);
+        std::promise<void> release;
+        std::shared_future<void> released = release.get_future().share();
+        auto file_job = [&](const std::string& name) {
+            carve_queue::job_t job;
+            job.path = tmpdir / "fq" / name;
+            job.source_fd = ::open((tmpdir / "source.bin").c_str(), O_RDONLY);
+            job.source_bytes = 600;
+            return job;
+        };
+        carve_queue::job_t first = file_job("first");
+        first.on_written = [released]() { released.wait(); };
+        q.enqueue(std::move(first));
+        REQUIRE(q.bytes_in_flight() == 600);
+        std::atomic<bool> enqueued {false};
+        std::thread t([&]() {
+            q.enqueue(file_job("second"));
+            enqueued = true;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        REQUIRE(enqueued == false);
+        release.set_value();
+        t.join();
+        q.drain();
+        REQUIRE(std::filesystem::file_size(tmpdir / "fq" / "second") == 600);
+
+        /* a job that enqueue() rejects because of an earlier error has its source closed, and is failed */
+        carve_queue::job_t bad;
+        bad.path = tmpdir / "source.bin" / "x"; // under a file
+        bad.bytes = {1};
+        q.enqueue(std::move(bad));
+        while (q.bytes_in_flight() > 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        carve_queue::job_t rejected = file_job("rejected");
+        const int fd = rejected.source_fd;
+        bool failed = false;
+        rejected.on_failed = [&failed]() { failed = true; };
+        REQUIRE_THROWS_AS(q.enqueue(std::move(rejected)), feature_recorder::DiskWriteError);
+        REQUIRE(::fcntl(fd, F_GETFD) == -1);
+        REQUIRE(failed);
+    }
+
+    /* carve() returns the name at once; the file is there after carve_drain() */
+    feature_recorder_set::flags_t flags;
+    flags.no_alert = true;
+    scanner_config sc;
+    sc.outdir = tmpdir;
+    feature_recorder_set frs(flags, sc);
+    frs.carve_max_bytes_in_flight = 64;
+    feature_recorder& fr = frs.create_feature_recorder("carver");
+    fr.carve_mode = feature_recorder_def::CARVE_ALL;
+    auto hbuf = sbuf_t("Header\n");
+    auto sbuf = sbuf_t("[record 001][record 002]");
+    std::string rel = fr.carve(hbuf, sbuf, ".rec", 1000000000);
+    REQUIRE(rel == "carver/000/0.rec");
+    REQUIRE(fr.carve(sbuf_t("Hello World!\n"), ".txt") == "carver/000/0.txt");
+    REQUIRE(fr.carve(sbuf_t("Hello World!\n"), ".txt") == feature_recorder::CACHED);
+    frs.carve_drain();
+    REQUIRE(getLast(getLines(tmpdir / rel)) == "[record 001][record 002]");
+    REQUIRE(std::filesystem::file_size(tmpdir / rel) == 7 + 24);
+    REQUIRE(frs.get_carve_queue().files_written == 2);
+    std::filesystem::remove_all(tmpdir);
+}
+
+TEST_CASE("carve_zero_copy", "[feature_recorder]") {
+    std::filesystem::path tmpdir = NamedTemporaryDirectory();
+    std::filesystem::path image = tmpdir / "image.bin";
+    std::string contents;
+    for (int i = 0; i < 300000; i++) contents.push_back(char(i * 7 + (i >> 8)));
+    std::ofstream(image, std::ios::binary) << contents;
+
+    feature_recorder_set::flags_t flags;
+    flags.no_alert = true;
+    scanner_config sc;
+    sc.outdir = tmpdir / "out";
+    feature_recorder_set frs(flags, sc);
+    frs.carve_max_bytes_in_flight = 1000; // file-backed data counts, so each carve waits for the one before
+    feature_recorder& fr = frs.create_feature_recorder("video");
+    std::string rel, rel_header;
+    {
+        sbuf_t* sbp = sbuf_t::map_file(image);
+        int fd = -1;
+        uint64_t off = 0;
+        sbuf_t* child = sbp->new_slice(pos0_t("", 1000), 1000, 250000);
+        REQUIRE(child->file_extent(fd, off));
+        REQUIRE(off == 1000);
+        rel = fr.carve(*child, ".mp4");
+        rel_header = fr.carve(sbuf_t("HEAD"), *sbp, ".mp4");
+        REQUIRE(sbuf_t("not in a file").file_extent(fd, off) == false);
+        delete child;
+        delete sbp;                     // the queue has its own descriptor
+    }
+    frs.carve_drain();
+    auto read_all = [](const std::filesystem::path& p) {
+        std::ifstream in(p, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+    REQUIRE(read_all(sc.outdir / rel) == contents.substr(1000, 250000));
+    REQUIRE(read_all(sc.outdir / rel_header) == "HEAD" + contents);
+    REQUIRE(frs.get_carve_queue().bytes_written == 250000 + 4 + contents.size());
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+    REQUIRE(frs.get_carve_queue().bytes_copied_in_kernel == 250000 + contents.size());
+#endif
+    std::filesystem::remove_all(tmpdir);
+}
+
+#include "carve_store.h"
+TEST_CASE("carve_store", "[feature_recorder]") {
+    std::filesystem::path tmpdir = NamedTemporaryDirectory();
+    std::filesystem::path storedir = tmpdir / "store";
+    std::string first_path;
+    for (int run = 0; run < 2; run++) {
+        feature_recorder_set::flags_t flags;
+        flags.no_alert = true;
+        scanner_config sc;
+        sc.outdir = tmpdir / ("run" + std::to_string(run));
+        feature_recorder_set frs(flags, sc);
+        frs.open_carve_store(storedir);
+        feature_recorder& fr1 = frs.create_feature_recorder("jpeg");
+        feature_recorder& fr2 = frs.create_feature_recorder("zip");
+
+        /* the same object carved by two recorders is stored once */
+        std::string p1 = fr1.carve(sbuf_t("a common object"), ".jpg");
+        std::string p2 = fr2.carve(sbuf_t("a common object"), ".jpg");
+        REQUIRE(p1 == p2);
+        REQUIRE(p1.find(storedir.string()) == 0);
+        std::string p3 = fr1.carve(sbuf_t("Header\n"), sbuf_t("a common object"), ".jpg");
+        REQUIRE(p3 != p1);              // the header is part of the object
+        const std::string whole = "Header\na common object";
+        REQUIRE(p3.find(frs.hasher.func(reinterpret_cast<const uint8_t*>(whole.data()), whole.size())) != std::string::npos);
+        frs.carve_drain();
+        REQUIRE(getLast(getLines(p1)) == "a common object");
+        if (run == 0) {
+            first_path = p1;
+            REQUIRE(frs.get_carve_queue().files_written == 2);
+        } else {
+            /* the second run finds both in the index and writes nothing */
+            REQUIRE(p1 == first_path);
+            REQUIRE(frs.get_carve_store()->hits == 3);
+            REQUIRE(frs.get_carve_queue().files_written == 0);
+        }
+        REQUIRE(frs.get_carve_store()->size() == 2);
+    }
+
+    /* a record cut short is ignored */
+    std::filesystem::path index = storedir / carve_store::INDEX_NAME;
+    std::filesystem::resize_file(index, std::filesystem::file_size(index) - 3);
+    {
+        carve_store store(storedir);
+        REQUIRE(store.size() == 1);
+    }
+
+    /* an object that could not be written is forgotten, so it is written again next time */
+    {
+        carve_store store(storedir);
+        carve_queue q(1);
+        std::ofstream(storedir / "00") << "not a directory";
+        std::filesystem::path p;
+        REQUIRE(store.find_or_add("00ff", ".bin", p) == false);
+        REQUIRE(store.find_or_add("00ff", ".bin", p) == true); // being written
+        carve_queue::job_t job;
+        job.path = p;
+        job.bytes = {1, 2, 3};
+        job.on_written = [&store, p]() { store.commit("00ff", p); };
+        job.on_failed = [&store]() { store.abandon("00ff"); };
+        q.enqueue(std::move(job));
+        REQUIRE_THROWS_AS(q.drain(), feature_recorder::DiskWriteError);
+        REQUIRE(store.find_or_add("00ff", ".bin", p) == false);
+        REQUIRE(store.size() == 1);
+    }
+    std::ofstream(storedir / "bad_index") << "not an index";
+    std::filesystem::rename(storedir / "bad_index", index);
+    REQUIRE_THROWS_AS(carve_store(storedir), carve_store::StoreError);
+    std::filesystem::remove_all(tmpdir);
+}
+
+#if defined(HAVE_SQLITE3_H) && defined(HAVE_LIBSQLITE3)
+#include "feature_recorder_sql.h"
+#include <sqlite3.h>
+namespace {
+int64_t sql_count(sqlite3* db, const std::string& sql) {
+    sqlite3_stmt* stmt = nullptr;
+    int64_t ret = -1;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        ret = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return ret;
+}
+}
+
+TEST_CASE("feature_recorder_sql", "[feature_recorder]") {
+    std::filesystem::path tmpdir = NamedTemporaryDirectory();
+    const int THREADS = 4;
+    const int PER_THREAD = 2500;
+    {
+        feature_recorder_set::flags_t flags;
+        flags.no_alert = true;
+        flags.record_files = false;
+        flags.record_sql = true;
+        scanner_config sc;
+        sc.outdir = tmpdir;
+        feature_recorder_set frs(flags, sc);
+        frs.sql_options.batch_rows = 100;
+        feature_recorder& fr = frs.create_feature_recorder("email");
+        frs.histogram_add(histogram_def("email", "email", "", "", "", histogram_def::flags_t()));
+        frs.histogram_add(histogram_def("domains", "email", "example[0-9]", "", "domain", histogram_def::flags_t()));
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < THREADS; t++) {
+            threads.emplace_back([&fr, t]() {
+                for (int i = 0; i < PER_THREAD; i++) {
+                    fr.write(pos0_t("", t * PER_THREAD + i),
+                             "user" + std::to_string(i % 10) + "@example" + std::to_string(t) + ".com", "context");
+                }
+            });
+        }
+        for (auto& th : threads) th.join();
+        frs.feature_recorders_shutdown();
+        sql_writer& w = frs.get_sql_writer();
+        REQUIRE(w.rows_inserted == THREADS * PER_THREAD);
+        REQUIRE(w.transactions == THREADS * PER_THREAD / 100); // every batch is full
+        REQUIRE(w.inserts_per_second() > 0);
+        frs.histograms_generate();
+    }
+
+    sqlite3* db = nullptr;
+    REQUIRE(sqlite3_open((tmpdir / feature_recorder_set::SQL_DB_NAME).c_str(), &db) == SQLITE_OK);
+    REQUIRE(sql_count(db, "SELECT COUNT(*) FROM f_email") == THREADS * PER_THREAD);
+    REQUIRE(sql_count(db, "SELECT offset FROM f_email WHERE feature_utf8='user3@example2.com' ORDER BY offset") ==
+            2 * PER_THREAD + 3);
+    REQUIRE(sql_count(db, "SELECT COUNT(*) FROM h_email") == 10 * THREADS);
+    REQUIRE(sql_count(db, "SELECT count FROM h_email WHERE feature_utf8='user0@example0.com'") == PER_THREAD / 10);
+    REQUIRE(sql_count(db, "SELECT COUNT(*) FROM h_email_domain") == THREADS);
+    REQUIRE(sql_count(db, "SELECT count FROM h_email_domain WHERE feature_utf8='example1'") == PER_THREAD);
+    sqlite3_close(db);
+    std::filesystem::remove_all(tmpdir);
+}
+
+TEST_CASE("feature_recorder_sql_histograms", "[feature_recorder]") {
+    std::filesystem::path tmpdir = NamedTemporaryDirectory();
+    const std::filesystem::path dbname = tmpdir / feature_recorder_set::SQL_DB_NAME;
+    const std::string count_indexes = "SELECT COUNT(*) FROM sqlite_master WHERE type='index' AND tbl_name='f_url'";
+    {
+        feature_recorder_set::flags_t flags;
+        flags.no_alert = true;
+        flags.record_files = false;
+        flags.record_sql = true;
+        scanner_config sc;
+        sc.outdir = tmpdir;
+        feature_recorder_set frs(flags, sc);
+        frs.sql_histogram_threads = 2;
+        feature_recorder& url = frs.create_feature_recorder("url");
+        feature_recorder& email = frs.create_feature_recorder("email");
+        histogram_def::flags_t lower;
+        lower.lowercase = true;
+        histogram_def::flags_t in_context;
+        in_context.require_feature = false;
+        in_context.require_context = true;
+        frs.histogram_add(histogram_def("url_hosts", "url", "^[a-z]+://[^/]+", "", "hosts", lower));
+        frs.histogram_add(histogram_def("url_search", "url", "", "search", "search", in_context));
+        frs.histogram_add(histogram_def("email", "email", "", "", "", histogram_def::flags_t()));
+        for (int i = 0; i < 100; i++) {
+            url.write(pos0_t("", i), (i % 2 ? "HTTP://Example.com/" : "http://example.org/") + std::to_string(i),
+                      i % 4 == 0 ? "a search page" : "a page");
+            email.write(pos0_t("", i), "user" + std::to_string(i % 5) + "@example.com", "");
+        }
+        url.flush();
+        sqlite3* db = nullptr;
+        REQUIRE(sqlite3_open(dbname.c_str(), &db) == SQLITE_OK);
+        REQUIRE(sql_count(db, count_indexes) == 0);      // they are built at shutdown
+        sqlite3_close(db);
+
+        frs.feature_recorders_shutdown();
+        frs.histograms_generate();
+    }
+
+    sqlite3* db = nullptr;
+    REQUIRE(sqlite3_open(dbname.c_str(), &db) == SQLITE_OK);
+    REQUIRE(sql_count(db, count_indexes) == 3);
+    REQUIRE(sql_count(db, "SELECT COUNT(*) FROM h_url_hosts") == 2);
+    REQUIRE(sql_count(db, "SELECT count FROM h_url_hosts WHERE feature_utf8='http://example.com'") == 50);
+    REQUIRE(sql_count(db, "SELECT COUNT(*) FROM h_url_search") == 25);
+    REQUIRE(sql_count(db, "SELECT SUM(count) FROM h_email") == 100);
+    REQUIRE(sql_count(db, "SELECT COUNT(*) FROM sqlite_master WHERE type='index' AND tbl_name='h_email'") == 2);
+    sqlite3_close(db);
+    std::filesystem::remove_all(tmpdir);
+}
+#endif
+
 /** feature_recorder_file functions */
 TEST_CASE("file_support","[feature_recorder_file]") {
     std::string line {"one\ttwo\tthree\\133"};
@@ -458,6 +1005,319 @@ TEST_CASE("file_support","[feature_recorder_file]") {
 
 }
 
+/* Writes copies of four features, one of them bad UTF-8, for comparing a binary feature file with the text one */
+static void binary_test_write(feature_recorder& fr, int copies) {
+    for (int i = 0; i < copies; i++) {
+        fr.write(pos0_t("", 100 + i), "one", "context one");
+        fr.write(pos0_t("1000-GZIP", 20 + i), "two", "context\ttwo");
+        fr.write(pos0_t("1000-GZIP", 40 + i), "one", "");
+        fr.write(pos0_t("", 200 + i), "bad\xff", "bad\xff context");
+    }
+    fr.flush();
+}
+
+/* The feature lines of a feature file in text form; comments are skipped */
+static std::vector<std::string> binary_test_lines(std::istream& in) {
+    std::vector<std::string> lines;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.size() > 0 && line[0] != '#') lines.push_back(line);
+    }
+    return lines;
+}
+
+/* What the text recorder writes for binary_test_write() */
+static std::vector<std::string> binary_test_text_lines(int copies) {
+    feature_recorder_set::flags_t flags;
+    flags.no_alert = true;
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    feature_recorder_set fs(flags, sc);
+    binary_test_write(fs.create_feature_recorder("test"), copies);
+    std::ifstream in(sc.outdir / "test.txt");
+    return binary_test_lines(in);
+}
+
+/** feature_recorder_bin: the binary file must convert to exactly what the text recorder writes */
+#include "feature_recorder_bin.h"
+TEST_CASE("feature_recorder_bin", "[feature_recorder_file]") {
+    feature_recorder_set::flags_t flags;
+    flags.no_alert = true;
+    flags.record_binary = true;
+    scanner_config sc_bin;
+    sc_bin.outdir = NamedTemporaryDirectory();
+    feature_recorder_set fs_bin(flags, sc_bin);
+    feature_recorder_bin& fr = dynamic_cast<feature_recorder_bin&>(fs_bin.create_feature_recorder("test"));
+    histogram_def h1("h1", "test", "", "", "histogram", histogram_def::flags_t());
+    fs_bin.histogram_add(h1);
+    fr.disable_incremental_histograms = true;
+    binary_test_write(fr, 1);
+
+    REQUIRE(std::filesystem::exists(sc_bin.outdir / "test.bin"));
+    REQUIRE(!std::filesystem::exists(sc_bin.outdir / "test.txt"));
+
+    std::stringstream ss;
+    feature_recorder_bin::convert_to_text(sc_bin.outdir / "test.bin", ss);
+    const auto bin_lines = binary_test_lines(ss);
+    REQUIRE(bin_lines.size() == 4);
+    REQUIRE(bin_lines == binary_test_text_lines(1));
+    REQUIRE(bin_lines[1] == "1000-GZIP-20\ttwo\tcontext\\011two");
+
+    /* the file is read in chunks, in parallel, with the same result */
+    fr.read_chunk_bytes = 1;            // a chunk for every record
+    std::mutex M;
+    std::multiset<std::string> serial, parallel;
+    fr.feature_file_for_each([&](const std::string& f, const std::string& c) { serial.insert(f + "/" + c); }, 1);
+    fr.feature_file_for_each([&](const std::string& f, const std::string& c) {
+        const std::lock_guard<std::mutex> lock(M);
+        parallel.insert(f + "/" + c);
+    }, 3);
+    REQUIRE(serial.size() == 4);
+    REQUIRE(parallel == serial);
+
+    /* histograms are rebuilt from the binary file */
+    fr.histogram_rebuild_threads = 3;
+    fs_bin.histograms_generate();
+    auto hlines = getLines(sc_bin.outdir / "test_histogram.txt");
+    REQUIRE(getLast(hlines) == "n=1\ttwo");
+
+    /* damaged files are detected */
+    std::filesystem::resize_file(sc_bin.outdir / "test.bin", std::filesystem::file_size(sc_bin.outdir / "test.bin") - 2);
+    REQUIRE_THROWS_AS(feature_recorder_bin::convert_to_text(sc_bin.outdir / "test.bin", ss),
+                      feature_recorder_bin::BinaryFormatError);
+}
+
+#include "feature_recorder_columnar.h"
+TEST_CASE("feature_recorder_columnar", "[feature_recorder_file]") {
+    feature_recorder_set::flags_t flags;
+    flags.no_alert = true;
+    flags.record_columnar = true;
+    scanner_config sc_col;
+    sc_col.outdir = NamedTemporaryDirectory();
+    feature_recorder_set fs_col(flags, sc_col);
+    feature_recorder_columnar& fr = dynamic_cast<feature_recorder_columnar&>(fs_col.create_feature_recorder("test"));
+    fr.row_group_rows = 7;
+    fr.histogram_rebuild_threads = 3;
+    histogram_def h1("h1", "test", "", "", "histogram", histogram_def::flags_t());
+    fs_col.histogram_add(h1);
+    fr.disable_incremental_histograms = true;
+    binary_test_write(fr, 10);
+
+    const std::filesystem::path fname = sc_col.outdir / "test.cols";
+    REQUIRE(std::filesystem::exists(fname));
+    REQUIRE(!std::filesystem::exists(sc_col.outdir / "test.txt"));
+    REQUIRE(fr.row_groups_written == 6); // 40 rows in groups of 7
+    {
+        feature_recorder_columnar::file_reader reader(fname);
+        REQUIRE(reader.row_groups.size() == 6);
+        REQUIRE(reader.rows() == 40);
+        REQUIRE(reader.paths.size() == 2); // each path is in the dictionary once
+        REQUIRE(reader.row_groups[0].offsets[1] == 20);
+        REQUIRE(reader.paths[reader.row_groups[0].path_ids[1]] == "1000-GZIP");
+    }
+
+    std::stringstream ss;
+    feature_recorder_columnar::convert_to_text(fname, ss);
+    const auto col_lines = binary_test_lines(ss);
+    REQUIRE(col_lines.size() == 40);
+    REQUIRE(col_lines == binary_test_text_lines(10));
+
+    /* histograms are rebuilt from the row groups, in parallel */
+    fs_col.histograms_generate();
+    auto hlines = getLines(sc_col.outdir / "test_histogram.txt");
+    REQUIRE(getLast(hlines) == "n=10\ttwo");
+
+    /* damaged files are detected */
+    std::filesystem::resize_file(fname, std::filesystem::file_size(fname) - 8);
+    REQUIRE_THROWS_AS(feature_recorder_columnar::convert_to_text(fname, ss),
+                      feature_recorder_columnar::ColumnarFormatError);
+}
+
+/** FeatureReader: the sequential, range and parallel readers must see the same features */
+#include "feature_reader.h"
+TEST_CASE("FeatureReader", "[feature_recorder_file]") {
+    feature_recorder_set::flags_t flags;
+    flags.no_alert = true;
+    scanner_config sc;
+    sc.outdir = NamedTemporaryDirectory();
+    feature_recorder_set fs(flags, sc);
+    feature_recorder& fr = fs.create_feature_recorder("test");
+    const int N = 10000;
+    for (int i = 0; i < N; i++) {
+        fr.write(pos0_t("", i * 10), std::to_string(i), (i % 2) ? std::string("ctx") : std::string(""));
+    }
+    fr.flush();
+
+    FeatureView fv;
+    REQUIRE(FeatureReader::parse_line("100\tfoo\tbar\r", fv));
+    REQUIRE(fv.pos0 == "100");
+    REQUIRE(fv.feature == "foo");
+    REQUIRE(fv.context == "bar");
+    REQUIRE(FeatureReader::parse_line("100\tfoo", fv));
+    REQUIRE(fv.context == "");
+    REQUIRE(!FeatureReader::parse_line("# comment\tfoo", fv));
+    REQUIRE(!FeatureReader::parse_line("nothing", fv));
+
+    FeatureReader reader(fr);
+    uint64_t count = 0, sum = 0;
+    for (const auto& it : reader) {
+        count += 1;
+        sum += std::stoi(std::string(it.feature));
+    }
+    REQUIRE(count == N);
+    REQUIRE(sum == uint64_t(N) * (N - 1) / 2);
+    REQUIRE(reader.begin()->to_feature().pos.offset == 0);
+
+    /* chunks must be line-aligned and cover the whole file */
+    auto chunks = reader.chunks(7);
+    REQUIRE(chunks.front().first == 0);
+    REQUIRE(chunks.back().second == reader.size());
+    for (size_t i = 1; i < chunks.size(); i++) {
+        REQUIRE(chunks[i].first == chunks[i - 1].second);
+    }
+
+    std::atomic<uint64_t> pcount {0}, psum {0}, pcontexts {0};
+    reader.for_each_parallel([&](const FeatureView& f) {
+        pcount += 1;
+        psum += std::stoi(std::string(f.feature));
+        if (f.context == "ctx") pcontexts += 1;
+    }, 4);
+    REQUIRE(pcount == N);
+    REQUIRE(psum == sum);
+    REQUIRE(pcontexts == N / 2);
+
+    REQUIRE_THROWS_AS(reader.for_each_parallel([](const FeatureView&) { throw std::runtime_error("stop"); }, 4),
+                      std::runtime_error);
+}
+
+/** Histograms rebuilt from the feature file in parallel must match the incremental histograms */
+TEST_CASE("histograms_write_from_file", "[feature_recorder_file]") {
+    auto make_histograms = [](bool incremental) {
+        feature_recorder_set::flags_t flags;
+        flags.no_alert = true;
+        scanner_config sc;
+        sc.outdir = NamedTemporaryDirectory();
+        feature_recorder_set fs(flags, sc);
+        feature_recorder& fr = fs.create_feature_recorder("email");
+        fr.disable_incremental_histograms = !incremental;
+        dynamic_cast<feature_recorder_file&>(fr).histogram_rebuild_threads = 4;
+        fs.histogram_add(histogram_def("h1", "email", "", "", "histogram", histogram_def::flags_t()));
+        fs.histogram_add(histogram_def("h2", "email", "@(.*)", "", "domain_histogram", histogram_def::flags_t(true, false)));
+        for (int i = 0; i < 5000; i++) {
+            std::string feature = "User" + std::to_string(i % 97) + "@Domain" + std::to_string(i % 13) + ".com";
+            fr.write(pos0_t("", i * 100), feature, "<" + feature + ">");
+        }
+        fs.histograms_generate();
+        std::vector<std::vector<std::string>> ret;
+        for (const auto& fname : {"email_histogram.txt", "email_domain_histogram.txt"}) {
+            std::vector<std::string> lines;
+            for (const auto& line : getLines(sc.outdir / fname)) {
+                if (line[0] != '#') lines.push_back(line);
+            }
+            ret.push_back(lines);
+        }
+        return ret;
+    };
+    auto incremental = make_histograms(true);
+    auto rebuilt = make_histograms(false);
+    REQUIRE(incremental[0].size() == 97 * 13);
+    REQUIRE(incremental[1].size() == 13);
+    REQUIRE(incremental[1][0] == "n=385\t@domain0.com");
+    REQUIRE(rebuilt == incremental);
+
+    /* an approximate histogram is rebuilt in the memory of one sketch, whatever the number of threads */
+    auto rebuild_bytes = [](unsigned int threads) {
+        feature_recorder_set::flags_t flags;
+        flags.no_alert = true;
+        scanner_config sc;
+        sc.outdir = NamedTemporaryDirectory();
+        feature_recorder_set fs(flags, sc);
+        feature_recorder_file& fr = dynamic_cast<feature_recorder_file&>(fs.create_feature_recorder("email"));
+        fr.disable_incremental_histograms = true;
+        fr.histogram_rebuild_threads = threads;
+        histogram_def def("h1", "email", "", "", "histogram", histogram_def::flags_t());
+        def.approximate_top_n = 10;
+        fs.histogram_add(def);
+        for (int i = 0; i < 20000; i++) {
+            std::string feature = "user" + std::to_string(i < 10000 ? i % 5 : i) + "@example.com";
+            fr.write(pos0_t("", i * 100), feature, "<" + feature + ">");
+        }
+        fs.histograms_generate();
+        size_t lines = 0, heavy = 0;
+        for (const auto& line : getLines(sc.outdir / "email_histogram.txt")) {
+            if (line[0] == '#') continue;
+            lines++;
+            for (int k = 0; k < 5; k++) {  // counts are estimates, so only the keys are checked
+                const std::string key = "\tuser" + std::to_string(k) + "@example.com";
+                if (line.size() > key.size() && line.compare(line.size() - key.size(), key.size(), key) == 0) heavy++;
+            }
+        }
+        REQUIRE(lines == 10);
+        REQUIRE(heavy == 5);
+        return static_cast<uint64_t>(fr.histogram_rebuild_bytes);
+    };
+    const uint64_t one = rebuild_bytes(1);
+    REQUIRE(one > 0);
+    REQUIRE(rebuild_bytes(8) < one * 3 / 2);
+}
+
+
+#include "histogram_spill.h"
+TEST_CASE("histogram_spill", "[feature_recorder_file]") {
+    /* A histogram that is spilled must come out the same as one that stayed in memory */
+    auto make_histogram = [](size_t budget, uint64_t& spilled, size_t& leftover_files) {
+        feature_recorder_set::flags_t flags;
+        flags.no_alert = true;
+        scanner_config sc;
+        sc.outdir = NamedTemporaryDirectory();
+        feature_recorder_set fs(flags, sc);
+        feature_recorder& fr = fs.create_feature_recorder("email");
+        auto& frf = dynamic_cast<feature_recorder_file&>(fr);
+        frf.histogram_memory_budget = budget;
+        fs.histogram_add(histogram_def("h1", "email", "", "", "histogram", histogram_def::flags_t()));
+        for (int i = 0; i < 20000; i++) {
+            std::string feature = "User" + std::to_string((i * 7) % 1500) + "@Domain" + std::to_string(i % 13) + ".com";
+            fr.write(pos0_t("", i * 100), feature, "<" + feature + ">");
+        }
+        spilled = frf.histogram_spills[0]->entries_spilled();
+        fs.histograms_generate();
+        leftover_files = 0;
+        for (const auto& p : std::filesystem::directory_iterator(sc.outdir)) {
+            if (p.path().string().find(".run") != std::string::npos) leftover_files++;
+        }
+        std::vector<std::string> lines;
+        for (const auto& line : getLines(sc.outdir / "email_histogram.txt")) {
+            if (line[0] != '#') lines.push_back(line);
+        }
+        return lines;
+    };
+    uint64_t spilled = 0;
+    size_t leftover_files = 0;
+    auto in_memory = make_histogram(0, spilled, leftover_files);
+    REQUIRE(spilled == 0);
+    auto spilled_lines = make_histogram(16384, spilled, leftover_files);
+    REQUIRE(spilled > 0);
+    REQUIRE(leftover_files == 0);
+    REQUIRE(in_memory.size() > 1500);
+    REQUIRE(spilled_lines == in_memory);
+
+    /* runs can also be merged directly */
+    std::filesystem::path dir = NamedTemporaryDirectory();
+    histogram_def d1("name", "feature_file", "", "", "suffix1", histogram_def::flags_t());
+    AtomicUnicodeHistogram h(d1);
+    histogram_spill spill(dir / "run");
+    h.add0("a", "", false);
+    h.add0("b", "", true);
+    REQUIRE(spill.spill(h) == 2);
+    REQUIRE(h.size() == 0);
+    h.add0("b", "", false);
+    h.add0("c", "", false);
+    REQUIRE(spill.runs() == 1);
+    std::stringstream ss;
+    spill.merge(h, 1, [&ss](const AtomicUnicodeHistogram::auh_t::item& it) { ss << it; });
+    REQUIRE(ss.str() == "n=2\tb\t(utf16=1)\nn=1\ta\nn=1\tc\n");
+    REQUIRE(spill.runs() == 0);
+}
 
 /** test the path printer
  */
@@ -744,6 +1604,69 @@ TEST_CASE("pos0_t", "[feature_recorder]") {
     REQUIRE(p1 == p2);
 }
 
+TEST_CASE("pos0_t_interning", "[feature_recorder]") {
+    size_t before = pos0_t::interned_count();
+    {
+        pos0_t p0("500-GZIP-20-BASE64", 7);
+        pos0_t p1("500-GZIP-20-BASE64", 7);
+        pos0_t p2(p0);
+        REQUIRE(pos0_t::interned_count() == before + 1);
+        REQUIRE(p0.same_path(p1));
+        REQUIRE(&p0.path == &p2.path);
+        REQUIRE(p0.depth() == 2);
+        REQUIRE(std::hash<pos0_t>()(p0) == std::hash<pos0_t>()(p1));
+        REQUIRE(std::hash<pos0_t>()(p0) != std::hash<pos0_t>()(p0 + 1));
+        REQUIRE(pos0_t().depth() == 0);
+        REQUIRE(pos0_t().alphaPart() == "");
+
+        pos0_t p3 = p0 + "ZIP";
+        REQUIRE(p3.path == "500-GZIP-20-BASE64-7-ZIP");
+        REQUIRE(p3.lastAddedPart() == "ZIP");
+        REQUIRE(p3.alphaPart() == "GZIP/BASE64/ZIP");
+        REQUIRE(pos0_t::interned_count() == before + 2);
+    }
+    REQUIRE(pos0_t::interned_count() == before);
+
+    /* copies and releases from several threads leave the table as it was */
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([]() {
+            for (int i = 0; i < 20000; i++) {
+                pos0_t p(std::string("100-GZIP-") + std::to_string(i % 7), i);
+                pos0_t q(p);
+                pos0_t r = q + 1;
+            }
+        });
+    }
+    for (auto& th : threads) th.join();
+    REQUIRE(pos0_t::interned_count() == before);
+}
+
+TEST_CASE("pos0_t_render", "[feature_recorder]") {
+    pos0_t p0("10000-GZIP-200-BASE64", 300);
+    REQUIRE(p0.str() == "10000-GZIP-200-BASE64-300");
+    REQUIRE(pos0_t("", 42).str() == "42");
+    REQUIRE(p0.shift(5).path == "10005-GZIP-200-BASE64"); // the whole base offset is shifted
+
+    /* rendering with a shift is the same as shifting and rendering */
+    size_t mismatches = 0;
+    for (const pos0_t& p : {p0, pos0_t(), pos0_t("", 7), pos0_t("123", 4), pos0_t("-ZIP", 9), p0 + "ZIP"}) {
+        for (int64_t s : {0, 1, -3, 1000000}) {
+            std::string out {"prefix "};
+            p.append_to(out, s);
+            if (out != "prefix " + p.shift(s).str()) mismatches++;
+        }
+    }
+    REQUIRE(mismatches == 0);
+
+    char buf[64];
+    auto r = p0.to_chars(buf, buf + sizeof(buf), 1);
+    REQUIRE(r.ec == std::errc());
+    REQUIRE(std::string(buf, r.ptr) == "10001-GZIP-200-BASE64-300");
+    REQUIRE(p0.to_chars(buf, buf + 10).ec == std::errc::value_too_large);
+    REQUIRE(p0.max_chars() >= p0.str().size());
+}
+
 /****************************************************************
  * regex_vector.h & regex_vector.cpp
  * Previously tested all three regex engines. Now just tests RE_ENGINE=RE2
@@ -821,6 +1744,145 @@ alarm(0);
     putenv(disable);
 }
 
+/* Patterns like a stop list's: mostly literal, some with character classes */
+static std::vector<std::string> regex_test_patterns(size_t count) {
+    std::vector<std::string> ret;
+    for (size_t i = 0; i < count; i++) {
+        switch (i % 4) {
+        case 0: ret.push_back("user" + std::to_string(i) + "@example\\.com"); break;
+        case 1: ret.push_back("[a-z]+" + std::to_string(i) + "@host" + std::to_string(i % 100) + "\\.org"); break;
+        case 2: ret.push_back("support@vendor" + std::to_string(i) + "\\.(com|net)"); break;
+        case 3: ret.push_back("ip" + std::to_string(i) + "-[0-9]+"); break;
+        }
+    }
+    return ret;
+}
+
+static std::vector<std::string> regex_test_probes(size_t count) {
+    std::vector<std::string> ret;
+    for (size_t i = 0; i < count; i++) {
+        switch (i % 5) {
+        case 0: ret.push_back("mail to user" + std::to_string(i * 7 % 1000) + "@example.com please"); break;
+        case 1: ret.push_back("abc" + std::to_string(i % 1000) + "@host" + std::to_string(i % 100) + ".org"); break;
+        case 2: ret.push_back("SUPPORT@VENDOR" + std::to_string(i % 1000) + ".NET"); break;
+        case 3: ret.push_back("ip" + std::to_string(i % 1000) + "-12345 and ip3-9"); break;
+        case 4: ret.push_back("nothing to see here " + std::to_string(i)); break;
+        }
+    }
+    return ret;
+}
+
+TEST_CASE("regex_vector_set", "[regex]") {
+    /* The RE2::Set must report the same first match as trying the regexes in order */
+    regex_vector rv;
+    for (const auto& p : regex_test_patterns(1000)) rv.push_back(p);
+    rv.push_back("example");            // matches some probes that an earlier pattern also matches
+    size_t hits = 0;
+    size_t mismatches = 0;
+    for (const auto& probe : regex_test_probes(2000)) {
+        std::string f1, f2;
+        size_t o1 = 0, o2 = 0, l1 = 0, l2 = 0;
+        rv.multi_pattern = false;
+        bool r1 = rv.search_all(probe, &f1, &o1, &l1);
+        rv.multi_pattern = true;
+        bool r2 = rv.search_all(probe, &f2, &o2, &l2);
+        if (r1) hits++;
+        if (r1 != r2 || f1 != f2 || o1 != o2 || l1 != l2) {
+            std::cerr << "mismatch for probe " << probe << ": " << f1 << " " << f2 << std::endl;
+            mismatches++;
+        }
+    }
+    REQUIRE(hits >= 1000);
+    REQUIRE(mismatches == 0);
+
+    /* adding a pattern after a search recompiles the set */
+    std::string found;
+    REQUIRE(rv.search_all("a new pattern", &found) == false);
+    rv.push_back("new pat+ern");
+    REQUIRE(rv.search_all("a new pattern", &found) == true);
+    REQUIRE(found == "new pattern");
+}
+
+#include "literal_prefilter.h"
+TEST_CASE("literal_prefilter", "[regex]") {
+    REQUIRE(literal_prefilter::required_literal("user12@example\\.com") == "user12@example.com");
+    REQUIRE(literal_prefilter::required_literal("[a-z]+77@HOST7\\.org") == "77@host7.org");
+    REQUIRE(literal_prefilter::required_literal("support@vendor2\\.(com|net)") == "support@vendor2.");
+    REQUIRE(literal_prefilter::required_literal("colou?r-scheme") == "r-scheme");
+    REQUIRE(literal_prefilter::required_literal("ab+cdef") == "cdef");
+    REQUIRE(literal_prefilter::required_literal("\\d+\\.\\d+\\.example") == ".example");
+    REQUIRE(literal_prefilter::required_literal("abc|defgh") == "");
+    REQUIRE(literal_prefilter::required_literal("x{2}yz\\x41bcdefgh") == "yz");
+    REQUIRE(literal_prefilter::required_literal("([)]xyzw)") == "");
+    REQUIRE(literal_prefilter::required_literal("(a[(\\]]b)cdef") == "cdef");
+
+    literal_prefilter pf;
+    pf.add("example", 0);
+    pf.add("", 1);
+    pf.add("ample", 2);
+    pf.add("plex", 3);
+    pf.add("xyz", 4);
+    pf.compile();
+    std::vector<uint32_t> ids;
+    pf.candidates("an EXAMPLE", ids);
+    REQUIRE(ids == std::vector<uint32_t>{0, 1, 2});
+    pf.candidates("simplexyz", ids);
+    REQUIRE(ids == std::vector<uint32_t>{1, 3, 4});
+    pf.candidates("nothing", ids);
+    REQUIRE(ids == std::vector<uint32_t>{1});
+    REQUIRE(literal_prefilter::is_ascii("plain ascii text"));
+    REQUIRE(!literal_prefilter::is_ascii("caf\xc3\xa9 ole"));
+
+    /* With the prefilter, search_all() must give the same first match as the RE2::Set alone */
+    regex_vector rv;
+    for (const auto& p : regex_test_patterns(1000)) rv.push_back(p);
+    size_t mismatches = 0;
+    for (const auto& probe : regex_test_probes(2000)) {
+        std::string f1, f2;
+        size_t o1 = 0, o2 = 0, l1 = 0, l2 = 0;
+        rv.prefilter = false;
+        bool r1 = rv.search_all(probe, &f1, &o1, &l1);
+        rv.prefilter = true;
+        bool r2 = rv.search_all(probe, &f2, &o2, &l2);
+        if (r1 != r2 || f1 != f2 || o1 != o2 || l1 != l2) mismatches++;
+    }
+    REQUIRE(mismatches == 0);
+
+    /* A class in a group may hold parentheses */
+    regex_vector rv2;
+    rv2.push_back("([)]xyzw)");
+    rv2.push_back("zzzz");
+    rv2.prefilter = false;
+    REQUIRE(rv2.search_all("a)xyzw", nullptr) == true);
+    rv2.prefilter = true;
+    REQUIRE(rv2.search_all("a)xyzw", nullptr) == true);
+
+    /* Case-insensitive regexes match KELVIN SIGN for k; non-ASCII probes skip the prefilter */
+    rv.push_back("kelvin@example");
+    REQUIRE(rv.search_all("\xe2\x84\xaa" "elvin@example", nullptr) == true);
+}
+
+TEST_CASE("regex_vector_set_benchmark", "[.][benchmark]") {
+    /* Run with: test_be20_api "[benchmark]" */
+    regex_vector rv;
+    for (const auto& p : regex_test_patterns(10000)) rv.push_back(p);
+    auto probes = regex_test_probes(2000);
+    for (int mode = 0; mode < 3; mode++) {
+        rv.multi_pattern = (mode > 0);
+        rv.prefilter = (mode > 1);
+        size_t hits = 0;
+        aftimer t;
+        t.start();
+        for (const auto& probe : probes) {
+            if (rv.search_all(probe, nullptr)) hits++;
+        }
+        t.stop();
+        const char* names[] = {"one at a time", "RE2::Set", "RE2::Set with literal prefilter"};
+        std::cout << "10000 patterns, " << probes.size() << " probes, "
+                  << names[mode] << ": " << t.elapsed_seconds() << "s hits=" << hits << "\n";
+    }
+}
+
 /****************************************************************
  *
  * sbuf.h
@@ -1054,6 +2116,70 @@ TEST_CASE("machine_stats", "[machine_stats]") {
 #endif
 
 
+#include "memory_monitor.h"
+TEST_CASE("memory_monitor", "[machine_stats]") {
+    memory_monitor::sample_t s = memory_monitor::sample();
+#ifndef _WIN32
+    REQUIRE(s.resident > 0);
+#endif
+
+    /* Drive the decisions with a fake sampler */
+    std::filesystem::path fname = NamedTemporaryDirectory() / "monitor.xml";
+    uint64_t rss = 0;
+    uint64_t largest = 1500;            // bytes in the largest histogram
+    bool throttled = false;
+    {
+        dfxml_writer w(fname, false);
+        memory_monitor mm(1000, &w);
+        mm.sampler  = [&rss]() { memory_monitor::sample_t s; s.resident = rss; return s; };
+        mm.spill    = [&largest](uint64_t min_bytes) { return largest >= min_bytes; };
+        mm.evict    = []() { return size_t(0); };
+        mm.throttle = [&throttled](bool t) { throttled = t; };
+
+        rss = 500;
+        mm.check();
+        REQUIRE(mm.spills == 0);
+        rss = 2000;
+        mm.check();
+        REQUIRE(mm.spills == 1);
+        REQUIRE(throttled == false);
+        mm.check();                     // the spill did not help, so move on
+        REQUIRE(mm.spills == 1);
+        REQUIRE(throttled == true);
+        REQUIRE(mm.throttles == 1);
+        rss = 950;                      // under budget but above low water
+        mm.check();
+        REQUIRE(throttled == true);
+        rss = 100;
+        mm.check();
+        REQUIRE(throttled == false);
+        REQUIRE(mm.samples == 5);
+
+        rss = 3000;                     // nothing is as large as the overage
+        mm.check();
+        REQUIRE(mm.spills == 1);
+        REQUIRE(throttled == true);
+        rss = 100;
+        mm.check();
+        REQUIRE(throttled == false);
+        rss = 2000;                     // under budget in between, so spilling is tried again
+        mm.check();
+        REQUIRE(mm.spills == 2);
+
+        /* the thread releases producers when it stops */
+        mm.interval = std::chrono::milliseconds(1);
+        mm.start();
+        while (mm.throttles < 3) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        mm.stop();
+        REQUIRE(throttled == false);
+    }
+    int spill_lines = 0;
+    for (const auto& line : getLines(fname)) {
+        if (line.find("action='spill'") != std::string::npos) spill_lines++;
+    }
+    REQUIRE(spill_lines == 2);
+}
+
 /* Just make sure that they can be created and deleted without error.
  * Previously we got errors before we moved the destructor to the .cpp file from the .h file.
  */
@@ -1310,6 +2436,170 @@ TEST_CASE("word_and_context_list", "[feature_recorder]") {
     std::filesystem::remove_all(tmpdir);
 }
 
+/* A stop list with contexts, and probes that hit it, miss it, and miss its contexts */
+static void stop_list_test_fill(word_and_context_list& wcl, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        std::string f = "user" + std::to_string(i) + "@example.com";
+        switch (i % 3) {
+        case 0: wcl.add_fc(f, ""); break;
+        case 1: wcl.add_fc(f, "To: " + f + " (home)"); break;
+        case 2:
+            wcl.add_fc(f, "From: " + f + "\r\n");
+            wcl.add_fc(f, "Cc: " + f + ", ");
+            break;
+        }
+    }
+}
+
+static std::vector<std::pair<std::string, std::string>> stop_list_test_probes(size_t count) {
+    std::vector<std::pair<std::string, std::string>> ret;
+    for (size_t i = 0; i < count; i++) {
+        std::string f = "user" + std::to_string(i % (count / 2)) + "@example.com";
+        switch (i % 5) {
+        case 0: ret.push_back(std::make_pair(f, "To: " + f + " (home)")); break;
+        case 1: ret.push_back(std::make_pair(f, "From: " + f + "\r\nSubject")); break;
+        case 2: ret.push_back(std::make_pair(f, "Bcc: " + f + " (work)")); break;
+        case 3: ret.push_back(std::make_pair(f, "ends with " + f)); break;
+        case 4: ret.push_back(std::make_pair("someone" + std::to_string(i) + "@example.org", "mail someone")); break;
+        }
+    }
+    return ret;
+}
+
+#include "bloom_filter.h"
+TEST_CASE("blocked_bloom_filter", "[feature_recorder]") {
+    blocked_bloom_filter bloom;
+    REQUIRE(bloom.maybe_contains(stop_list_index::hash("anything")) == false);
+    bloom.init(10000);
+    REQUIRE(bloom.bytes() == (10000 * blocked_bloom_filter::DEFAULT_BITS_PER_KEY + 511) / 512 * 64);
+    for (int i = 0; i < 10000; i++) bloom.add(stop_list_index::hash("feature" + std::to_string(i)));
+    size_t missing = 0;
+    size_t false_positives = 0;
+    for (int i = 0; i < 10000; i++) {
+        if (!bloom.maybe_contains(stop_list_index::hash("feature" + std::to_string(i)))) missing++;
+        if (bloom.maybe_contains(stop_list_index::hash("absent" + std::to_string(i)))) false_positives++;
+    }
+    REQUIRE(missing == 0);
+    REQUIRE(false_positives < 300);
+    REQUIRE(bloom.false_positive_rate() > 0.0);
+    REQUIRE(bloom.false_positive_rate() < 0.03);
+}
+
+#include "stop_list_index.h"
+TEST_CASE("stop_list_index", "[feature_recorder]") {
+    REQUIRE(stop_list_index::locate("abc", "xxabcxx") == 2);
+    REQUIRE(stop_list_index::locate("abc", "xxabc") == std::string::npos); // like the sliding window
+    REQUIRE(stop_list_index::rsuffix_equal("ab", "xab"));
+    REQUIRE(!stop_list_index::rsuffix_equal("ab", "xac"));
+
+    /* The index must give the same answers as the uncompiled list */
+    word_and_context_list plain;
+    word_and_context_list compiled;
+    stop_list_test_fill(plain, 3000);
+    stop_list_test_fill(compiled, 3000);
+    plain.add_regex("special[0-9]+@example\\.net");
+    compiled.add_regex("special[0-9]+@example\\.net");
+    compiled.compile();
+    REQUIRE(!plain.is_compiled());
+    REQUIRE(compiled.is_compiled());
+
+    size_t hits = 0;
+    size_t mismatches = 0;
+    auto probes = stop_list_test_probes(4000);
+    probes.push_back(std::make_pair("special12@example.net", "x"));
+    for (const auto& p : probes) {
+        bool r1 = plain.check_feature_context(p.first, p.second);
+        bool r2 = compiled.check_feature_context(p.first, p.second);
+        if (r1) hits++;
+        if (r1 != r2) mismatches++;
+        if (plain.check(p.first, "To: ", " (home)") != compiled.check(p.first, "To: ", " (home)")) mismatches++;
+    }
+    REQUIRE(hits > 1000);
+    REQUIRE(hits < probes.size());
+    REQUIRE(mismatches == 0);
+
+    /* a saved index is mapped by readfile() and gives the same answers */
+    auto tmpdir = NamedTemporaryDirectory();
+    std::filesystem::path index_fname = tmpdir / "stoplist.idx";
+    compiled.write_index(index_fname);
+    REQUIRE(stop_list_index::is_index_file(index_fname));
+    word_and_context_list mapped;
+    std::stringstream ss;
+    REQUIRE(mapped.readfile(index_fname, ss) == 0);
+    REQUIRE(mapped.is_mapped());
+    REQUIRE(mapped.size() == compiled.size());
+    mismatches = 0;
+    for (const auto& p : probes) {
+        if (plain.check_feature_context(p.first, p.second) != mapped.check_feature_context(p.first, p.second)) mismatches++;
+    }
+    REQUIRE(mismatches == 0);
+    REQUIRE_THROWS_AS(mapped.add_fc("new@example.com", ""), std::runtime_error);
+
+    /* a damaged index is rejected, whether an offset in it is wrong or it is cut short */
+    stop_list_index::file_header_t hdr;
+    std::ifstream(index_fname, std::ios_base::binary).read(reinterpret_cast<char*>(&hdr), sizeof(hdr));
+    auto align64 = [](size_t n) { return (n + 63) & ~size_t(63); };
+    const size_t slots_pos = align64(sizeof(hdr)) + align64(hdr.n_blocks * 64) + align64(hdr.n_seeds * 4);
+    const size_t entries_pos = slots_pos + align64(hdr.n_slots * sizeof(stop_list_index::slot_t));
+    auto damaged = [&](size_t pos, uint32_t value) {
+        std::filesystem::path fname = tmpdir / "damaged.idx";
+        std::filesystem::copy_file(index_fname, fname, std::filesystem::copy_options::overwrite_existing);
+        std::fstream f(fname, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+        f.seekp(pos);
+        f.write(reinterpret_cast<const char*>(&value), sizeof(value));
+        f.close();
+        stop_list_index index;
+        REQUIRE_THROWS_AS(index.read(fname), stop_list_index::IndexError);
+    };
+    size_t used = 0;                    // a slot that holds a feature
+    while (true) {
+        stop_list_index::slot_t slot;
+        std::ifstream in(index_fname, std::ios_base::binary);
+        in.seekg(slots_pos + used * sizeof(slot));
+        in.read(reinterpret_cast<char*>(&slot), sizeof(slot));
+        if (slot.n_entries > 0) break;
+        used++;
+    }
+    const size_t slot_pos = slots_pos + used * sizeof(stop_list_index::slot_t);
+    damaged(slot_pos + offsetof(stop_list_index::slot_t, feature_off), hdr.arena_bytes);
+    damaged(slot_pos + offsetof(stop_list_index::slot_t, first_entry), hdr.n_entries);
+    damaged(slot_pos + offsetof(stop_list_index::slot_t, n_entries), hdr.n_entries + 1);
+    damaged(entries_pos + offsetof(stop_list_index::entry_t, before_len), hdr.arena_bytes + 1);
+    damaged(entries_pos + sizeof(stop_list_index::entry_t) + offsetof(stop_list_index::entry_t, after_off), UINT32_MAX);
+
+    const size_t full = std::filesystem::file_size(index_fname);
+    for (size_t len : {sizeof(hdr) - 1, sizeof(hdr) + 64, slots_pos + 1, entries_pos + 1, full / 2}) {
+        std::filesystem::resize_file(index_fname, len);
+        word_and_context_list truncated;
+        REQUIRE_THROWS_AS(truncated.readfile(index_fname, ss), stop_list_index::IndexError);
+    }
+    std::filesystem::remove_all(tmpdir);
+
+    /* adding to the list drops the index */
+    compiled.add_fc("new@example.com", "");
+    REQUIRE(!compiled.is_compiled());
+    REQUIRE(compiled.check_feature_context("new@example.com", "a new@example.com b"));
+}
+
+TEST_CASE("stop_list_index_benchmark", "[.][benchmark]") {
+    /* Run with: test_be20_api "[benchmark]" */
+    word_and_context_list wcl;
+    stop_list_test_fill(wcl, 100000);
+    auto probes = stop_list_test_probes(200000);
+    for (int compiled = 0; compiled < 2; compiled++) {
+        if (compiled) wcl.compile();
+        size_t hits = 0;
+        aftimer t;
+        t.start();
+        for (const auto& p : probes) {
+            if (wcl.check_feature_context(p.first, p.second)) hits++;
+        }
+        t.stop();
+        std::cout << "100000 stop list features, " << probes.size() << " probes, "
+                  << (compiled ? "compiled" : "uncompiled") << ": " << t.elapsed_seconds() << "s hits=" << hits << "\n";
+    }
+}
+
 
 /****************************************************************
  * unicode_escape.h
@@ -1351,6 +2641,130 @@ TEST_CASE("unicode_escape", "[unicode]") {
     //REQUIRE_THROWS_AS( validateOrEscapeUTF8( test1, false, false, true), BadUnicode );
 }
 
+/* The byte-at-a-time validateOrEscapeUTF8() that the table-driven one replaced.
+ * It looped forever on bad UTF-8 that was neither escaped nor validated; here, the byte is copied.
+ */
+static std::string validateOrEscapeUTF8_reference(const std::string& input, bool escape_bad_utf8, bool escape_backslash,
+                                                  bool validate) {
+    if (escape_bad_utf8 == false && escape_backslash == false && validate == false) return input;
+    std::string output;
+    for (size_t i = 0; i < input.length();) {
+        uint8_t ch = (uint8_t)input.at(i);
+        if ((ch & 0x80) == 0x00) {
+            if ((ch == '\\' && escape_backslash) || ch < ' ') {
+                output += octal_escape(ch);
+            } else {
+                output += ch;
+            }
+            i++;
+            continue;
+        }
+        if (((ch & 0xe0) == 0xc0) && (i + 1 < input.length()) && utf8cont((uint8_t)input.at(i + 1))) {
+            uint32_t unichar = ((ch & 0x1f) << 6) | (((uint8_t)input.at(i + 1) & 0x3f));
+            if (valid_utf8codepoint(unichar) && ch != 0xc0 && (unichar >= 0x80)) {
+                output += input.substr(i, 2);
+                i += 2;
+                continue;
+            }
+        }
+        if (((ch & 0xf0) == 0xe0) && (i + 2 < input.length()) && utf8cont((uint8_t)input.at(i + 1)) &&
+            utf8cont((uint8_t)input.at(i + 2))) {
+            uint32_t unichar = ((ch & 0x0f) << 12) | (((uint8_t)input.at(i + 1) & 0x3f) << 6) |
+                               (((uint8_t)input.at(i + 2) & 0x3f));
+            if (valid_utf8codepoint(unichar) && unichar >= 0x800) {
+                output += input.substr(i, 3);
+                i += 3;
+                continue;
+            }
+        }
+        if (((ch & 0xf8) == 0xf0) && (i + 3 < input.length()) && utf8cont((uint8_t)input.at(i + 1)) &&
+            utf8cont((uint8_t)input.at(i + 2)) && utf8cont((uint8_t)input.at(i + 3))) {
+            uint32_t unichar = (((ch & 0x07) << 18) | (((uint8_t)input.at(i + 1) & 0x3f) << 12) |
+                                (((uint8_t)input.at(i + 2) & 0x3f) << 6) | (((uint8_t)input.at(i + 3) & 0x3f)));
+            if (valid_utf8codepoint(unichar) && unichar >= 0x1000000) {
+                output += input.substr(i, 4);
+                i += 4;
+                continue;
+            }
+        }
+        if (escape_bad_utf8) {
+            output += octal_escape((uint8_t)input.at(i++));
+        } else if (validate) {
+            throw BadUnicode(input);
+        } else {
+            output += input.at(i++);
+        }
+    }
+    return output;
+}
+
+/* Lines of the test corpora, as UTF-8 and as the raw UTF-16 that is bad UTF-8 */
+static std::vector<std::string> unicode_test_lines() {
+    std::vector<std::string> ret;
+    for (const char* fname : {"unilang.htm", "unilang8.htm"}) {
+        std::ifstream in(tests_dir() / fname, std::ios_base::binary);
+        std::string line;
+        while (std::getline(in, line)) ret.push_back(line);
+    }
+    return ret;
+}
+
+TEST_CASE("validateOrEscapeUTF8_table", "[unicode]") {
+    std::vector<std::string> inputs = unicode_test_lines();
+    REQUIRE(inputs.size() > 20);
+    for (const char* s : {"", "plain ascii that is long enough for several words", "tab\there", "back\\slash",
+                          "\xc3\xa9t\xc3\xa9", "\xc0\x80", "\xc1\xbf", "\xe0\x9f\xbf", "\xe0\xa0\x80",
+                          "\xed\x9f\xbf", "\xed\xa0\x80", "\xef\xbf\xbd", "\xef\xbf\xbe", "\xef\xbf\xbf",
+                          "\xf0\x9f\x98\x81", "\xe6\x88", "trailing \xe6", "\x80\xbf continuation", "\x7f del"}) {
+        inputs.push_back(s);
+    }
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    for (int i = 0; i < 2000; i++) {    // random bytes, mostly ASCII
+        std::string r;
+        for (int j = 0; j < i % 40; j++) {
+            x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+            r.push_back((x % 4) ? char(0x20 + (x >> 8) % 0x60) : char(x >> 16));
+        }
+        inputs.push_back(r);
+    }
+
+    size_t mismatches = 0;
+    for (const auto& in : inputs) {
+        for (int flags = 1; flags < 8; flags++) {
+            bool a = flags & 1, b = flags & 2, c = flags & 4;
+            std::string r1, r2;
+            bool t1 = false, t2 = false;
+            try { r1 = validateOrEscapeUTF8_reference(in, a, b, c); } catch (const BadUnicode&) { t1 = true; }
+            try { r2 = validateOrEscapeUTF8(in, a, b, c); } catch (const BadUnicode&) { t2 = true; }
+            if (r1 != r2 || t1 != t2) mismatches++;
+        }
+    }
+    REQUIRE(mismatches == 0);
+    REQUIRE(validateOrEscapeUTF8("\xef\xbf\xbe", true, false, false) == "\\357\\277\\276");
+    REQUIRE_THROWS_AS(validateOrEscapeUTF8("ok\xff", false, false, true), BadUnicode);
+    REQUIRE(validateOrEscapeUTF8("ok\xff", false, true, false) == "ok\xff");
+}
+
+TEST_CASE("validateOrEscapeUTF8_benchmark", "[.][benchmark]") {
+    /* Run with: test_be20_api "[benchmark]" */
+    std::vector<std::string> lines = unicode_test_lines();
+    const int reps = 20000;
+    for (int impl = 0; impl < 2; impl++) {
+        size_t bytes = 0;
+        aftimer t;
+        t.start();
+        for (int r = 0; r < reps; r++) {
+            for (const auto& line : lines) {
+                bytes += (impl ? validateOrEscapeUTF8(line, true, true, true)
+                          : validateOrEscapeUTF8_reference(line, true, true, true)).size();
+            }
+        }
+        t.stop();
+        std::cout << "validateOrEscapeUTF8 over unilang corpora x" << reps << ", "
+                  << (impl ? "table-driven" : "byte at a time") << ": " << t.elapsed_seconds() << "s output bytes=" << bytes << "\n";
+    }
+}
+
 TEST_CASE("unicode_detection1", "[unicode]") {
     auto sb16p = sbuf_t::map_file(tests_dir() / "unilang.htm");
     auto& sb16 = *sb16p;
@@ -1402,6 +2816,105 @@ TEST_CASE("unicode_detection2", "[unicode]") {
     REQUIRE( little_endian == true);
 }
 
+/* The unit-at-a-time conversion through utfcpp, reading the bytes as unsigned */
+static std::string convert_utf16_to_utf8_reference(const std::string& key, bool little_endian) {
+    std::u16string utf16;
+    for (size_t i = 0; i < key.size(); i += 2) {
+        uint8_t a = key[i], b = (i + 1 < key.size()) ? key[i + 1] : 0;
+        utf16.push_back(little_endian ? (a | (b << 8)) : ((a << 8) | b));
+    }
+    std::string ret;
+    utf8::utf16to8(utf16.begin(), utf16.end(), std::back_inserter(ret));
+    ret.erase(std::remove(ret.begin(), ret.end(), '\000'), ret.end());
+    return ret;
+}
+
+TEST_CASE("utf16_transcode", "[unicode]") {
+    std::vector<std::string> inputs = unicode_test_lines();
+    /* sizeof-1 keeps the embedded NULs */
+#define UTF16_INPUT(lit) inputs.push_back(std::string(lit, sizeof(lit) - 1))
+    UTF16_INPUT("h\000i\000 \000t\000h\000e\000r\000e\000");
+    UTF16_INPUT("\000h\000i\000 \000t\000h\000e\000r\000e");
+    UTF16_INPUT("\xff\xfe" "a\000b\000");
+    UTF16_INPUT("\xe9\000t\000\xe9\000t\000\xe9\000");       // low bytes >= 0x80 are not sign extended
+    UTF16_INPUT("\x3d\xd8\x01\xde" "x\000y\000z\000w\000"); // a surrogate pair
+    UTF16_INPUT("\x3d\xd8" "x\000");                       // a high surrogate without its pair
+    UTF16_INPUT("\x01\xde" "x\000");                       // a lone low surrogate
+    UTF16_INPUT("a\000b\000c");                            // odd length
+    UTF16_INPUT("\000\000\000\000a\000\000\000b\000c\000d\000");
+    UTF16_INPUT("\xac\x20\xac\x20\xac\x20\xac\x20\xac\x20");
+#undef UTF16_INPUT
+
+    size_t mismatches = 0;
+    size_t detected = 0;
+    for (const auto& in : inputs) {
+        for (bool le : {true, false}) {
+            std::string r1, r2;
+            bool t1 = false, t2 = false;
+            try { r1 = convert_utf16_to_utf8_reference(in, le); } catch (const utf8::invalid_utf16&) { t1 = true; }
+            try { convert_utf16_to_utf8(in, le, r2); } catch (const utf8::invalid_utf16&) { t2 = true; }
+            if ((t1 != t2) || (!t1 && r1 != r2)) mismatches++;
+        }
+        /* the fused entry point agrees with detection and the returning conversion */
+        bool le = false;
+        std::string out;
+        bool looks = looks_like_utf16(in, le);
+        try {
+            if (utf16_to_utf8_if_utf16(in, out) != looks) mismatches++;
+            if (looks && out != convert_utf16_to_utf8(in, le)) mismatches++;
+            if (looks) detected++;
+        } catch (const utf8::invalid_utf16&) {
+        }
+    }
+    REQUIRE(mismatches == 0);
+    REQUIRE(detected > 0);
+
+    std::string out {"left over"};
+    REQUIRE(utf16_to_utf8_if_utf16("plain ascii", out) == false);
+    REQUIRE(out == "left over");
+    std::string bytes("\xe9\000t\000\xe9\000", 6);
+    REQUIRE(utf16_to_utf8_if_utf16(bytes, out) == true);
+    REQUIRE(out == "\xc3\xa9t\xc3\xa9");
+    REQUIRE(make_utf8(std::string("\x3d\xd8" "x\000y\000", 6)) == "=\\330x\\000y\\000");
+    REQUIRE(utf16_find_nul(reinterpret_cast<const uint8_t*>("a\000b\000c\000d\000e\000\000\000f\000"), 7) == 5);
+    REQUIRE(utf16_find_nul(reinterpret_cast<const uint8_t*>("a\000b\000"), 2) == 2);
+
+    /* getUTF16 stops at U+0000 and at the end of the buffer */
+    const uint8_t u16[] {'a', 0, 'b', 0, 0xe9, 0, 0, 0, 'c', 0, 'd'};
+    sbuf_t sb(pos0_t(), u16, sizeof(u16));
+    REQUIRE(sb.getUTF16(0) == std::wstring(L"ab\u00e9"));
+    REQUIRE(sb.getUTF16(8) == std::wstring(L"c"));
+    REQUIRE(sb.getUTF16(2, 10) == std::wstring(L"b\u00e9\0c", 4));
+    REQUIRE(sb.getUTF16(1, sbuf_t::BO_BIG_ENDIAN) == std::wstring(L"b\u00e9"));
+    REQUIRE(sb.getUTF16(20).empty());
+}
+
+TEST_CASE("utf16_transcode_benchmark", "[.][benchmark]") {
+    /* Run with: test_be20_api "[benchmark]" */
+    auto sb16p = sbuf_t::map_file(tests_dir() / "unilang.htm");
+    std::string utf16 = sb16p->asString();
+    delete sb16p;
+    const int reps = 2000;
+    for (int impl = 0; impl < 2; impl++) {
+        size_t bytes = 0;
+        std::string out;
+        aftimer t;
+        t.start();
+        for (int r = 0; r < reps; r++) {
+            if (impl) {
+                utf16_to_utf8_if_utf16(utf16, out);
+            } else {
+                bool le = false;
+                if (looks_like_utf16(utf16, le)) out = convert_utf16_to_utf8_reference(utf16, le);
+            }
+            bytes += out.size();
+        }
+        t.stop();
+        std::cout << "UTF-16 to UTF-8 of unilang.htm x" << reps << ", "
+                  << (impl ? "word at a time" : "unit at a time") << ": " << t.elapsed_seconds() << "s output bytes=" << bytes << "\n";
+    }
+}
+
 
 TEST_CASE("directory_support", "[utilities]") {
     auto tmpdir = NamedTemporaryDirectory();
@@ -96,9 +96,10 @@ void thread_pool::push_task(const sbuf_t *sbuf, scanner_t *scanner)
     std::unique_lock<std::mutex> lock(M);
     /* In the main thread, make sure there is a free worker before continuing.
      * We don't do this in the worker threads because we want them to clear.
+     * When throttled, also wait for the running work to finish, so that sbufs are not queued faster than memory is freed.
      */
     if (main_thread == std::this_thread::get_id() && scanner==nullptr) {
-        while (freethreads==0){               // if there are no free threads, wait.
+        while (freethreads==0 || (throttled && working_workers > 0)){ // if there are no free threads, wait.
             main_wait_timer.start();
             //TO_WORKER.notify_one();         // if a worker is sleeping, wake it up
             TO_MAIN.wait( lock );
@@ -113,6 +114,13 @@ void thread_pool::push_task(const sbuf_t *sbuf, scanner_t *scanner)
 };
 
 
+void thread_pool::set_throttle(bool throttle_)
+{
+    std::unique_lock<std::mutex> lock(M);
+    throttled = throttle_;
+    TO_MAIN.notify_all();               // a waiting main thread rechecks
+}
+
 void thread_pool::push_task(const sbuf_t *sbuf)
 {
     push_task(sbuf, nullptr);
@@ -91,6 +91,9 @@ public:
     std::atomic<uint64_t>      total_worker_wait_ns {0};
     int                        mode {0}; // 0=running; 1 = waiting for workers to finish; 2=workers should die
     std::atomic<bool>          debug {false}; // display debug messages?
+    std::atomic<bool>          throttled {false}; // if set, the main thread waits for running work before pushing more
+
+    void set_throttle(bool throttle_);  // called by the memory_monitor
 
     thread_pool(scanner_set &ss_);
     ~thread_pool();
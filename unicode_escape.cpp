@@ -24,9 +24,11 @@
  * not subject to copyright.
  */
 
+#include <array>
 #include <cassert>
 //#include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <iterator>
@@ -80,6 +82,66 @@ bool valid_utf8codepoint(uint32_t unichar) {
     return true; // must be valid
 }
 
+namespace {
+/* For each lead byte: the length of the sequence it starts (0 if it cannot start one that is accepted)
+ * and the allowed range of the second byte, as in Table 3-7 of the Unicode Standard. E0 and ED exclude
+ * overlong encodings and surrogates. Four-byte sequences are never accepted (the code point bound in
+ * the byte-at-a-time version that this replaced, 0x1000000, cannot be reached), so F0..F4 are 0.
+ */
+struct utf8_lead_t {
+    uint8_t len;
+    uint8_t lo;
+    uint8_t hi;
+};
+const std::array<utf8_lead_t, 256> UTF8_LEAD = [] {
+    std::array<utf8_lead_t, 256> t {};
+    for (int b = 0xc2; b <= 0xdf; b++) t[b] = {2, 0x80, 0xbf};
+    for (int b = 0xe0; b <= 0xef; b++) t[b] = {3, 0x80, 0xbf};
+    t[0xe0] = {3, 0xa0, 0xbf};
+    t[0xed] = {3, 0x80, 0x9f};
+    return t;
+}();
+
+/* The length of the valid sequence at s, or 0 */
+inline size_t utf8_sequence(const uint8_t* s, size_t n) {
+    const utf8_lead_t& lead = UTF8_LEAD[s[0]];
+    if (lead.len == 0 || n < lead.len || s[1] < lead.lo || s[1] > lead.hi) return 0;
+    if (lead.len == 3) {
+        if (!utf8cont(s[2])) return 0;
+        if (s[0] == 0xef && s[1] == 0xbf && s[2] >= 0xbe) return 0; // U+FFFE and U+FFFF
+    }
+    return lead.len;
+}
+
+/* Skip bytes that are copied as they are: printable ASCII, and backslash if it is not escaped.
+ * Eight bytes are checked at a time; a word that might need attention is then checked bytewise.
+ */
+inline size_t skip_plain_ascii(const uint8_t* s, size_t i, size_t n, bool escape_backslash) {
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, s + i, sizeof(w));
+        uint64_t attention = (w | ((w - ones * 0x20) & ~w)) & highs; // >= 0x80, or < 0x20
+        if (escape_backslash) {
+            uint64_t bs = w ^ (ones * '\\');
+            attention |= (bs - ones) & ~bs & highs;
+        }
+        if (attention) break;
+    }
+    for (; i < n; i++) {
+        uint8_t ch = s[i];
+        if (ch >= 0x80 || ch < ' ' || (ch == '\\' && escape_backslash)) break;
+    }
+    return i;
+}
+
+inline void append_octal_escape(std::string& output, uint8_t ch) {
+    const char esc[4] {'\\', char('0' + (ch >> 6)), char('0' + ((ch >> 3) & 7)), char('0' + (ch & 7))};
+    output.append(esc, sizeof(esc));
+}
+}
+
 /**
  * validateOrEscapeUTF8
  * Input: UTF8 string (possibly corrupt)
@@ -89,6 +151,11 @@ bool valid_utf8codepoint(uint32_t unichar) {
  *    - DO NOT USE wchar_t because it is 16-bits on Windows and 32-bits on Unix.
  * Output:
  *   - UTF8 string.  If do_escape is set, then corruptions are escaped in \xFF notation where FF is a hex character.
+ *
+ * Runs of plain ASCII are skipped eight bytes at a time, and multi-byte sequences are checked with a table
+ * of lead bytes. If nothing needs escaping, the input is returned as it is; otherwise the bytes between
+ * escapes are copied in spans.
+ * If an invalid sequence is neither escaped nor validated, its bytes are copied.
  */
 
 std::string validateOrEscapeUTF8(const std::string& input, bool escape_bad_utf8, bool escape_backslash,
@@ -98,106 +165,109 @@ std::string validateOrEscapeUTF8(const std::string& input, bool escape_bad_utf8,
         return input;
     }
 
-    // validate or escape input
-    std::string output;
-    for (std::string::size_type i = 0; i < input.length();) {
-        uint8_t ch = (uint8_t)input.at(i);
+    const uint8_t* s = reinterpret_cast<const uint8_t*>(input.data());
+    const size_t n = input.size();
+    size_t i = skip_plain_ascii(s, 0, n, escape_backslash);
+    if (i == n) return input;           // the usual case: nothing to escape
 
-        // utf8 1 byte prefix (0xxx xxxx)
-        if ((ch & 0x80) == 0x00) {                // 00 .. 0x7f
-            if (ch == '\\' && escape_backslash) { // escape the escape character as \x92
-                output += octal_escape(ch);
-                i++;
-                continue;
-            }
-
-            if (ch < ' ') { // not printable are escaped
-                output += octal_escape(ch);
+    std::string output;
+    output.reserve(n + 16);
+    size_t span = 0;                    // the first byte that has not been copied to output
+    auto escape = [&](uint8_t ch) {
+        output.append(input, span, i - span);
+        append_octal_escape(output, ch);
+        span = ++i;
+    };
+    while (i < n) {
+        uint8_t ch = s[i];
+        if (ch < 0x80) {
+            if (ch < ' ' || (ch == '\\' && escape_backslash)) { // not printable, or the escape character
+                escape(ch);
+            } else {
                 i++;
-                continue;
             }
-            output += ch; // printable is not escaped
+        } else if (size_t len = utf8_sequence(s + i, n - i)) {
+            i += len;
+        } else if (escape_bad_utf8) {
+            escape(ch);                 // Just escape the next byte and carry on
+        } else if (validateOrEscapeUTF8_validate) {
+            throw BadUnicode(input);
+        } else {
             i++;
-            continue;
         }
+        i = skip_plain_ascii(s, i, n, escape_backslash);
+    }
+    output.append(input, span, n - span);
+    return output;
+}
 
-        // utf8 2 bytes  (110x xxxx) prefix
-        if (((ch & 0xe0) == 0xc0) // 2-byte prefix
-            && (i + 1 < input.length()) && utf8cont((uint8_t)input.at(i + 1))) {
-            uint32_t unichar = (((uint8_t)input.at(i) & 0x1f) << 6) | (((uint8_t)input.at(i + 1) & 0x3f));
-
-            // check for valid 2-byte encoding
-            if (valid_utf8codepoint(unichar) && ((uint8_t)input.at(i) != 0xc0) && (unichar >= 0x80)) {
-                output += (uint8_t)input.at(i++); // byte1
-                output += (uint8_t)input.at(i++); // byte2
-                continue;
-            }
-        }
+namespace {
+inline bool host_little_endian() {
+    const uint16_t one = 1;
+    uint8_t first;
+    memcpy(&first, &one, 1);
+    return first == 1;
+}
 
-        // utf8 3 bytes (1110 xxxx prefix)
-        if (((ch & 0xf0) == 0xe0) && (i + 2 < input.length()) && utf8cont((uint8_t)input.at(i + 1)) &&
-            utf8cont((uint8_t)input.at(i + 2))) {
-            uint32_t unichar = (((uint8_t)input.at(i) & 0x0f) << 12) | (((uint8_t)input.at(i + 1) & 0x3f) << 6) |
-                               (((uint8_t)input.at(i + 2) & 0x3f));
-
-            // check for a valid 3-byte code point
-            if (valid_utf8codepoint(unichar) && unichar >= 0x800) {
-                output += (uint8_t)input.at(i++); // byte1
-                output += (uint8_t)input.at(i++); // byte2
-                output += (uint8_t)input.at(i++); // byte3
-                continue;
-            }
-        }
+/* 0x80 in each byte of w that is zero, and nowhere else */
+inline uint64_t zero_bytes(uint64_t w) {
+    const uint64_t lows = 0x7f7f7f7f7f7f7f7fULL;
+    return ~(((w & lows) + lows) | w | lows);
+}
 
-        // utf8 4 bytes (1111 0xxx prefix)
-        if (((ch & 0xf8) == 0xf0) && (i + 3 < input.length()) && utf8cont((uint8_t)input.at(i + 1)) &&
-            utf8cont((uint8_t)input.at(i + 2)) && utf8cont((uint8_t)input.at(i + 3))) {
-            uint32_t unichar = ((((uint8_t)input.at(i) & 0x07) << 18) | (((uint8_t)input.at(i + 1) & 0x3f) << 12) |
-                                (((uint8_t)input.at(i + 2) & 0x3f) << 6) | (((uint8_t)input.at(i + 3) & 0x3f)));
-
-            if (valid_utf8codepoint(unichar) && unichar >= 0x1000000) {
-                output += (uint8_t)input.at(i++); // byte1
-                output += (uint8_t)input.at(i++); // byte2
-                output += (uint8_t)input.at(i++); // byte3
-                output += (uint8_t)input.at(i++); // byte4
-                continue;
-            }
-        }
+/* the number of bytes of m that are 0x80 */
+inline unsigned count_marks(uint64_t m) {
+    return ((m >> 7) * 0x0101010101010101ULL) >> 56;
+}
 
-        if (escape_bad_utf8) {
-            // Just escape the next byte and carry on
-            output += octal_escape((uint8_t)input.at(i++));
-        } else {
-            // fatal if we are debug pedantic, otherwise just ignore
-            // note: we shouldn't be here anyway, since if we are not escaping and we are not
-            // pedantic we should have returned above
-            if (validateOrEscapeUTF8_validate) {
-                throw BadUnicode(input);
-            }
-        }
+inline void append_utf8(std::string& out, uint32_t cp) {
+    if (cp < 0x80) {
+        out.push_back(char(cp));
+    } else if (cp < 0x800) {
+        const char b[2] {char(0xc0 | (cp >> 6)), char(0x80 | (cp & 0x3f))};
+        out.append(b, 2);
+    } else if (cp < 0x10000) {
+        const char b[3] {char(0xe0 | (cp >> 12)), char(0x80 | ((cp >> 6) & 0x3f)), char(0x80 | (cp & 0x3f))};
+        out.append(b, 3);
+    } else {
+        const char b[4] {char(0xf0 | (cp >> 18)), char(0x80 | ((cp >> 12) & 0x3f)), char(0x80 | ((cp >> 6) & 0x3f)),
+                         char(0x80 | (cp & 0x3f))};
+        out.append(b, 4);
     }
-    return output;
+}
 }
 
-bool looks_like_utf16(const std::string& str, bool& little_endian) {
+/* NULs in the even and odd bytes are counted eight bytes at a time; as soon as both have been seen,
+ * the string cannot be UTF-16.
+ */
+bool looks_like_utf16(std::string_view str, bool& little_endian) {
     /* first check for BOMs */
-    if (static_cast<uint8_t>(str[0]) == 0xff && static_cast<uint8_t>(str[1]) == 0xfe) {
+    if (str.size() >= 2 && static_cast<uint8_t>(str[0]) == 0xff && static_cast<uint8_t>(str[1]) == 0xfe) {
         little_endian = true;
         return true; // begins with FFFE
     }
-    if (static_cast<uint8_t>(str[0]) == 0xfe && static_cast<uint8_t>(str[1]) == 0xff) {
+    if (str.size() >= 2 && static_cast<uint8_t>(str[0]) == 0xfe && static_cast<uint8_t>(str[1]) == 0xff) {
         little_endian = false;
         return true; // begins with FEFF
     }
     /* If none of the even characters are NULL and some of the odd
      * characters are NULL, it's UTF-16
      */
+    const uint64_t even_bytes = host_little_endian() ? 0x0080008000800080ULL : 0x8000800080008000ULL;
     uint32_t even_null_count = 0;
     uint32_t odd_null_count = 0;
-    for (size_t i = 0; i + 1 < str.size(); i += 2) {
+    size_t i = 0;
+    for (; i + 8 <= str.size(); i += 8) {
+        uint64_t w;
+        memcpy(&w, str.data() + i, sizeof(w));
+        const uint64_t z = zero_bytes(w);
+        even_null_count += count_marks(z & even_bytes);
+        odd_null_count += count_marks(z & ~even_bytes);
+        if (even_null_count > 0 && odd_null_count > 0) return false;
+    }
+    for (; i + 1 < str.size(); i += 2) {
         if (str[i] == 0)     even_null_count++;
         if (str[i + 1] == 0) odd_null_count++;
-        /* TODO: Should we look for FFFE or FEFF and act accordingly ? */
     }
     if (even_null_count == 0 && odd_null_count > 1) {
         little_endian = true;
@@ -211,47 +281,95 @@ bool looks_like_utf16(const std::string& str, bool& little_endian) {
 }
 
 /**
- * Converts a utf16 with a byte order to utf8.
- *
+ * Converts a utf16 with a byte order to utf8, straight from the bytes.
+ * Runs of four ASCII code units are converted eight bytes at a time.
+ * A missing last byte is taken to be 0, and U+0000 is dropped.
  */
-/* static */
-std::string convert_utf16_to_utf8(const std::string& key, bool little_endian) {
-    /* re-image this string as UTF16*/
-    std::u16string utf16;
-    for (size_t i = 0; i < key.size(); i += 2) {
-        if (little_endian)
-            utf16.push_back(key[i] | (key[i + 1] << 8));
-        else
-            utf16.push_back(key[i] << 8 | (key[i + 1]));
-    }
-    /* Now convert it to a UTF-8;
-     * set tempKey to be the utf-8 string that will be erased.
-     */
-    std::string tempKey;
-    utf8::utf16to8(utf16.begin(), utf16.end(), std::back_inserter(tempKey));
-    /* Erase any nulls if present */
-    while (tempKey.size() > 0) {
-        size_t nullpos = tempKey.find('\000');
-        if (nullpos == std::string::npos) break;
-        tempKey.erase(nullpos, 1);
+void convert_utf16_to_utf8(std::string_view key, bool little_endian, std::string& out) {
+    out.clear();
+    out.reserve(key.size() / 2 + 16);
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(key.data());
+    const size_t n = key.size();
+    /* in each 16-bit lane of a word: the high byte, and the top bit of the low byte */
+    const uint64_t non_ascii = (little_endian == host_little_endian()) ? 0xff80ff80ff80ff80ULL : 0x80ff80ff80ff80ffULL;
+    const size_t lo = little_endian ? 0 : 1; // offset of the low byte of a code unit
+    auto unit = [&](size_t k) -> uint16_t {
+        const uint8_t a = p[k];
+        const uint8_t b = (k + 1 < n) ? p[k + 1] : 0;
+        return little_endian ? (a | (b << 8)) : ((a << 8) | b);
+    };
+    for (size_t i = 0; i < n;) {
+        if (i + 8 <= n) {
+            uint64_t w;
+            memcpy(&w, p + i, sizeof(w));
+            if ((w & non_ascii) == 0 && p[i + lo] && p[i + 2 + lo] && p[i + 4 + lo] && p[i + 6 + lo]) {
+                const char c[4] {char(p[i + lo]), char(p[i + 2 + lo]), char(p[i + 4 + lo]), char(p[i + 6 + lo])};
+                out.append(c, 4);
+                i += 8;
+                continue;
+            }
+        }
+        uint32_t cp = unit(i);
+        i += 2;
+        if (cp >= 0xd800 && cp <= 0xdbff) { // high surrogate
+            if (i >= n) throw utf8::invalid_utf16(cp);
+            const uint16_t trail = unit(i);
+            if (trail < 0xdc00 || trail > 0xdfff) throw utf8::invalid_utf16(trail);
+            i += 2;
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (trail - 0xdc00);
+        } else if (cp >= 0xdc00 && cp <= 0xdfff) {
+            throw utf8::invalid_utf16(cp);
+        }
+        if (cp != 0) append_utf8(out, cp);
     }
-    return tempKey;
 }
 
-std::string convert_utf16_to_utf8(const std::string& key) {
+std::string convert_utf16_to_utf8(const std::string& key, bool little_endian) {
+    std::string out;
+    convert_utf16_to_utf8(key, little_endian, out);
+    return out;
+}
+
+bool utf16_to_utf8_if_utf16(std::string_view str, std::string& out) {
     bool little_endian = false;
-    if (looks_like_utf16(key, little_endian)) {
-        return convert_utf16_to_utf8(key, little_endian);
-    }
+    if (!looks_like_utf16(str, little_endian)) return false;
+    convert_utf16_to_utf8(str, little_endian, out);
+    return true;
+}
+
+std::string convert_utf16_to_utf8(const std::string& key) {
+    std::string out;
+    if (utf16_to_utf8_if_utf16(key, out)) return out;
     throw utf8::invalid_utf16(0);
 }
 
-std::string make_utf8(const std::string& str) {
+void make_utf8(const std::string& str, std::string& out) {
     try {
-        return convert_utf16_to_utf8(str);
+        if (utf16_to_utf8_if_utf16(str, out)) return;
     } catch (const utf8::invalid_utf16&) {
-        return validateOrEscapeUTF8(str, true, true, true);
     }
+    out = validateOrEscapeUTF8(str, true, true, true);
+}
+
+std::string make_utf8(const std::string& str) {
+    std::string out;
+    make_utf8(str, out);
+    return out;
+}
+
+/* Four code units (eight bytes) at a time; both bytes of a U+0000 are zero in either byte order */
+size_t utf16_find_nul(const uint8_t* p, size_t nunits) {
+    size_t k = 0;
+    for (; k + 4 <= nunits; k += 4) {
+        uint64_t w;
+        memcpy(&w, p + k * 2, sizeof(w));
+        const uint64_t z = zero_bytes(w);
+        if (z & (z >> 8) & 0x0080008000800080ULL) break;
+    }
+    for (; k < nunits; k++) {
+        if (p[k * 2] == 0 && p[k * 2 + 1] == 0) return k;
+    }
+    return nunits;
 }
 
 /*
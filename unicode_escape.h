@@ -13,6 +13,7 @@
 #include <iostream>
 #include <locale>
 #include <string>
+#include <string_view>
 
 #include "utf8.h"
 
@@ -53,7 +54,7 @@ public:
 std::string validateOrEscapeUTF8(const std::string& input, bool escape_bad_UTF8, bool escape_backslash, bool validate);
 
 /* Guess if this is valid utf16 and return likely endian */
-bool looks_like_utf16(const std::string& str, bool& little_endian);
+bool looks_like_utf16(std::string_view str, bool& little_endian);
 
 /* These return the string. If no conversion is possible,
  * they throw const utf8::invalid_utf16.
@@ -63,6 +64,13 @@ bool looks_like_utf16(const std::string& str, bool& little_endian);
 std::string convert_utf16_to_utf8(const std::string& str, bool little_endian); // request specific conversion
 std::string convert_utf16_to_utf8(const std::string& str);                     // guess for best
 
+/* The same, into a caller's buffer, which is replaced; no intermediate strings are made */
+void convert_utf16_to_utf8(std::string_view str, bool little_endian, std::string& out);
+/* looks_like_utf16() and convert_utf16_to_utf8() in one call; returns false, and leaves out alone, if str is not utf16 */
+bool utf16_to_utf8_if_utf16(std::string_view str, std::string& out);
+/* The index of the first U+0000 in nunits code units at p, or nunits */
+size_t utf16_find_nul(const uint8_t* p, size_t nunits);
+
 // std::u32string convert_utf16_to_utf32(const std::string &str,bool little_endian); // request specific conversion
 
 // std::u32string convert_utf8_to_utf32(const std::string &str);
@@ -71,6 +79,7 @@ std::string convert_utf16_to_utf8(const std::string& str);                     /
 std::u32string convert_utf16_to_utf32(const std::string& str);
 std::u16string convert_utf32_to_utf16(const std::u32string& str);
 std::string make_utf8(const std::string& str); // returns valid, escaped UTF8 for utf8 or utf16
+void make_utf8(const std::string& str, std::string& out); // into a caller's buffer
 
 inline const std::u32string utf32_lowercase(const std::u32string& str) {
     std::u32string output;
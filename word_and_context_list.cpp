@@ -6,21 +6,43 @@
 #include "config.h"
 #include <cinttypes>
 #include <iostream>
+#include <sstream>
 
 #include "word_and_context_list.h"
 
 void word_and_context_list::add_regex(const std::string& pat) { patterns.push_back(pat); }
 
+/* The index holds copies of the features and contexts, so fcmap may change afterwards */
+void word_and_context_list::compile() {
+    if (index.is_mapped()) return;      // it is already compiled, and fcmap is empty
+    std::vector<stop_list_index::input_t> inputs;
+    inputs.reserve(fcmap.size());
+    for (const auto& it : fcmap) {
+        inputs.push_back(stop_list_index::input_t{it.second.feature, it.second.before, it.second.after});
+    }
+    index.build(inputs);
+    compiled = true;
+}
+
+void word_and_context_list::write_index(const std::filesystem::path path) {
+    if (!compiled) compile();
+    std::stringstream ss;
+    patterns.dump(ss);
+    index.write(path, ss.str());
+}
+
 /**
  * Insert a feature and context, but only if not already present.
  * Returns true if added.
  */
 bool word_and_context_list::add_fc(const std::string& f, const std::string& c) {
+    if (index.is_mapped()) throw std::runtime_error("cannot add to a stop list read from an index");
     context ctx(f, c); // ctx includes feature, before and after
 
     if (c.size() > 0 && context_set.find(c) != context_set.end()) return false; // already present
     context_set.insert(c);                                                      // now we've seen it.
     fcmap.insert(std::pair<std::string, context>(f, ctx));
+    compiled = false;
     return true;
 }
 
@@ -29,6 +51,26 @@ returns 0 if success, -1 if fail. */
 int word_and_context_list::readfile(const std::filesystem::path path, std::ostream &os) {
     std::ifstream i( path );
     if (!i.is_open()) return -1;
+    if (stop_list_index::is_index_file(path)) {
+        if (compiled || fcmap.size() > 0) throw std::runtime_error("a stop list index must be read first");
+        i.close();
+        os << "Mapping stop list index " << path << "\n";
+        std::string_view pats = index.read(path);
+        for (size_t start = 0; start < pats.size();) {
+            size_t end = pats.find('\n', start);
+            if (end == std::string_view::npos) end = pats.size();
+            if (end > start) patterns.push_back(std::string(pats.substr(start, end - start)));
+            start = end + 1;
+        }
+        compiled = true;
+        os << "Stop list index mapped.\n";
+        os << "  List Size: " << index.size() << "\n";
+        os << "  Regular Expressions: " << patterns.size() << "\n";
+        os << "  Index: " << index.features() << " features in " << index.bytes() << " bytes\n";
+        os << "  Bloom filter false positive rate " << index.bloom_false_positive_rate() * 100.0 << "%\n";
+        return 0;
+    }
+    if (index.is_mapped()) throw std::runtime_error("cannot add to a stop list read from an index");
     os << "Reading context stop list " << path << "\n";
     std::string line;
     uint64_t total_context = 0;
@@ -68,21 +110,29 @@ int word_and_context_list::readfile(const std::filesystem::path path, std::ostre
             fcmap.insert(std::pair<std::string, context>(line, context(line)));
         }
     }
+    compile();
     os << "Stop list read.\n";
     os << "  Total features read: " << features_read << " in " << line_counter << " lines.\n";
     os << "  List Size: " << fcmap.size() << "\n";
     os << "  Context Strings: " << total_context << "\n";
     os << "  Regular Expressions: " << patterns.size() << "\n";
+    os << "  Index: " << index.features() << " features in " << index.bytes() << " bytes\n";
+    os << "  Bloom filter false positive rate " << index.bloom_false_positive_rate() * 100.0 << "%\n";
     return 0;
 }
 
 /** check() is threadsafe. */
 bool word_and_context_list::check(const std::string& probe, const std::string& before, const std::string& after) const {
     /* First check literals, because they are faster */
-    for (stopmap_t::const_iterator it = fcmap.find(probe); it != fcmap.end(); it++) {
-        if ((rstrcmp((*it).second.before, before) == 0) && (rstrcmp((*it).second.after, after) == 0) &&
-            ((*it).second.feature == probe)) {
-            return true;
+    if (compiled) {
+        if (index.check(probe, before, after)) return true;
+    } else {
+        auto range = fcmap.equal_range(probe);
+        for (stopmap_t::const_iterator it = range.first; it != range.second; it++) {
+            if ((rstrcmp((*it).second.before, before) == 0) && (rstrcmp((*it).second.after, after) == 0) &&
+                ((*it).second.feature == probe)) {
+                return true;
+            }
         }
     }
 
@@ -91,6 +141,9 @@ bool word_and_context_list::check(const std::string& probe, const std::string& b
 };
 
 bool word_and_context_list::check_feature_context(const std::string& probe, const std::string& context) const {
+    if (compiled) {
+        return index.check_feature_context(probe, context) || patterns.search_all(probe, nullptr);
+    }
     std::string before;
     std::string after;
     context::extract_before_after(probe, context, before, after);
@@ -99,18 +152,32 @@ bool word_and_context_list::check_feature_context(const std::string& probe, cons
 
 void word_and_context_list::dump(std::ostream &os) {
     os << "dump context list:\n";
+    if (index.is_mapped()) index.dump(os);
     for (auto const& it : fcmap) { os << it.first << " = " << it.second << "\n"; }
     os << "dump RE list:\n";
     patterns.dump(os);
 }
 
 #ifdef STAND
+/* word_and_context_list [-o index] list... : dump the lists, or compile them into an index */
 int main(int argc, char** argv) {
-    cout << "testing contxt_list\n";
+    std::string index_fname;
+    if (argc > 2 && std::string(argv[1]) == "-o") {
+        index_fname = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
     word_and_context_list cl;
     while (--argc) {
         argv++;
-        if (cl.readfile(*argv)) { err(1, "Cannot read %s", *argv); }
+        if (cl.readfile(*argv)) {
+            std::cerr << "Cannot read " << *argv << "\n";
+            exit(1);
+        }
+    }
+    if (index_fname.size() > 0) {
+        cl.write_index(index_fname);
+        exit(0);
     }
     cl.dump();
     exit(1);
@@ -20,6 +20,15 @@
  * The stop list contains is a map of features that are stopped.
  * For each feature, there may be no context or a list of context.
  * If there is no context and the feature is in the list,
+ *
+ * readfile() compiles the features and contexts into a stop_list_index, which the checks use
+ * without allocating. In front of the index is a blocked Bloom filter of the features, so most features
+ * that are not on the list are rejected with one cache miss; only then are the regular expressions run.
+ * Adding to the list afterwards drops the index until compile() is called again.
+ *
+ * write_index() saves the compiled list. Given such a file, readfile() maps it instead of parsing a
+ * text list, and the list is then read-only. To compile a list, build this file with -DSTAND and run
+ *     word_and_context_list -o stoplist.idx stoplist.txt
  */
 
 /*
@@ -37,20 +46,17 @@
 #include <filesystem>
 
 #include "regex_vector.h"
+#include "stop_list_index.h"
 
 class context {
 public:
     static void extract_before_after(const std::string& feature, const std::string& ctx, std::string& before,
                                      std::string& after) {
-        if (feature.size() <= ctx.size()) {
-            /* The most simple algorithm is a sliding window */
-            for (size_t i = 0; i < ctx.size() - feature.size(); i++) {
-                if (ctx.substr(i, feature.size()) == feature) {
-                    before = ctx.substr(0, i);
-                    after = ctx.substr(i + feature.size());
-                    return;
-                }
-            }
+        size_t i = stop_list_index::locate(feature, ctx);
+        if (i != std::string::npos) {
+            before = ctx.substr(0, i);
+            after = ctx.substr(i + feature.size());
+            return;
         }
         before.clear(); // can't be done
         after.clear();
@@ -89,6 +95,9 @@ private:
 
     regex_vector patterns;
 
+    stop_list_index index;
+    bool compiled {false};
+
 public:
     /**
      * rstrcmp is like strcmp, except it compares std::strings right-aligned
@@ -96,11 +105,16 @@ public:
      */
     static int rstrcmp(const std::string& a, const std::string& b);
 
-    word_and_context_list() : fcmap(), context_set(), patterns() {}
-    size_t size() { return fcmap.size() + patterns.size(); }
+    word_and_context_list() : fcmap(), context_set(), patterns(), index() {}
+    size_t size() { return (index.is_mapped() ? index.size() : fcmap.size()) + patterns.size(); }
     void add_regex(const std::string& pat);                  // not threadsafe
     bool add_fc(const std::string& f, const std::string& c); // not threadsafe
     int readfile(const std::filesystem::path path, std::ostream& os = std::cout); // readfile with stats to os
+    void compile();                                          // build the index; not threadsafe
+    bool is_compiled() const { return compiled; }
+    bool is_mapped() const { return index.is_mapped(); }     // read from an index file
+    double bloom_false_positive_rate() const { return index.bloom_false_positive_rate(); }
+    void write_index(const std::filesystem::path path);      // compiles the list if it is not compiled
 
     // return true if the probe with context is in the list or in the stopmap
     bool check(const std::string& probe, const std::string& before, const std::string& after) const; // threadsafe